@@ -19,21 +19,36 @@
 #include "Utility/LoadStoreNumbering.h"
 #include "Utility/PostDominanceFrontier.h"
 
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Pass.h"
 #include "llvm/InstVisitor.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/Support/CallSite.h"
 
 #include <deque>
+#include <map>
 #include <set>
 #include <unordered_set>
+#include <vector>
 
 using namespace dg;
 using namespace llvm;
 
 namespace giri {
 
+class StaticSlice;
+
+/// Find the slicing criteria given by -criterion-loc or -criterion-inst, or
+/// the first return of main if neither is given. The criterion of a source
+/// line is its last instruction. Both the dynamic and the static slice use
+/// these criteria. Errors are reported to errs().
+/// \return false if the criterion file cannot be opened.
+bool findSlicingCriteria(Module &M, std::vector<Instruction *> &Criteria);
+
 /// This class defines an LLVM function pass that instruments a program to
 /// generate a trace of its execution usable for dynamic slicing.
 class TracingNoGiri : public BasicBlockPass,
@@ -47,7 +62,9 @@ public:
   /// prototypes for the dynamic slicing functionality here.
   virtual bool doInitialization(Module &M);
   virtual bool doFinalization(Module &M) { return false; }
-  virtual bool doInitialization(Function &F) { return false; }
+  /// This method allocates the slots of the batched records of the function
+  /// when the accesses are batched (-trace-batch-blocks).
+  virtual bool doInitialization(Function &F);
   virtual bool doFinalization(Function &F) { return false; }
 
   /// This method starts execution of the dynamic slice tracing instrumentation
@@ -55,24 +72,23 @@ public:
   /// blocks.
   virtual bool runOnBasicBlock(BasicBlock &BB);
 
-  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
-    AU.addRequired<DataLayout>();
-    AU.addRequired<QueryBasicBlockNumbers>();
-    AU.addPreserved<QueryBasicBlockNumbers>();
-
-    AU.addRequired<QueryLoadStoreNumbers>();
-    AU.addPreserved<QueryLoadStoreNumbers>();
-    AU.setPreservesCFG();
-  };
+  /// The loop analyses are only required with -trace-strided, and the static
+  /// slice with -trace-slice, so the analysis usage depends on the command
+  /// line.
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
   /// Visit a load instruction. This method instruments the load instruction
   /// with a call to the tracing run-time that will record, in the dynamic
-  /// trace, the memory read by this load instruction.
+  /// trace, the memory read by this load instruction. Loads of allocas whose
+  /// address does not escape, strided loads, and loads outside the static
+  /// slice with -trace-slice, are not instrumented.
   void visitLoadInst(LoadInst &LI);
 
   /// Visit a store instruction. This method instruments the store instruction
   /// with a call to the tracing run-time that will record, in the dynamic
-  /// trace, the memory written by this store instruction.
+  /// trace, the memory written by this store instruction. Stores to allocas
+  /// whose address does not escape, strided stores, and stores outside the
+  /// static slice with -trace-slice, are not instrumented.
   void visitStoreInst(StoreInst &SI);
 
   /// Visit a call instruction. For most call instructions, we will instrument
@@ -86,7 +102,8 @@ public:
   /// Visit a select instruction.  This method instruments the select
   /// instruction with a call to the tracing run-time that will record, in the
   /// dynamic trace, the boolean value that the select instruction will use to
-  /// select its output operand.
+  /// select its output operand. With -trace-slice, only the selects in the
+  /// static slice are instrumented.
   void visitSelectInst(SelectInst &SI);
 
   /// Examine a call instruction and see if it is a call to an external function
@@ -98,11 +115,22 @@ public:
   /// otherwise false.
   bool visitSpecialCall(CallInst &CI);
 
+  /// Examine a call instruction and see if it calls one of the pthread
+  /// functions which synchronize threads. If so, instrument it with the calls
+  /// to the run-time which record the synchronization operations.
+  ///
+  /// \param CI - The call instruction which may synchronize threads.
+  /// \param name - The name of the called function.
+  /// \return true if the call synchronizes threads, otherwise false.
+  bool visitSyncCall(CallInst &CI, const std::string &name);
+
 private:
   // Pointers to other passes
   const DataLayout *TD;
   const QueryBasicBlockNumbers *bbNumPass;
   const QueryLoadStoreNumbers  *lsNumPass;
+  const StaticSlice *SlicePass;
+  ScalarEvolution *SE;
 
   // Functions for recording events during execution
   Function *RecordBB;
@@ -122,6 +150,12 @@ private:
   Function *Init;
   Function *RecordLock;
   Function *RecordUnlock;
+  Function *RecordSync;
+  Function *RecordBatch;
+  Function *RecordBlockBatch;
+  Function *RecordStrided;
+  Function *RecordFunctionEntry;
+  Function *RecordBranch;
 
   // Integer types
   // Removed const modifier since method signatures have changed
@@ -130,6 +164,19 @@ private:
   Type *Int64Type;
   Type *VoidType;
   Type *VoidPtrType;
+  Type *VoidPtrPtrType;
+  StructType *BatchRecordType;
+
+  /// The slots of the batched records of the current function, or NULL
+  AllocaInst *BatchSlots;
+
+  /// The static parts (BatchRecord) of the records of the current basic
+  /// block which are not yet recorded
+  std::vector<Constant *> BatchRecords;
+
+  /// The loads and stores of the current function which are recorded by
+  /// strided access records
+  std::set<const Instruction *> StridedAccesses;
 
 private:
   /// Instrument the unlock function for load/store instructions
@@ -140,14 +187,63 @@ private:
   /// This should insert a function call after the I;
   void instrumentUnlock(Instruction *I);
 
+  /// Record a synchronization operation of the call CI on the object. The
+  /// record is inserted before the call, or after the instruction After if it
+  /// is not null.
+  /// \return the last instruction inserted.
+  Instruction *instrumentSync(CallInst &CI,
+                              unsigned kind,
+                              Value *Object,
+                              Instruction *After);
+
   /// Instrument the function to record it's thread id, if it is a function
   /// started from pthread_create
   void instrumentPthreadCreatedFunctions(Function *F);
 
   /// This method instruments a basic block so that it records its execution at
-  /// run-time.
+  /// run-time. With -trace-branches, the basic block records the entry of its
+  /// function if it is the entry block, and the outcome of its terminator.
   void instrumentBasicBlock(BasicBlock &BB);
 
+  /// Record the outcome of the terminator of the basic block, unless it has
+  /// a single successor or none.
+  void instrumentBranch(BasicBlock &BB);
+
+  /// Record the call and the return of the call instruction with the record
+  /// function RecordFn (RecordCall or RecordExtCall).
+  void instrumentCall(CallInst &CI, Function *RecordFn);
+
+  /// Return true if the instruction is in the static slice of the slicing
+  /// criteria, or if the accesses are not restricted to it (-trace-slice).
+  bool inSlice(Instruction &I);
+
+  /// Return true if the instruction is recorded in a batch.
+  bool isBatched(Instruction &I);
+
+  /// Store the value of a record into the next slot of the batch before the
+  /// instruction I, and add the static part of the record to the batch.
+  void addToBatch(Instruction *I, RecordType type, Value *V, uint64_t length);
+
+  /// Append the arguments of a batched run-time call before the instruction I
+  /// to args: the static parts of the pending records, their slots and their
+  /// number. No record is pending afterwards.
+  void takeBatch(Instruction *I, std::vector<Value *> &args);
+
+  /// Record the pending records of the batch before the instruction I.
+  void flushBatch(Instruction *I);
+
+  /// Find the loads and stores of the innermost loops of the function whose
+  /// address advances by a constant stride in every iteration, and record
+  /// each of them once per execution of its loop, in the loop preheader.
+  /// They are added to StridedAccesses.
+  void instrumentStridedAccesses(Function &F);
+
+  /// Add the strided accesses of the basic block BB of loop L to
+  /// StridedAccesses, and record them before the terminator of the
+  /// preheader of L, which is executed before every execution of the loop.
+  /// The basic block is executed count times in every execution of the loop.
+  void instrumentStridedAccesses(Loop *L, BasicBlock *BB, const SCEV *Count);
+
   /// Create a global constructor (ctor) function that can be called when the
   /// program starts up.
   void createCtor(Module &M);
@@ -258,6 +354,85 @@ private:
   const QueryLoadStoreNumbers *lsNumPass;
 };
 
+/// This pass finds a conservative static backwards slice of the slicing
+/// criteria given by -criterion-loc or -criterion-inst (or of the first
+/// return of main), following the SSA def-use chains, the stores and calls
+/// which may write the memory read, and the control dependences, across
+/// calls. TracingNoGiri uses it with -trace-slice to record only the loads,
+/// stores and selects which may affect the criteria.
+class StaticSlice : public ModulePass {
+public:
+  static char ID;
+  StaticSlice() : ModulePass(ID) {}
+
+  /// Find the static backwards slice of the slicing criteria.
+  /// \return false - The module was not modified.
+  virtual bool runOnModule(Module &M);
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<AliasAnalysis>();
+    AU.addRequired<PostDominanceFrontier>();
+
+    // This pass is an analysis pass, so it does not modify anything
+    AU.setPreservesAll();
+  };
+
+  /// Return true if the value may affect a slicing criterion.
+  bool contains(const Value *V) const { return Slice.count(V); }
+
+private:
+  /// Find the instructions which may write memory, except the calls of
+  /// defined functions whose writes are found in their bodies, and the call
+  /// sites of the functions.
+  void findWritersAndCalls(Module &M);
+
+  /// Add the value to the slice if it is an instruction or an argument not
+  /// yet in it.
+  void add(Value *V);
+
+  /// Add the values on which the instruction or argument depends.
+  void addDependences(Value *V);
+
+  /// Add the terminators of the basic blocks on which BB is control
+  /// dependent.
+  void addControlDependences(BasicBlock *BB);
+
+  /// Add the instructions which may write the memory read by I.
+  void addMemoryDependences(Instruction *I);
+
+  /// Add the control dependences of the call sites of the function, and of
+  /// the call sites of their functions, which decide whether it is executed.
+  void addCallers(Function *F);
+
+  /// Add the returns of the functions the call site may call.
+  void addReturns(CallSite CS);
+
+  /// Return the call sites which may call the function: its direct call
+  /// sites and, if its address is taken, the indirect ones.
+  std::vector<Instruction *> getCallSites(Function *F);
+
+  AliasAnalysis *AA;
+
+  /// The instructions and arguments in the slice
+  std::set<const Value *> Slice;
+
+  /// The values in the slice whose dependences are not yet added
+  std::deque<Value *> Worklist;
+
+  /// The instructions which may write memory
+  std::vector<Instruction *> Writers;
+
+  /// The direct call sites of each function, and the indirect call sites
+  std::map<Function *, std::vector<Instruction *> > DirectCalls;
+  std::vector<Instruction *> IndirectCalls;
+
+  /// The functions whose callers were added
+  std::set<Function *> Called;
+
+  /// Cache of the basic blocks on which each basic block is control dependent
+  std::map<BasicBlock *, std::vector<BasicBlock *> > ControlDeps;
+};
+
 } // END namespace giri
 
 #endif
@@ -21,35 +21,103 @@
 //===----------------------------------------------------------------------===//
 // Identifiers for record types
 //===----------------------------------------------------------------------===//
-enum class RecordType : unsigned {
+enum class RecordType : unsigned char {
   BBType  = 'B',  // Basic block record
   LDType  = 'L',  // Load record
   STType  = 'S',  // Store record
   CLType  = 'C',  // Call record
   RTType  = 'R',  // Call return record
   ENType  = 'E',  // End record
-  PDType  = 'P'   // Select (predicated) record
+  PDType  = 'P',  // Select (predicated) record
+  THType  = 'T',  // Thread record
+  SYType  = 'Y',  // Synchronization record
+  GPType  = 'G',  // Gap record
+  AFType  = 'A',  // Strided (affine) access record
+  FNType  = 'F',  // Function entry record
+  BRType  = 'O'   // Branch outcomes record
 //static const unsigned char EXType = 'X';  // External Function record
 };
 
+/// The number of record types (see encodeType())
+static const unsigned GIRI_NUM_RECORD_TYPES = 13;
+
+/// The synchronization operations recorded by synchronization records
+/// (SYType).
+///
+/// Every operation either releases or acquires the synchronization object
+/// named by the address of its record. A release record is written before the
+/// operation is performed and an acquire record after it, so in every trace
+/// the release precedes the acquires which observe it. Together with the
+/// thread records, they give readers the happens-before order of the
+/// threads, which orders the memory accesses of data-race free programs
+/// without relying on the order of the records of different threads.
+enum SyncKind : uintptr_t {
+  SK_MutexLock = 1,     ///< A mutex was locked (acquire)
+  SK_MutexUnlock = 2,   ///< A mutex is unlocked (release)
+  SK_CondSignal = 3,    ///< A condition is signalled or broadcast (release)
+  SK_CondWake = 4,      ///< A wait on a condition returned (acquire)
+  SK_ThreadCreate = 5,  ///< A thread is created (release). The address is
+                        ///< the pthread_t * passed to pthread_create()
+  SK_ThreadCreated = 6, ///< pthread_create() returned. The address is the
+                        ///< pthread_t of the new thread, or null if the
+                        ///< call failed
+  SK_ThreadJoin = 7     ///< A thread was joined (acquire). The address is
+                        ///< the pthread_t of the joined thread
+};
+
+/// The reductions of the trace marked by gap records (GPType).
+///
+/// When the trace approaches its size budget (GIRI_TRACE_BUDGET), the run-time
+/// reduces what it records in this order, and writes a gap record whose id is
+/// the new level before the first record affected. The levels only increase,
+/// so every record after a gap is subject to all the reductions up to its
+/// level. The length of a gap record is the size of the trace in bytes when
+/// the reduction started.
+enum TraceGap : unsigned {
+  TG_Coalesced = 1,      ///< Loads and stores are coalesced. Nothing is lost.
+  TG_NoSelects = 2,      ///< Select records are no longer written
+  TG_NoAccesses = 3,     ///< Loads and stores of the functions configured
+                         ///< with GIRI_BUDGET_FUNCTIONS, or of all the
+                         ///< functions, are no longer written
+  TG_Stopped = 4         ///< Nothing but the end of the trace is written
+};
+
+/// The dense index of a thread within the trace.
+///
+/// The run-time assigns the indices in the order in which the threads record
+/// their first event, so the index is also the creation order of the threads
+/// as seen by the trace. Before its first record, every thread writes a thread
+/// record (THType) which maps its index to its pthread_t.
+typedef uint16_t ThreadIndex;
+
 /// \class This is the format for one entry in the tracing log file.
 ///
 /// WARNING:
-///  This size of this data structure must evenly divide both the machine's
-///  page size *and* the size of the in-memory cache of the run-time.  An
-///  assertion in the run-time library verifies that this condition is met.
-///  Therefore, be mindful of this when adding or deleting fields from this
-///  structure. One solution is to adding one padding variable with proper size.
+///  The run-time rounds the size of its in-memory cache to a multiple of both
+///  the machine's page size and the size of this data structure, so keep the
+///  structure small and free of padding when adding or deleting fields.
 struct Entry {
   /// The type of entry
   /// For special external functions like memcpy, memset, it is
   /// type + #elements to transfer
   RecordType type;
 
-  /// The ID of the basic block, or the load/store instruction
-  unsigned id;
+  /// For load/store records, the number of further accesses of the same size
+  /// by the same instruction which were merged into the record, each one
+  /// following the previous one in memory (see GIRI_COALESCE). The length of
+  /// the record covers all of them. The field takes the place of padding.
+  /// For strided access records, it is the size of each access.
+  unsigned char repeat;
+
+  ThreadIndex tid; ///< The index of the thread
 
-  pthread_t tid; ///< The thread ID
+  /// The ID of the basic block, or the load/store instruction.
+  /// For thread records, it is the index of the thread.
+  /// For gap records, it is the TraceGap level.
+  /// For strided access records, it is the ID of the load/store instruction.
+  /// For function entry records, it is the ID of the entry block.
+  /// For branch outcomes records, it is the number of outcome bits.
+  unsigned id;
 
   /// For a load or store, it is the memory address which is read or written.
   /// For special external functions (e.g., memcpy, memset), it is the
@@ -57,31 +125,38 @@ struct Entry {
   /// stores.
   /// Note that we use an integer size that is large enough to hold a pointer.
   /// For Basic block entries, it is overloaded to the address of the function
-  /// it belongs to.
+  /// it belongs to. For thread records, it is the pthread_t of the thread.
+  /// For synchronization records, it is the address of the mutex or the
+  /// condition, or the thread as documented by SyncKind.
+  /// For strided access records, it is the address of the first access.
+  /// For function entry records, it is the address of the function.
+  /// For branch outcomes records, it holds the first 64 outcome bits.
   uintptr_t address;
 
-  /// For load/store records, this holds the size of the memory access in bytes.
+  /// For load/store records, this holds the size of the memory access in bytes,
+  /// or of all the accesses merged into the record.
+  /// For synchronization records, it is the SyncKind of the operation.
+  /// For gap records, it is the size of the trace when the gap began.
+  /// For strided access records, it packs the number of accesses and their
+  /// stride (see stridedLength()).
+  /// For branch outcomes records, it holds the outcome bits after the first
+  /// 64 (see BranchRecordBits).
   /// For last returning basic block of the function, it is overloaded to store
   /// the id of the function call instruction which invokes it.
   uintptr_t length;
 
-  /// Padding to make the Entry size be devided by Page size 
-#ifndef __LP64__
-  char padding[12]; 
-#endif
-
   /// A nice one-line method for initializing the structure
   explicit Entry(RecordType type, unsigned id) :
-    type(type), id(id), tid(0), address(0), length(0) {
+    type(type), repeat(0), tid(0), id(id), address(0), length(0) {
   }
 
   /// A nice one-line constructor for initializing the structure with pointers
   explicit Entry(RecordType type,
                  unsigned id,
-                 pthread_t tid,
+                 ThreadIndex tid,
                  unsigned char *p,
                  uintptr_t length = 0) :
-    type(type), id(id), tid(tid), length(length) {
+    type(type), repeat(0), tid(tid), id(id), length(length) {
     address = reinterpret_cast<uintptr_t>(p);
   }
 
@@ -89,4 +164,284 @@ struct Entry {
   Entry() { }
 };
 
+//===----------------------------------------------------------------------===//
+//                        Segmented trace files
+//===----------------------------------------------------------------------===//
+//
+// By default the run-time writes the trace as a flat array of Entry records
+// terminated by an ENType record. When the run-time buffers records per
+// thread, the trace file instead starts with a TraceHeader and is followed by
+// a sequence of segments. Each segment holds the records flushed by one
+// thread, together with the global sequence number of each record, so that
+// readers can merge the per-thread streams back into one total order.
+//
+// In the compact format (version 2), the records of every segment are encoded
+// with a variable-length encoding (see Giri/TraceEncoding.h). The segments of
+// a compact trace written without per-thread buffers all belong to one stream
+// and carry no sequence numbers; their records are in trace order.
+//
+// The flight recorder of the run-time writes only the window of the last
+// records of the execution (TF_Window). The first segment then holds a
+// synthetic prefix: the thread records, and call records for the functions
+// which were active when the window started.
+//
+// In compressed traces (TF_Compressed), the payload of every segment (its
+// fixed-size or encoded records, and their sequence numbers) is compressed
+// with the block codec of Giri/TraceCompression.h. The compressed block is
+// preceded by the 64-bit size of the payload it decompresses to.
+//
+// Every segment of a trace with summaries (TF_Summaries) ends with a
+// SegmentSummary, which is included in the size of the segment and follows
+// the (possibly compressed) payload. Readers use the summaries to skip whole
+// segments when they search for records which are provably not in them.
+//
+// With per-thread trace files (TF_ThreadFiles), every thread appends its
+// segments to a file of its own, named after the trace file and the index of
+// the thread (<trace>.<index>). Each of these files is a per-thread trace
+// with the same version and flags, but for TF_ThreadFiles. The trace file
+// itself holds only the segments which were not written by a thread, and
+// readers merge the segments of all the files. The thread indices are dense,
+// so the thread files are found by counting up from <trace>.0.
+//
+
+/// The magic string at the beginning of every segmented trace file
+#define GIRI_TRACE_MAGIC "GIRITRC"
+
+/// The version of the segmented trace format with fixed-size records
+static const uint32_t GIRI_TRACE_VERSION = 1;
+
+/// The version of the segmented trace format with variable-length records
+static const uint32_t GIRI_TRACE_VERSION_COMPACT = 2;
+
+/// Flags describing the layout of a segmented trace file
+enum TraceFlags : uint32_t {
+  TF_PerThread = 1u << 0, ///< Segments hold per-thread sequenced records
+  TF_Window = 1u << 1,    ///< The trace holds only the last records of the
+                          ///< execution, after a synthetic prefix
+  TF_Compressed = 1u << 2, ///< The payload of every segment is compressed
+  TF_Summaries = 1u << 3,  ///< Every segment ends with a SegmentSummary
+  TF_ThreadFiles = 1u << 4 ///< The segments of each thread are in a file
+                           ///< of their own
+};
+
+/// \class The header at the beginning of a segmented trace file.
+struct TraceHeader {
+  char magic[8];       ///< GIRI_TRACE_MAGIC
+  uint32_t version;    ///< Version of the trace format
+  uint32_t flags;      ///< Bitwise or of TraceFlags
+  uint32_t entrySize;  ///< sizeof(Entry) of the run-time writing the trace
+  uint32_t headerSize; ///< Offset of the first segment in the file
+};
+
+/// The magic number at the beginning of every segment: "GSEG"
+static const uint32_t GIRI_SEGMENT_MAGIC = 0x47455347;
+
+/// \class The header in front of every segment of a segmented trace file.
+///
+/// In per-thread mode the header is followed by count Entry records and then
+/// by count 64-bit sequence numbers, one for each record. In the compact
+/// format the sequence numbers are encoded along with the records instead.
+/// Segments written without per-thread buffers carry no sequence numbers, and
+/// firstSeq is the index of their first record in the trace. The sequence
+/// numbers of the records in one segment are strictly increasing, and so are
+/// the sequence numbers across the segments written by one thread.
+struct SegmentHeader {
+  uint32_t magic;    ///< GIRI_SEGMENT_MAGIC
+  uint32_t count;    ///< Number of records in the segment
+  uint64_t thread;   ///< The index of the thread which wrote the segment
+  uint64_t firstSeq; ///< Sequence number of the first record
+  uint64_t size;     ///< Size in bytes of the segment following this header
+};
+
+/// Number of 64-bit words of the thread set of a segment summary
+static const unsigned GIRI_SUMMARY_THREAD_WORDS = 4;
+
+/// Number of 64-bit words of the identifier filter of a segment summary
+static const unsigned GIRI_SUMMARY_FILTER_WORDS = 64;
+
+/// \class The summary at the end of every segment of a trace with summaries.
+///
+/// The thread set and the identifier filter are Bloom filters: a clear bit
+/// proves that no record of the segment has the thread or the identifier,
+/// while a set bit may be shared by several of them. See Giri/TraceSummary.h
+/// for how they are built and queried.
+struct SegmentSummary {
+  uint64_t firstSeq;   ///< Sequence number of the first record
+  uint64_t lastSeq;    ///< Sequence number of the last record
+  /// Number of records of each type, by encodeType()
+  uint64_t counts[GIRI_NUM_RECORD_TYPES];
+  uint64_t minAddress; ///< Lowest address read or written by a load or store
+  uint64_t maxAddress; ///< End of the highest range read or written, where
+                       ///< an access of zero bytes counts as one byte
+  /// Bit (tid % 256) is set for the thread of every record
+  uint64_t threads[GIRI_SUMMARY_THREAD_WORDS];
+  /// Bloom filter of the type and id of every record
+  uint64_t ids[GIRI_SUMMARY_FILTER_WORDS];
+};
+
+//===----------------------------------------------------------------------===//
+//                        Execution profile
+//===----------------------------------------------------------------------===//
+//
+// With GIRI_PROFILE set, the run-time writes the execution profile
+// <trace>.profile next to the trace file at exit. It counts the basic block
+// records by the id of the basic block, and the load and store records by the
+// id of the instruction (see QueryLoadStoreNumbers). Only the non-zero
+// counters are written, sorted by type and id.
+//
+
+/// The magic string at the beginning of every execution profile
+#define GIRI_PROFILE_MAGIC "GIRIPRF"
+
+/// The version of the execution profile format
+static const uint32_t GIRI_PROFILE_VERSION = 1;
+
+/// \class The header at the beginning of an execution profile. It is followed
+/// by count ProfileCounter records.
+struct ProfileHeader {
+  char magic[8];     ///< GIRI_PROFILE_MAGIC
+  uint32_t version;  ///< Version of the profile format
+  uint32_t count;    ///< Number of counters following the header
+  uint64_t records;  ///< Number of records written to the trace
+};
+
+/// \class The number of records of one basic block, load or store.
+struct ProfileCounter {
+  uint32_t type;  ///< The RecordType: BBType, LDType or STType
+  uint32_t id;    ///< The id of the basic block or the instruction
+  uint64_t count; ///< Number of records
+};
+
+//===----------------------------------------------------------------------===//
+//                        Batched block records
+//===----------------------------------------------------------------------===//
+//
+// With -trace-batch-blocks, the tracing pass does not call the run-time for
+// every load, store and select. Each of them stores its address (or, for a
+// select, its condition) into a slot of an array on the stack of its
+// function, and recordBlockBatch() appends the records of the block together
+// with the basic block record at its terminator. The records of the accesses
+// which precede a call are appended by recordBatch() before the call, so the
+// trace is the same as without batching. The type, id and length of every
+// record are known statically, and are passed in a constant array of
+// BatchRecord.
+//
+
+/// \class The static part of one record of a batch.
+struct BatchRecord {
+  uint32_t type;   ///< The RecordType of the record
+  uint32_t id;     ///< The id of the instruction
+  uint64_t length; ///< The number of bytes accessed
+};
+
+//===----------------------------------------------------------------------===//
+//                        Strided access records
+//===----------------------------------------------------------------------===//
+//
+// With -trace-strided, a load or store of an innermost loop whose address
+// advances by a constant stride in every iteration is not recorded one access
+// at a time. recordStrided() writes a single strided access record (AFType)
+// in the preheader of the loop, which holds the address of the first access,
+// the stride, the number of accesses and their size. The k-th access is
+// performed by the k-th execution of the basic block of the instruction
+// which follows the record in the thread. The loops contain no calls, and
+// an access is only compressed if no recorded access follows it in its basic
+// block, so the accesses take place just before the basic block records of
+// their executions.
+//
+
+/// Pack the number of accesses and the stride of a strided access record
+/// into its length.
+static inline uint64_t stridedLength(uint32_t count, int32_t stride) {
+  return (static_cast<uint64_t>(count) << 32) | static_cast<uint32_t>(stride);
+}
+
+/// Return the number of accesses of a strided access record.
+static inline uint32_t stridedCount(const Entry &entry) {
+  return static_cast<uint32_t>(static_cast<uint64_t>(entry.length) >> 32);
+}
+
+/// Return the distance in bytes between the accesses of a strided access
+/// record.
+static inline int32_t stridedStride(const Entry &entry) {
+  return static_cast<int32_t>(static_cast<uint32_t>(entry.length));
+}
+
+//===----------------------------------------------------------------------===//
+//                        Branch outcomes records
+//===----------------------------------------------------------------------===//
+//
+// With -trace-branches, basic blocks write no records. Every function writes
+// a function entry record (FNType) when it starts, and every conditional
+// branch, switch and indirect branch appends its outcome to the bits of its
+// thread: one bit for a branch (0 if it is taken to its first successor),
+// the value of the condition for a switch, and the index of the successor
+// for an indirect branch. The bits are written as a branch outcomes record
+// (BRType) when BranchRecordBits of them are pending, and before any other
+// record of the thread, so the records of the thread follow the branches
+// which precede them. Readers walk the control flow graph of every thread
+// from its function entries and regenerate the basic block records (see
+// BranchDecoder in Giri/TraceFile.h).
+//
+
+/// The largest number of outcome bits held by one branch outcomes record
+static const unsigned BranchRecordBits = 128;
+
+/// Return the outcome bit at the position of a branch outcomes record, which
+/// is below the id of the record.
+static inline unsigned branchBit(const Entry &entry, unsigned position) {
+  uint64_t word = position < 64 ? entry.address : entry.length;
+  return (word >> (position % 64)) & 1;
+}
+
+//===----------------------------------------------------------------------===//
+//                        Inlinable fast path
+//===----------------------------------------------------------------------===//
+//
+// Most calls of recordLoad(), recordStore() and recordSelect() only append one
+// record to the trace buffer. runtime/Giri/FastPath.cpp implements them on top
+// of the interface below; it is compiled to a bitcode module which can be
+// linked into the instrumented program, so that the append is inlined at the
+// call sites and only the slow path calls into the run-time.
+//
+
+/// The value of giri_thread_index for threads which have no index yet
+static const unsigned GIRI_NO_THREAD_INDEX = ~0u;
+
+/// \class The part of the trace buffer into which records can be appended
+/// without calling the run-time. The window is empty whenever the run-time has
+/// to see every record, e.g., when it buffers the records per thread.
+struct AppendWindow {
+  Entry *next; ///< The position of the next record
+  Entry *end;  ///< The end of the window
+};
+
+/// \class The lock which recordLock() and recordUnlock() take around the
+/// records of the instrumented instructions.
+struct AppendLock {
+  /// The mutex of the entry cache, or null if the records are buffered per
+  /// thread and are ordered without a lock
+  pthread_mutex_t *mutex;
+  bool timed; ///< Whether the run-time measures the waits for the mutex
+};
+
+extern "C" {
+/// The append window of the shared entry cache. Like the entry cache itself,
+/// it is protected by recordLock().
+extern AppendWindow giri_append_window;
+
+/// The index of the calling thread, or GIRI_NO_THREAD_INDEX
+extern __thread unsigned giri_thread_index;
+
+/// How recordLock() guards the shared entry cache
+extern AppendLock giri_append_lock;
+
+/// Take the mutex of the entry cache, measuring the time spent waiting for it.
+void giri_lock_timed(void);
+
+/// Add a record which cannot be appended to the window. The thread index of
+/// the record is filled in by the run-time.
+void giri_append_slow(const Entry *entry);
+}
+
 #endif
@@ -0,0 +1,203 @@
+//===- TraceCompression.h - Block compression of trace segments -*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the LZ-style block codec which compresses the segments of
+// compressed traces (TF_Compressed). It is shared by the run-time, which
+// compresses every segment before writing it, and by the readers of the
+// trace. Trace records repeat the same identifiers, thread indices and
+// function addresses over and over, which a byte-oriented LZ codec removes at
+// a fraction of the cost of writing the raw records.
+//
+// A block is a sequence of commands. Each command starts with a token byte:
+//
+//   bits 4-7 - The number of literal bytes, or 15 if more bytes follow
+//   bits 0-3 - The length of the match minus MinMatch, or 15 if more bytes
+//              follow
+//
+// followed by the extra bytes of the literal count (each adds up to 255, the
+// first byte below 255 ends it), the literal bytes, the 16-bit little-endian
+// distance of the match, and the extra bytes of the match length. The last
+// command of a block has only literals; the block ends after them.
+//
+// The codec keeps no state across blocks and does not allocate memory, so the
+// run-time can also compress segments in a signal handler.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_TRACECOMPRESSION_H
+#define GIRI_TRACECOMPRESSION_H
+
+#include <inttypes.h>
+#include <string.h>
+
+/// The largest size of a block compressing size bytes
+#define GIRI_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+namespace TraceCompression {
+
+/// The shortest match which is encoded as a match
+static const unsigned MinMatch = 4;
+
+/// The farthest distance of a match
+static const unsigned MaxDistance = 65535;
+
+/// Number of bits of the hash of four bytes
+static const unsigned HashBits = 12;
+
+static inline uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t hash4(uint32_t value) {
+  return (value * 2654435761u) >> (32 - HashBits);
+}
+
+/// Write the extra bytes of a length which did not fit into its nibble.
+static inline unsigned char *encodeLength(unsigned char *p, size_t length) {
+  for (; length >= 255; length -= 255)
+    *p++ = 255;
+  *p++ = static_cast<unsigned char>(length);
+  return p;
+}
+
+/// Write one command.
+static inline unsigned char *encodeCommand(unsigned char *p,
+                                           const unsigned char *literals,
+                                           size_t numLiterals,
+                                           size_t distance,
+                                           size_t matchLength) {
+  size_t matchCode = matchLength ? matchLength - MinMatch : 0;
+  unsigned char *token = p++;
+  *token = (numLiterals < 15 ? numLiterals : 15) << 4;
+  if (numLiterals >= 15)
+    p = encodeLength(p, numLiterals - 15);
+  memcpy(p, literals, numLiterals);
+  p += numLiterals;
+  if (!matchLength)
+    return p;
+
+  *token |= matchCode < 15 ? matchCode : 15;
+  *p++ = static_cast<unsigned char>(distance);
+  *p++ = static_cast<unsigned char>(distance >> 8);
+  if (matchCode >= 15)
+    p = encodeLength(p, matchCode - 15);
+  return p;
+}
+
+/// Read the extra bytes of a length whose nibble is 15.
+/// \return the position following the length, or nullptr if it is truncated.
+static inline const unsigned char *decodeLength(const unsigned char *p,
+                                                const unsigned char *end,
+                                                size_t &length) {
+  unsigned char byte;
+  do {
+    if (p == end)
+      return nullptr;
+    byte = *p++;
+    length += byte;
+  } while (byte == 255);
+  return p;
+}
+
+} // END namespace TraceCompression
+
+/// Compress a block of size bytes into dst, which must have room for
+/// GIRI_COMPRESS_BOUND(size) bytes.
+/// \return the size of the compressed block.
+static inline size_t compressBlock(const void *src,
+                                   size_t size,
+                                   unsigned char *dst) {
+  using namespace TraceCompression;
+  const unsigned char *base = static_cast<const unsigned char *>(src);
+  const unsigned char *ip = base;
+  const unsigned char *anchor = base;
+  const unsigned char *end = base + size;
+  unsigned char *op = dst;
+
+  // The position of the last occurrence of each hash, plus one
+  uint32_t table[1u << HashBits];
+  memset(table, 0, sizeof(table));
+
+  if (size > MinMatch) {
+    const unsigned char *limit = end - MinMatch;
+    while (ip <= limit) {
+      uint32_t value = read32(ip);
+      uint32_t &slot = table[hash4(value)];
+      const unsigned char *ref = slot ? base + slot - 1 : nullptr;
+      slot = ip - base + 1;
+      if (!ref || ip - ref > MaxDistance || read32(ref) != value) {
+        // Skip faster over data which does not compress.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      const unsigned char *match = ip + MinMatch;
+      ref += MinMatch;
+      while (match < end && *match == *ref) {
+        ++match;
+        ++ref;
+      }
+      op = encodeCommand(op, anchor, ip - anchor, match - ref, match - ip);
+      ip = anchor = match;
+    }
+  }
+  return encodeCommand(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+/// Decompress a block into dst, which has room for exactly rawSize bytes.
+/// \return false if the block is malformed or does not decompress to
+/// rawSize bytes.
+static inline bool decompressBlock(const unsigned char *src,
+                                   size_t size,
+                                   void *dst,
+                                   size_t rawSize) {
+  using namespace TraceCompression;
+  const unsigned char *ip = src;
+  const unsigned char *end = src + size;
+  unsigned char *base = static_cast<unsigned char *>(dst);
+  unsigned char *op = base;
+  unsigned char *opEnd = base + rawSize;
+
+  while (ip != end) {
+    unsigned char token = *ip++;
+    size_t numLiterals = token >> 4;
+    if (numLiterals == 15 && !(ip = decodeLength(ip, end, numLiterals)))
+      return false;
+    if (numLiterals > size_t(end - ip) || numLiterals > size_t(opEnd - op))
+      return false;
+    memcpy(op, ip, numLiterals);
+    ip += numLiterals;
+    op += numLiterals;
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return false;
+    size_t distance = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t matchLength = token & 15;
+    if (matchLength == 15 && !(ip = decodeLength(ip, end, matchLength)))
+      return false;
+    matchLength += MinMatch;
+    if (distance == 0 || distance > size_t(op - base) ||
+        matchLength > size_t(opEnd - op))
+      return false;
+
+    // The match may overlap the bytes it produces, so copy byte by byte.
+    const unsigned char *ref = op - distance;
+    for (size_t i = 0; i < matchLength; ++i)
+      op[i] = ref[i];
+    op += matchLength;
+  }
+  return op == opEnd;
+}
+
+#endif
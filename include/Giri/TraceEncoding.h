@@ -0,0 +1,342 @@
+//===- TraceEncoding.h - Compact encoding of the trace records -*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the variable-length encoding of the records of compact
+// (version 2) trace files. It is shared by the run-time, which encodes the
+// records when it writes a segment, and by the readers of the trace.
+//
+// Every record starts with a one byte tag:
+//
+//   bits 0-2 - The low bits of the type of the record (see encodeType())
+//   bits 3-5 - The length of the record if it is one of 0, 1, 2, 4 or 8, or
+//              LC_Explicit if the length follows as a varint, or LC_Repeated
+//              if both the length and the repeat count of a record with
+//              merged accesses follow as varints
+//   bit  6   - The record belongs to another thread than the previous record;
+//              the new thread follows the tag as a varint
+//   bit  7   - The high bit of the type of the record
+//
+// The tag is followed by the fields of the record, in order:
+//
+//   thread  - varint, only if bit 6 of the tag is set
+//   id      - varint
+//   address - zigzag varint of the difference to the previous address of the
+//             same kind (code or data) on the same thread. Select, thread
+//             and synchronization records store their flag, pthread_t or
+//             object as a plain varint instead.
+//   length  - varint, only if the length code is LC_Explicit or LC_Repeated
+//   repeat  - varint, only if the length code is LC_Repeated
+//   seq     - varint of the distance to the sequence number following the
+//             one of the previous record, only if the segment is sequenced
+//
+// The state of the encoder is reset at the beginning of every segment, so each
+// segment can be decoded on its own. The coders do not allocate memory, so
+// the run-time can also encode records in a signal handler.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_TRACEENCODING_H
+#define GIRI_TRACEENCODING_H
+
+#include "Giri/Runtime.h"
+
+/// The maximum number of bytes taken by one encoded record: the tag, a 32-bit
+/// id, four 64-bit varints, and the repeat count.
+static const unsigned GIRI_MAX_ENCODED_RECORD = 1 + 5 + 4 * 10 + 2;
+
+/// The tag bit marking a change of the thread
+static const unsigned char TAG_NewThread = 1u << 6;
+
+/// The tag bit holding the high bit of the type code
+static const unsigned char TAG_HighType = 1u << 7;
+
+/// The length codes of the tag
+enum LengthCode : unsigned char {
+  LC_Explicit = 0,
+  LC_Zero = 1,
+  LC_One = 2,
+  LC_Two = 3,
+  LC_Four = 4,
+  LC_Eight = 5,
+  LC_Repeated = 6
+};
+
+/// Map a record type to its code, which is below GIRI_NUM_RECORD_TYPES. The
+/// low three bits of the code are stored in bits 0-2 of the tag, and the high
+/// bit in bit 7.
+static inline unsigned char encodeType(RecordType type) {
+  switch (type) {
+  case RecordType::BBType: return 0;
+  case RecordType::LDType: return 1;
+  case RecordType::STType: return 2;
+  case RecordType::CLType: return 3;
+  case RecordType::RTType: return 4;
+  case RecordType::ENType: return 5;
+  case RecordType::PDType: return 6;
+  case RecordType::THType: return 7;
+  case RecordType::SYType: return 8;
+  case RecordType::GPType: return 9;
+  case RecordType::AFType: return 10;
+  case RecordType::FNType: return 11;
+  case RecordType::BRType: return 12;
+  }
+  return 7;
+}
+
+/// Map the code of a record type back to the record type.
+/// \return false if the code is invalid.
+static inline bool decodeType(unsigned char code, RecordType &type) {
+  static const RecordType Types[] = {
+    RecordType::BBType, RecordType::LDType, RecordType::STType,
+    RecordType::CLType, RecordType::RTType, RecordType::ENType,
+    RecordType::PDType, RecordType::THType, RecordType::SYType,
+    RecordType::GPType, RecordType::AFType, RecordType::FNType,
+    RecordType::BRType
+  };
+  if (code >= sizeof(Types) / sizeof(Types[0]))
+    return false;
+  type = Types[code];
+  return true;
+}
+
+/// Return true if the address of records of this type is a memory address
+/// rather than the address of a function.
+static inline bool isDataAddress(RecordType type) {
+  return type == RecordType::LDType || type == RecordType::STType;
+}
+
+/// Return true if records of this type describe memory accesses, one by one
+/// or strided.
+static inline bool isMemoryAccess(RecordType type) {
+  return isDataAddress(type) || type == RecordType::AFType;
+}
+
+/// Return true if the address of records of this type is not an address at
+/// all, and is therefore not delta coded.
+static inline bool hasPlainAddress(RecordType type) {
+  return type == RecordType::PDType || type == RecordType::THType ||
+         type == RecordType::SYType || type == RecordType::GPType ||
+         type == RecordType::BRType;
+}
+
+static inline unsigned char *encodeVarint(unsigned char *p, uint64_t value) {
+  while (value >= 0x80) {
+    *p++ = static_cast<unsigned char>(value) | 0x80;
+    value >>= 7;
+  }
+  *p++ = static_cast<unsigned char>(value);
+  return p;
+}
+
+/// Decode one varint.
+/// \return the position following the varint, or nullptr if it is truncated.
+static inline const unsigned char *decodeVarint(const unsigned char *p,
+                                                const unsigned char *end,
+                                                uint64_t &value) {
+  value = 0;
+  for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+    unsigned char byte = *p++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return p;
+  }
+  return nullptr;
+}
+
+static inline uint64_t zigzag(uint64_t delta) {
+  return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+static inline uint64_t unzigzag(uint64_t value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+/// \class The per-segment state shared by the encoder and the decoder.
+///
+/// It remembers the current thread and, for the threads seen in the segment,
+/// the last code and data addresses against which new addresses are coded.
+/// The state of at most MaxThreads threads is kept. When another thread shows
+/// up, it replaces the threads in the order in which they showed up, and its
+/// addresses are coded against zero.
+class RecordCoderState {
+public:
+  /// Start a new segment whose first record belongs to the given thread.
+  /// \param sequenced - Whether the records carry sequence numbers.
+  void reset(uint64_t thread, uint64_t firstSeq, bool sequenced) {
+    numThreads = 0;
+    switchThread(thread);
+    nextSeq = firstSeq;
+    this->sequenced = sequenced;
+  }
+
+protected:
+  struct ThreadState {
+    uint64_t thread;
+    uint64_t code; ///< Previous function address
+    uint64_t data; ///< Previous memory address
+  };
+
+  static const unsigned MaxThreads = 64;
+
+  /// Make the given thread the current one.
+  void switchThread(uint64_t thread) {
+    unsigned size = numThreads < MaxThreads ? numThreads : MaxThreads;
+    for (unsigned i = 0; i < size; ++i)
+      if (threads[i].thread == thread) {
+        current = i;
+        return;
+      }
+    ThreadState state = { thread, 0, 0 };
+    current = numThreads++ % MaxThreads;
+    threads[current] = state;
+  }
+
+  /// Return the previous address of the current thread of the given kind.
+  uint64_t &lastAddress(RecordType type) {
+    return isMemoryAccess(type) ? threads[current].data : threads[current].code;
+  }
+
+  ThreadState threads[MaxThreads]; ///< The threads seen in the segment
+  unsigned numThreads; ///< Number of threads which showed up in the segment
+  unsigned current; ///< Index of the current thread
+  uint64_t nextSeq; ///< The sequence number following the previous record
+  bool sequenced; ///< Whether the records carry sequence numbers
+};
+
+/// \class Encoder of the records of one segment.
+class RecordEncoder : public RecordCoderState {
+public:
+  /// Encode one record at p, which must have room for GIRI_MAX_ENCODED_RECORD
+  /// bytes. The sequence number is ignored if the segment is not sequenced.
+  /// \return the position following the encoded record.
+  unsigned char *encode(unsigned char *p, const Entry &entry, uint64_t seq) {
+    unsigned char code = encodeType(entry.type);
+    unsigned char tag = (code & 7) | ((code & 8) ? TAG_HighType : 0);
+    if (entry.repeat) {
+      tag |= LC_Repeated << 3;
+    } else {
+      switch (entry.length) {
+      case 0: tag |= LC_Zero << 3; break;
+      case 1: tag |= LC_One << 3; break;
+      case 2: tag |= LC_Two << 3; break;
+      case 4: tag |= LC_Four << 3; break;
+      case 8: tag |= LC_Eight << 3; break;
+      default: tag |= LC_Explicit << 3; break;
+      }
+    }
+
+    uint64_t thread = static_cast<uint64_t>(entry.tid);
+    bool newThread = thread != threads[current].thread;
+    if (newThread) {
+      tag |= TAG_NewThread;
+      switchThread(thread);
+    }
+
+    *p++ = tag;
+    if (newThread)
+      p = encodeVarint(p, thread);
+    p = encodeVarint(p, entry.id);
+
+    uint64_t address = entry.address;
+    if (hasPlainAddress(entry.type)) {
+      p = encodeVarint(p, address);
+    } else {
+      uint64_t &last = lastAddress(entry.type);
+      p = encodeVarint(p, zigzag(address - last));
+      last = address;
+    }
+
+    unsigned char lengthCode = (tag >> 3) & 7;
+    if (lengthCode == LC_Explicit || lengthCode == LC_Repeated)
+      p = encodeVarint(p, entry.length);
+    if (lengthCode == LC_Repeated)
+      p = encodeVarint(p, entry.repeat);
+    if (sequenced) {
+      p = encodeVarint(p, seq - nextSeq);
+      nextSeq = seq + 1;
+    }
+    return p;
+  }
+};
+
+/// \class Decoder of the records of one segment.
+class RecordDecoder : public RecordCoderState {
+public:
+  /// Decode the record at p. The sequence number of a segment which is not
+  /// sequenced is the one following the previous record.
+  /// \return the position following the record, or nullptr if the record is
+  /// malformed or truncated.
+  const unsigned char *decode(const unsigned char *p,
+                              const unsigned char *end,
+                              Entry &entry,
+                              uint64_t &seq) {
+    if (p == end)
+      return nullptr;
+    unsigned char tag = *p++;
+    RecordType type;
+    if (!decodeType((tag & 7) | ((tag & TAG_HighType) ? 8 : 0), type))
+      return nullptr;
+
+    uint64_t value;
+    if (tag & TAG_NewThread) {
+      if (!(p = decodeVarint(p, end, value)))
+        return nullptr;
+      switchThread(value);
+    }
+
+    entry = Entry(type, 0);
+    entry.tid = static_cast<ThreadIndex>(threads[current].thread);
+    if (!(p = decodeVarint(p, end, value)))
+      return nullptr;
+    entry.id = static_cast<unsigned>(value);
+
+    if (!(p = decodeVarint(p, end, value)))
+      return nullptr;
+    if (hasPlainAddress(type)) {
+      entry.address = static_cast<uintptr_t>(value);
+    } else {
+      uint64_t &last = lastAddress(type);
+      last += unzigzag(value);
+      entry.address = static_cast<uintptr_t>(last);
+    }
+
+    switch ((tag >> 3) & 7) {
+    case LC_Explicit:
+      if (!(p = decodeVarint(p, end, value)))
+        return nullptr;
+      entry.length = static_cast<uintptr_t>(value);
+      break;
+    case LC_Zero: entry.length = 0; break;
+    case LC_One: entry.length = 1; break;
+    case LC_Two: entry.length = 2; break;
+    case LC_Four: entry.length = 4; break;
+    case LC_Eight: entry.length = 8; break;
+    case LC_Repeated:
+      if (!(p = decodeVarint(p, end, value)))
+        return nullptr;
+      entry.length = static_cast<uintptr_t>(value);
+      if (!(p = decodeVarint(p, end, value)) || value == 0 || value > 255)
+        return nullptr;
+      entry.repeat = static_cast<unsigned char>(value);
+      break;
+    default: return nullptr;
+    }
+
+    seq = nextSeq;
+    if (sequenced) {
+      if (!(p = decodeVarint(p, end, value)))
+        return nullptr;
+      seq += value;
+    }
+    nextSeq = seq + 1;
+    return p;
+  }
+};
+
+#endif
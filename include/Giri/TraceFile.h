@@ -15,6 +15,7 @@
 #define GIRI_TRACEFILE_H
 
 #include "Giri/Runtime.h"
+#include "Giri/TraceReader.h"
 #include "Utility/BasicBlockNumbering.h"
 #include "Utility/LoadStoreNumbering.h"
 
@@ -22,12 +23,15 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Value.h"
 
+#include <algorithm>
 #include <deque>
 #include <iterator>
+#include <map>
 #include <pthread.h>
 #include <set>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 using namespace llvm;
 using namespace dg;
@@ -140,6 +144,247 @@ private:
   unsigned long index;
 };
 
+/// This class records where the segments of a trace with summaries ended up
+/// in the merged trace, and tells the searches through the trace which parts
+/// of it may hold the records they look for.
+///
+/// The segments are kept as blocks of consecutive trace indices, both for all
+/// the threads together and for each bucket of the thread set of the
+/// summaries. Overlapping segments are merged into one block, so the blocks of
+/// each list are disjoint and ordered. Indices outside of every block of a
+/// list hold no record of its threads. Without summaries, the whole trace is
+/// one block which may hold anything.
+class SegmentIndex {
+public:
+  /// A range of trace indices and the summary of their records
+  struct Block {
+    unsigned long first;
+    unsigned long last;
+    SegmentSummary summary;
+  };
+  typedef std::vector<Block> BlockList;
+
+  SegmentIndex() : enabled(false) { }
+
+  /// Build the blocks from the summaries of the segments read by the reader.
+  void build(const std::vector<TraceReader::SummaryRange> &ranges);
+
+  /// Return the blocks of all the threads.
+  const BlockList &blocks() const { return all; }
+
+  /// Return the blocks which may hold records of the thread.
+  const BlockList &blocks(ThreadIndex tid) const {
+    return enabled ? byThread[tid % byThread.size()] : all;
+  }
+
+  /// Find the next part of the trace to scan backwards from index. Blocks
+  /// whose summary does not satisfy mayHold are skipped.
+  /// \param[in,out] index - The highest index to scan, lowered to the last
+  ///                        index of the block it falls into.
+  /// \param[out] low - The first index of that block.
+  /// \return false if no index at or before index needs to be scanned.
+  template <typename Pred>
+  bool previous(const BlockList &blocks,
+                unsigned long &index,
+                Pred mayHold,
+                unsigned long &low) const {
+    if (!enabled) {
+      low = 0;
+      return true;
+    }
+    auto B = std::upper_bound(blocks.begin(), blocks.end(), index,
+                              [](unsigned long i, const Block &block) {
+                                return i < block.first;
+                              });
+    while (B != blocks.begin()) {
+      --B;
+      if (mayHold(B->summary)) {
+        index = std::min(index, B->last);
+        low = B->first;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Find the next part of the trace to scan forwards from index. Blocks
+  /// whose summary does not satisfy mayHold are skipped.
+  /// \param[in,out] index - The lowest index to scan, raised to the first
+  ///                        index of the block it falls into.
+  /// \param[out] high - The last index of that block.
+  /// \return false if no index at or after index needs to be scanned.
+  template <typename Pred>
+  bool next(const BlockList &blocks,
+            unsigned long &index,
+            Pred mayHold,
+            unsigned long &high) const {
+    if (!enabled) {
+      high = ~0ul;
+      return true;
+    }
+    auto B = std::lower_bound(blocks.begin(), blocks.end(), index,
+                              [](const Block &block, unsigned long i) {
+                                return block.last < i;
+                              });
+    for (; B != blocks.end(); ++B) {
+      if (mayHold(B->summary)) {
+        index = std::max(index, B->first);
+        high = B->last;
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  bool enabled; ///< Whether the trace has summaries
+  BlockList all; ///< The blocks of all the threads
+  std::vector<BlockList> byThread; ///< The blocks of each bucket of threads
+};
+
+/// This class computes the happens-before order of the threads of a trace
+/// from its synchronization records (SYType).
+///
+/// A forward pass over the trace maintains a vector clock for every thread.
+/// A release (unlocking a mutex, signalling a condition, creating a thread)
+/// publishes the clock of the thread in the synchronization object and then
+/// advances the own component of the clock; an acquire (locking a mutex,
+/// waking up from a condition, joining a thread) merges the clock of the
+/// object into the clock of the thread. A new thread starts with the clock
+/// published by the thread which created it. The clock of a thread changes
+/// only at its synchronization records, so the pass keeps a snapshot of the
+/// clock at each of them, and the clock of a thread at any index of the trace
+/// is the last snapshot at or before the index.
+///
+/// A record of one thread happens before a record of another thread if the
+/// own component of the clock of the first thread at the first record is not
+/// larger than the component of the first thread in the clock of the second
+/// thread at the second record. Without synchronization records, the order of
+/// the trace is used instead.
+class SyncOrder {
+public:
+  SyncOrder() : enabled(false) { }
+
+  /// Compute the clocks of the threads from the records of the trace.
+  void build(const Entry *trace, unsigned long maxIndex);
+
+  /// Return true if the trace holds synchronization records.
+  bool isEnabled() const { return enabled; }
+
+  /// Return true if the record at the index first, of thread firstTid,
+  /// happens before the record at the index second, of thread secondTid.
+  bool happensBefore(unsigned long first, ThreadIndex firstTid,
+                     unsigned long second, ThreadIndex secondTid) const;
+
+private:
+  typedef std::vector<uint64_t> VectorClock;
+
+  /// The clock of a thread from the index of a record on
+  struct Snapshot {
+    unsigned long index;
+    VectorClock clock;
+  };
+
+  /// Return the clock of the thread at the index, or null if the thread had
+  /// not started yet.
+  const VectorClock *clockAt(ThreadIndex tid, unsigned long index) const;
+
+  bool enabled; ///< Whether the trace has synchronization records
+  /// The snapshots of the clock of each thread, in the order of the trace
+  std::vector<std::vector<Snapshot>> snapshots;
+};
+
+/// This class regenerates the basic block records of a trace which was
+/// written by a program instrumented with -trace-branches, where functions
+/// record their entries and branches their outcomes instead (see
+/// Giri/Runtime.h).
+///
+/// The records are decoded in the order of the trace. For every thread, the
+/// decoder keeps the stack of the active functions and the basic block being
+/// executed in each of them. A branch outcomes record ends the current basic
+/// block and takes the successors chosen by its bits, following the basic
+/// blocks with a single successor and the returns in between, until all its
+/// bits are consumed. Any other record of an instruction is preceded by the
+/// basic blocks with a single successor which lead to the basic block of the
+/// instruction; a return record by the returns of the functions called by
+/// its call. A function entry record pushes the function onto the stack,
+/// after the returns of the functions which cannot have called it. As the
+/// run-time writes the pending outcome bits before any other record of the
+/// thread, a basic block record is added at the latest when the next record
+/// of its thread is decoded. The last basic blocks of a thread are ended when
+/// the thread is joined, or at the end of the trace, where the basic blocks
+/// which cannot end are terminated as the run-time does at exit.
+///
+/// The decoded trace holds the basic block records in place of the function
+/// entry and branch outcomes records, with the same fields as if the program
+/// had been instrumented for them, so the other records keep their order but
+/// not their indices.
+class BranchDecoder {
+public:
+  BranchDecoder(const QueryBasicBlockNumbers *bbNums,
+                const QueryLoadStoreNumbers *lsNums) :
+    bbNumPass(bbNums), lsNumPass(lsNums) { }
+
+  /// Return true if the trace has function entry records, i.e., has to be
+  /// decoded.
+  static bool isBranchTrace(const Entry *trace, unsigned long maxIndex);
+
+  /// Decode the records of the trace into out.
+  void decode(const Entry *trace,
+              unsigned long maxIndex,
+              std::vector<Entry> &out);
+
+private:
+  /// A function being executed by a thread
+  struct Frame {
+    BasicBlock *block;  ///< The basic block being executed
+    uintptr_t function; ///< The address of the function
+    bool inCall;        ///< Whether it waits for the return of a call
+  };
+
+  /// A call on the function call stack of the run-time, which gives the
+  /// length of the last basic block records
+  struct Call {
+    unsigned id;
+    uintptr_t function;
+  };
+
+  /// The state of one thread
+  struct Thread {
+    std::vector<Frame> frames;
+    std::vector<Call> calls;
+  };
+
+  /// End the current basic block of the innermost function of the thread and
+  /// continue with its successor, or return to the calling function. The
+  /// bits of the outcome are taken from the branch outcomes record at the
+  /// position, if the terminator has recorded any.
+  /// \return false if the basic block cannot end here.
+  bool endBlock(ThreadIndex tid,
+                Thread &T,
+                const Entry *outcomes,
+                unsigned &position,
+                std::vector<Entry> &out);
+
+  /// End the basic blocks of the innermost function of the thread which
+  /// precede the execution of the instruction I.
+  /// \return false if the instruction cannot be reached.
+  bool reach(ThreadIndex tid, Thread &T, Instruction *I,
+             std::vector<Entry> &out);
+
+  /// End the basic blocks of the innermost function of the thread up to its
+  /// return.
+  /// \return false if the function cannot return.
+  bool leave(ThreadIndex tid, Thread &T, std::vector<Entry> &out);
+
+  /// End the last basic blocks of a thread which finished, and terminate
+  /// those which cannot end.
+  void finish(ThreadIndex tid, Thread &T, std::vector<Entry> &out);
+
+  const QueryBasicBlockNumbers *bbNumPass;
+  const QueryLoadStoreNumbers *lsNumPass;
+};
+
 /// This class abstracts away searches through the trace file.
 class TraceFile {
 protected:
@@ -237,22 +482,22 @@ private:
 
   unsigned long findPreviousID(unsigned long start_index,
                                RecordType type,
-                               pthread_t tid,
+                               ThreadIndex tid,
                                const unsigned id);
   unsigned long findPreviousID(Function *fun,
                                unsigned long start_index,
                                RecordType type,
-                               pthread_t tid,
+                               ThreadIndex tid,
                                const std::set<unsigned> &ids);
   unsigned long findPreviousID(Function *fun,
                                unsigned long start_index,
                                RecordType type,
-                               pthread_t tid,
+                               ThreadIndex tid,
                                const unsigned id);
 
   unsigned long findPreviousNestedID(unsigned long start_index,
                                      RecordType type,
-                                     pthread_t tid,
+                                     ThreadIndex tid,
                                      const unsigned id,
                                      const unsigned nestedID);
 
@@ -260,17 +505,51 @@ private:
                                  RecordType type,
                                  const unsigned id,
                                  const unsigned nestID,
-                                 pthread_t tid);
+                                 ThreadIndex tid);
 
   unsigned long findNextAddress(unsigned long start_index,
                                 RecordType type,
-                                pthread_t tid,
+                                ThreadIndex tid,
                                 const uintptr_t address);
 
+  bool hasPreviousID(unsigned long start_index,
+                     unsigned long stop_index,
+                     RecordType type,
+                     ThreadIndex tid,
+                     const unsigned id);
+
+  long findGap(unsigned long index, unsigned level) const;
+
+  long findPreviousStore(long store_index,
+                         Instruction *&strided,
+                         const Entry &load_entry,
+                         long gap,
+                         Entry &store_entry);
+
+  bool findPreviousStridedStore(long store_index,
+                                Instruction *before,
+                                const Entry &load_entry,
+                                long low,
+                                long &found_index,
+                                Instruction *&found_store,
+                                Entry &found_entry);
+
+  bool findStridedAccess(unsigned id,
+                         unsigned long block_index,
+                         ThreadIndex tid,
+                         Entry &access);
+
+  void addStoreToWorklist(DynValue &DV,
+                          Worklist_t &Sources,
+                          long store_index,
+                          Instruction *strided);
+
   void findAllStoresForLoad(DynValue &DV,
                             Worklist_t &Sources,
                             long store_index,
-                            const Entry load_entry);
+                            unsigned long load_index,
+                            const Entry load_entry,
+                            Instruction *strided = nullptr);
 
   void getSourcesForPHI(DynValue &DV, Worklist_t &Sources);
 
@@ -278,11 +557,15 @@ private:
 
   void getSourcesForLoad(DynValue &DV, Worklist_t &Sources, unsigned count = 1);
 
+  void getSourcesForLocalLoad(DynValue &DV,
+                              const AllocaInst *AI,
+                              Worklist_t &Sources);
+
   void getSourcesForCall(DynValue &DV, Worklist_t &Sources);
   unsigned long matchReturnWithCall(unsigned long start_index,
                                     const unsigned bbID,
                                     const unsigned callID,
-                                    pthread_t tid);
+                                    ThreadIndex tid);
 
   bool getSourcesForSpecialCall(DynValue &DV, Worklist_t &Sources);
 
@@ -304,6 +587,38 @@ private:
   /// Maximum index of trace
   unsigned long maxIndex;
 
+  /// The summaries of the segments of the trace
+  SegmentIndex Segments;
+
+  /// The happens-before order of the threads of the trace
+  SyncOrder Sync;
+
+  /// The indices and levels (TraceGap) of the gap records of the trace, in
+  /// the order of the trace
+  std::vector<std::pair<unsigned long, unsigned> > Gaps;
+
+  /// \class The accesses of a strided access record (AFType).
+  struct StridedRecord {
+    unsigned long index; ///< The index of the record in the trace
+    /// The indices of the basic block records of the executions which
+    /// perform the accesses, one per access
+    std::vector<unsigned long> blocks;
+  };
+
+  /// The strided access records of the trace, in the order of the trace
+  std::vector<StridedRecord> Strided;
+
+  /// The positions in Strided of the records of every load and store
+  /// instruction, by its id
+  std::map<unsigned, std::vector<unsigned> > StridedByID;
+
+  /// The positions in Strided of the records of store instructions
+  std::vector<unsigned> StridedStores;
+
+  /// For every record of StridedStores, the highest index of a basic block
+  /// record of it or of any record before it
+  std::vector<unsigned long> StridedStoresEnd;
+
   /// Set of errorneous Static Values which have issues like missing matching
   /// entries during normalization for some reason
   std::unordered_set<Value *> BuggyValues;
@@ -312,6 +627,8 @@ public:
   /// Statistics on loads
   unsigned totalLoadsTraced;
   unsigned lostLoadsTraced;
+  /// Loads whose source may have been dropped by the run-time at a gap
+  unsigned gapLoadsTraced;
 };
 
 }
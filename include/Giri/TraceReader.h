@@ -0,0 +1,182 @@
+//===- TraceReader.h - Read the records of a trace file in order ----------===//
+//
+//                          Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file provides a sequential reader of trace files which hides the
+// layout in which the run-time wrote the records.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_TRACEREADER_H
+#define GIRI_TRACEREADER_H
+
+#include "Giri/Runtime.h"
+
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace giri {
+
+/// This class reads the records of a trace file in their global order.
+///
+/// A trace is either a flat array of entries, or a segmented trace. The
+/// segments of each thread form one stream ordered by sequence numbers, and
+/// the reader merges the per-thread streams back into one total order. The
+/// records of compact traces are decoded, and the segments of compressed
+/// traces decompressed, when their segment is loaded. Only the current segment
+/// of each thread is held in memory.
+///
+/// The reader stops after the END record. If the trace has no END record
+/// (e.g., the program was killed), the reader supplies one.
+///
+/// The segments of a trace with per-thread trace files (TF_ThreadFiles) are
+/// read from all the files, so the reader merges them as if they were in one
+/// file.
+///
+/// If the segments of the trace carry summaries, the reader also tells where
+/// the records of each segment ended up in the merged order, so that clients
+/// holding the merged records can skip the records of a segment in their
+/// searches.
+class TraceReader {
+public:
+  /// The summary of one segment, and the positions of its first and last
+  /// records among the records returned by next(). The records of other
+  /// segments may be interleaved with them.
+  struct SummaryRange {
+    unsigned long first;
+    unsigned long last;
+    SegmentSummary summary;
+  };
+
+  /// Open the trace file. The file name "-" reads a flat trace from the
+  /// standard input.
+  explicit TraceReader(const std::string &Filename);
+  ~TraceReader();
+
+  /// Return true if the trace file was opened successfully.
+  bool isOpen() const { return fd != -1; }
+
+  /// Return true if the trace is a flat array of entries, which can be mapped
+  /// into memory directly.
+  bool isFlat() const { return flat; }
+
+  /// Return the file descriptor of the trace file.
+  int getFD() const { return fd; }
+
+  /// Return an upper bound of the number of entries in the trace, including
+  /// the END record. This is zero if the trace is read from a pipe.
+  unsigned long size() const { return numEntries; }
+
+  /// Read the next entry of the trace.
+  /// \return false if there are no more entries.
+  bool next(Entry &entry);
+
+  /// Return true if the segments of the trace carry summaries.
+  bool hasSummaries() const { return summaries; }
+
+  /// Return the summaries of the segments of which next() has returned
+  /// records so far, in the order in which they were first returned.
+  const std::vector<SummaryRange> &getSummaries() const { return ranges; }
+
+private:
+  /// The location of one segment within the trace file
+  struct Segment {
+    int fd;            ///< The file holding the segment
+    uint64_t offset;   ///< Offset of the records following the header
+    uint64_t size;     ///< Size in bytes of the records
+    uint64_t thread;   ///< The thread which wrote the segment
+    uint64_t firstSeq; ///< Sequence number of the first record
+    unsigned count;    ///< Number of records in the segment
+    SegmentSummary summary; ///< The summary, if the trace has summaries
+  };
+
+  /// The records written by one thread
+  struct ThreadStream {
+    std::vector<Segment> segments; ///< The segments in file order
+    unsigned nextSegment; ///< Index of the next segment to load
+    std::vector<Entry> entries; ///< Records of the loaded segment
+    std::vector<uint64_t> seqs; ///< Sequence numbers of the loaded segment
+    unsigned pos; ///< Position of the next record in the loaded segment
+    unsigned long range; ///< Index of the range of the loaded segment
+  };
+
+  /// The head of one thread stream in the merge queue
+  typedef std::pair<uint64_t, unsigned> Head;
+
+  /// Scan the segment headers of a segmented trace, and of its per-thread
+  /// trace files.
+  bool openSegments(const std::string &Filename,
+                    const TraceHeader &header,
+                    uint64_t fileSize);
+
+  /// Scan the segment headers of one file, starting at the given offset, and
+  /// add the segments to the streams of their threads.
+  void scanSegments(int file,
+                    uint64_t offset,
+                    uint64_t fileSize,
+                    std::map<uint64_t, unsigned> &threadStreams);
+
+  /// Load the next segment of the stream.
+  /// \return false if the stream is exhausted.
+  bool loadSegment(ThreadStream &stream);
+
+  /// Read the payload of a segment into the encoded buffer, decompressing it
+  /// if the trace is compressed.
+  bool readPayload(const Segment &S);
+
+  /// Copy the fixed-size records of a segment of a compressed trace.
+  bool copySegment(const Segment &S, ThreadStream &stream);
+
+  /// Decode the records of a segment of a compact trace.
+  bool decodeSegment(const Segment &S, ThreadStream &stream);
+
+  /// Push the next record of the specified stream into the merge queue.
+  void pushHead(unsigned index);
+
+  bool nextFlat(Entry &entry);
+  bool nextMerged(Entry &entry);
+
+private:
+  int fd; ///< The trace file
+  std::vector<int> threadFiles; ///< The per-thread trace files
+  bool flat; ///< Whether the trace is a flat array of entries
+  bool compact; ///< Whether the records are in the compact format
+  bool sequenced; ///< Whether the segments store sequence numbers
+  bool compressed; ///< Whether the payload of the segments is compressed
+  bool summaries; ///< Whether every segment ends with a summary
+  bool done; ///< Whether the END record was returned
+  unsigned long numEntries; ///< Upper bound of the number of entries
+  unsigned long position; ///< Number of entries returned by next()
+
+  /// Buffer for reading flat traces
+  std::vector<Entry> buffer;
+  unsigned bufferPos; ///< Position of the next entry in the buffer
+  unsigned bufferEnd; ///< Number of valid entries in the buffer
+
+  /// The streams of each thread of a segmented trace
+  std::vector<ThreadStream> streams;
+
+  /// Buffer for reading the encoded records of a segment
+  std::vector<unsigned char> encoded;
+
+  /// Buffer for reading the compressed payload of a segment
+  std::vector<unsigned char> packed;
+
+  /// The summaries of the segments of which records were returned
+  std::vector<SummaryRange> ranges;
+
+  /// Min-heap of the next sequence number of each stream
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+};
+
+} // END namespace giri
+
+#endif
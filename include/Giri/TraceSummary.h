@@ -0,0 +1,164 @@
+//===- TraceSummary.h - Summaries of the segments of a trace ----*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines how the SegmentSummary at the end of every segment of a
+// trace with summaries (TF_Summaries) is built and queried. It is shared by
+// the run-time, which summarizes the records of a segment when it writes the
+// segment, and by the readers of the trace, which skip the segments whose
+// summary proves that they hold no record of interest.
+//
+// The identifier filter is a Bloom filter with two bits for every pair of a
+// record type and an identifier. The thread set has one bit for every thread
+// index modulo its size. Neither depends on the order of the records, so the
+// summaries of several segments can be merged by or-ing them.
+//
+// The functions do not allocate memory, so the run-time can also summarize
+// segments in a signal handler.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_TRACESUMMARY_H
+#define GIRI_TRACESUMMARY_H
+
+#include "Giri/TraceEncoding.h"
+
+#include <string.h>
+
+namespace TraceSummary {
+
+/// Number of bits of the identifier filter
+static const unsigned FilterBits = GIRI_SUMMARY_FILTER_WORDS * 64;
+
+/// Number of bits of the thread set
+static const unsigned ThreadBits = GIRI_SUMMARY_THREAD_WORDS * 64;
+
+static inline void setBit(uint64_t *words, unsigned bit) {
+  words[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+static inline bool testBit(const uint64_t *words, unsigned bit) {
+  return words[bit / 64] & (uint64_t(1) << (bit % 64));
+}
+
+/// Compute the two bits of the identifier filter of a type and an id.
+static inline void filterBits(RecordType type,
+                              unsigned id,
+                              unsigned &first,
+                              unsigned &second) {
+  uint64_t key = (static_cast<uint64_t>(id) << 4) | encodeType(type);
+  uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+  first = (hash >> 40) % FilterBits;
+  second = (hash >> 20) % FilterBits;
+}
+
+} // END namespace TraceSummary
+
+/// Reset the summary to the one of an empty segment.
+static inline void clearSummary(SegmentSummary &summary) {
+  memset(&summary, 0, sizeof(summary));
+  summary.minAddress = ~uint64_t(0);
+}
+
+/// Add one record to the summary. The sequence numbers of the summary are
+/// set by summarize().
+static inline void addToSummary(SegmentSummary &summary, const Entry &entry) {
+  using namespace TraceSummary;
+  ++summary.counts[encodeType(entry.type)];
+  setBit(summary.threads, entry.tid % ThreadBits);
+
+  if (isDataAddress(entry.type)) {
+    // An access of zero bytes still overlaps accesses of the same address.
+    uint64_t end = entry.address + (entry.length ? entry.length : 1);
+    if (entry.address < summary.minAddress)
+      summary.minAddress = entry.address;
+    if (end > summary.maxAddress)
+      summary.maxAddress = end;
+  }
+
+  if (entry.type != RecordType::ENType && entry.type != RecordType::THType) {
+    unsigned first, second;
+    filterBits(entry.type, entry.id, first, second);
+    setBit(summary.ids, first);
+    setBit(summary.ids, second);
+  }
+}
+
+/// Summarize count records whose sequence numbers are given, or follow
+/// firstSeq if seqs is null.
+static inline void summarize(SegmentSummary &summary,
+                             const Entry *entries,
+                             const uint64_t *seqs,
+                             unsigned long count,
+                             uint64_t firstSeq) {
+  clearSummary(summary);
+  if (count == 0)
+    return;
+  summary.firstSeq = seqs ? seqs[0] : firstSeq;
+  summary.lastSeq = seqs ? seqs[count - 1] : firstSeq + count - 1;
+  for (unsigned long i = 0; i < count; ++i)
+    addToSummary(summary, entries[i]);
+}
+
+/// Merge the summary of another segment into the summary.
+static inline void mergeSummary(SegmentSummary &summary,
+                                const SegmentSummary &other) {
+  if (other.firstSeq < summary.firstSeq)
+    summary.firstSeq = other.firstSeq;
+  if (other.lastSeq > summary.lastSeq)
+    summary.lastSeq = other.lastSeq;
+  for (unsigned i = 0; i < GIRI_NUM_RECORD_TYPES; ++i)
+    summary.counts[i] += other.counts[i];
+  if (other.minAddress < summary.minAddress)
+    summary.minAddress = other.minAddress;
+  if (other.maxAddress > summary.maxAddress)
+    summary.maxAddress = other.maxAddress;
+  for (unsigned i = 0; i < GIRI_SUMMARY_THREAD_WORDS; ++i)
+    summary.threads[i] |= other.threads[i];
+  for (unsigned i = 0; i < GIRI_SUMMARY_FILTER_WORDS; ++i)
+    summary.ids[i] |= other.ids[i];
+}
+
+/// Return false if the segment provably holds no record of the thread.
+static inline bool summaryMayHoldThread(const SegmentSummary &summary,
+                                        ThreadIndex tid) {
+  return TraceSummary::testBit(summary.threads,
+                               tid % TraceSummary::ThreadBits);
+}
+
+/// Return false if the segment provably holds no record of the given type.
+static inline bool summaryMayHoldType(const SegmentSummary &summary,
+                                      RecordType type) {
+  return summary.counts[encodeType(type)];
+}
+
+/// Return false if the segment provably holds no record of the given type
+/// and id.
+static inline bool summaryMayHoldID(const SegmentSummary &summary,
+                                    RecordType type,
+                                    unsigned id) {
+  using namespace TraceSummary;
+  if (!summaryMayHoldType(summary, type))
+    return false;
+  unsigned first, second;
+  filterBits(type, id, first, second);
+  return testBit(summary.ids, first) && testBit(summary.ids, second);
+}
+
+/// Return false if the segment provably holds no load or store of the given
+/// type which overlaps the length bytes at address.
+static inline bool summaryMayHoldAccess(const SegmentSummary &summary,
+                                        RecordType type,
+                                        uint64_t address,
+                                        uint64_t length) {
+  return summaryMayHoldType(summary, type) &&
+         address < summary.maxAddress &&
+         summary.minAddress < address + (length ? length : 1);
+}
+
+#endif
@@ -0,0 +1,102 @@
+//===- ProfileSrcLines.h - Rank source lines by trace records ---*- C++ -*-===//
+//
+//                      Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines a pass which joins the execution profile written by the
+// run-time (GIRI_PROFILE) with the source line information of the module.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DG_PROFILESRCLINES_H
+#define DG_PROFILESRCLINES_H
+
+#include "Giri/Runtime.h"
+#include "Utility/BasicBlockNumbering.h"
+#include "Utility/LoadStoreNumbering.h"
+
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace dg {
+
+/// \class This pass reports the functions and source lines which produce the
+/// most records of a trace, using the execution profile of the trace.
+struct ProfileSrcLines : public ModulePass {
+public:
+  static char ID;
+
+  ProfileSrcLines() : ModulePass(ID) {}
+
+  /// Entry point for this LLVM pass. Read the execution profile and print
+  /// the functions and source lines ranked by their number of records.
+  ///
+  /// \param M - The module to analyze.
+  /// @return false - The module was not modified.
+  virtual bool runOnModule(Module &M);
+
+  const char *getPassName() const {
+    return "Rank source lines by the records of a trace";
+  }
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    // We will need the ID numbers of basic blocks
+    AU.addRequiredTransitive<QueryBasicBlockNumbers>();
+
+    // We will need the ID numbers of loads and stores
+    AU.addRequiredTransitive<QueryLoadStoreNumbers>();
+
+    // This pass is an analysis pass, so it does not modify anything
+    AU.setPreservesAll();
+  };
+
+  /// The records of one function or source line, by record type
+  struct Records {
+    Records() : blocks(0), loads(0), stores(0) {}
+
+    uint64_t total() const { return blocks + loads + stores; }
+
+    uint64_t blocks;
+    uint64_t loads;
+    uint64_t stores;
+  };
+
+  /// Read the counters of an execution profile.
+  /// \return the number of records of the trace.
+  uint64_t readProfile(const std::string &profile_file,
+                       std::vector<ProfileCounter> &counters);
+
+  /// Add the counters to the functions and source lines they belong to.
+  void attributeCounters(const std::vector<ProfileCounter> &counters);
+
+  /// Print the entries of the map ranked by their number of records.
+  void printRanking(raw_ostream &Output,
+                    const std::string &title,
+                    const std::map<std::string, Records> &records,
+                    uint64_t numRecords);
+
+private:
+  /// Return the source line of the first instruction of the basic block which
+  /// has one, or "NIL".
+  std::string locateBlock(BasicBlock *BB);
+
+  const QueryBasicBlockNumbers *bbNumPass;
+  const QueryLoadStoreNumbers  *lsNumPass;
+
+  std::map<std::string, Records> FunctionRecords;
+  std::map<std::string, Records> LineRecords;
+};
+
+} // END namespace dg
+
+#endif
@@ -71,6 +71,39 @@ static inline Instruction *skipAllocas (BasicBlock &BB) {
   return BB.getTerminator();
 }
 
+/// Determines whether the address of an alloca never escapes: the alloca is
+/// only read and written by load and store instructions which use it as their
+/// pointer operand. Its memory can then only be accessed by the activation of
+/// the function which allocated it, and its dependences follow from the order
+/// of the instructions which the activation executed.
+///
+/// \param AI - The alloca to analyze.
+/// \return true if the address of the alloca does not escape.
+static inline bool isLocalAlloca(const AllocaInst *AI) {
+  if (AI->isArrayAllocation())
+    return false;
+  for (Value::const_use_iterator U = AI->use_begin(); U != AI->use_end(); ++U) {
+    if (const LoadInst *LI = dyn_cast<LoadInst>(*U)) {
+      if (LI->isVolatile())
+        return false;
+    } else if (const StoreInst *SI = dyn_cast<StoreInst>(*U)) {
+      // Storing the address itself lets it escape.
+      if (SI->getPointerOperand() != AI || SI->isVolatile())
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// This function returns the alloca accessed through the pointer if its
+/// address does not escape, or NULL.
+static inline const AllocaInst *getLocalAlloca(const Value *Pointer) {
+  const AllocaInst *AI = dyn_cast<AllocaInst>(Pointer);
+  return AI && isLocalAlloca(AI) ? AI : nullptr;
+}
+
 //===----------------------------------------------------------------------===//
 //          Simple factory for string constants
 //===----------------------------------------------------------------------===//
@@ -267,8 +300,16 @@ static inline bool isTracerFunction(Function *fun) {
           name == "recordStrcatStore" ||
           name == "recordLock" ||
           name == "recordUnlock" ||
+          name == "recordSync" ||
+          name == "recordBatch" ||
+          name == "recordBlockBatch" ||
+          name == "recordStrided" ||
+          name == "recordFunctionEntry" ||
+          name == "recordBranch" ||
           name == "recordCall" ||
           name == "recordInit" ||
+          name == "giri_trace_enable" ||
+          name == "giri_trace_disable" ||
           name == "trace_fn_start" ||
           name == "trace_fn_end" ||
           name == "ddgtrace_init" ||
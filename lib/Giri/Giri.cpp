@@ -64,6 +64,107 @@ STATISTIC(NumDynSources, "Number of Dynamic Sources Queried");
 STATISTIC(NumDynValsSkipped, "Number of Dynamic Values Skipped");
 STATISTIC(NumLoadsTraced, "Number of Dynamic Loads Traced");
 STATISTIC(NumLoadsLost, "Number of Dynamic Loads Lost");
+STATISTIC(NumLoadsAtGaps, "Number of Dynamic Loads Ending at a Trace Gap");
+
+//===----------------------------------------------------------------------===//
+//                        Slicing Criteria
+//===----------------------------------------------------------------------===//
+
+bool giri::findSlicingCriteria(Module &M,
+                               std::vector<Instruction *> &Criteria) {
+  if (!StartOfSliceLoc.empty()) {
+    // User specified the line number of the source code. This is very useful
+    // if the user won't bother to dive into the IR of the program. We compare
+    // the file name and the loc with all the instructions of the module. Note
+    // that there will be more than one instruction in this case, and we'll
+    // treat the *last* one of them as the criterion.
+    std::ifstream StartOfSlice(StartOfSliceLoc);
+    if (!StartOfSlice.is_open()) {
+      errs() << "Error opening criterion file: " << StartOfSliceLoc << "\n";
+      return false;
+    }
+    std::string StartFilename;
+    unsigned StartLoc = 0;
+    while (StartOfSlice >> StartFilename >> StartLoc) {
+      if (StartLoc == 0) {
+        errs() << "Error reading criterion file: " << StartOfSliceLoc << "\n";
+        break;
+      }
+      DEBUG(dbgs() << "Start slicing Filename:Loc is defined as "
+                   << StartFilename << ":" << StartLoc << "\n");
+
+      Instruction *Criterion = nullptr;
+      for (Module::iterator F = M.begin(); F != M.end(); ++F)
+        for (inst_iterator I = inst_begin(F); I != inst_end(F); ++I)
+          if (MDNode *N = I->getMetadata("dbg")) {
+            DILocation l(N);
+            if (l.getFilename().str() == StartFilename &&
+                l.getLineNumber() == StartLoc)
+              Criterion = &*I;
+          }
+
+      if (Criterion != nullptr) {
+        DEBUG(dbgs() << "Found instruction matching the LoC: ");
+        DEBUG(Criterion->dump());
+        Criteria.push_back(Criterion);
+      } else
+        errs() << "Didn't find the instruction of " << StartFilename << ":"
+               << StartLoc << "\n";
+      StartLoc = 0; // reset the LoC for error checking of while
+    }
+  } else if (!StartOfSliceInst.empty()) {
+    // User specified the slicing criterion by the inst command, with the
+    // function name and the instruction count. The instruction count can be
+    // known with the help of SourcceLineMapping pass. We simply count the
+    // number of instructions until the count matches.
+    std::ifstream StartOfSlice(StartOfSliceInst);
+    if (!StartOfSlice.is_open()) {
+      errs() << "Error opening criterion file: " << StartOfSliceInst << "\n";
+      return false;
+    }
+    std::string StartFunction;
+    unsigned StartInst = 0;
+    while (StartOfSlice >> StartFunction >> StartInst) {
+      if (StartInst == 0) {
+        errs() << "Error reading criterion file: " << StartOfSliceInst << "\n";
+        break;
+      }
+      DEBUG(dbgs() << "Start slicing Function:Instruction is defined as "
+                   << StartFunction << ":" << StartInst << "\n");
+
+      Function *Func = M.getFunction(StartFunction);
+      Instruction *Criterion = nullptr;
+      // Scan the function to find the slicing criterion by inst number
+      if (Func)
+        for (inst_iterator I = inst_begin(Func), E = inst_end(Func); I != E;
+             ++I)
+          if (--StartInst == 0) {
+            Criterion = &*I;
+            break;
+          }
+
+      if (Criterion != nullptr) {
+        DEBUG(dbgs() << "The start of slice instruction is: ");
+        DEBUG(Criterion->dump());
+        Criteria.push_back(Criterion);
+      } else
+        errs() << "Didn't find the instruction of " << StartFunction << "\n";
+      StartInst = 0; // reset the inst number for error checking of while
+    }
+  } else if (Function *Func = M.getFunction("main")) {
+    // In this case, the user did not specify the slicing criterion, i.e. the
+    // start of the slicing instruction. Thus we simply use the first return
+    // instruction in the main function as the slicing criterion.
+    for (inst_iterator I = inst_begin(Func), E = inst_end(Func); I != E; ++I)
+      if (isa<ReturnInst>(*I)) {
+        DEBUG(dbgs() << "The start of slice instruction is: " << "\n");
+        DEBUG(I->dump());
+        Criteria.push_back(&*I);
+        break;
+      }
+  }
+  return true;
+}
 
 //===----------------------------------------------------------------------===//
 //                       DynamicGiri Implementations
@@ -243,6 +344,7 @@ void DynamicGiri::findSlice(DynValue &Initial,
   // Update the statistics on lost loads.
   NumLoadsTraced = Trace->totalLoadsTraced;
   NumLoadsLost = Trace->lostLoadsTraced;
+  NumLoadsAtGaps = Trace->gapLoadsTraced;
 }
 
 void DynamicGiri::printBackwardsSlice(const Instruction *Criterion,
@@ -324,114 +426,15 @@ bool DynamicGiri::runOnModule(Module &M) {
   // FIXME:
   //  This code should not be here.  It should be in a separate pass that
   //  queries this pass as an analysis pass.
-
-  if (!StartOfSliceLoc.empty()) {
-    // User specified the line number of the source code. This is very useful
-    // if the user won't bother to dive into the IR of the program. We compare
-    // the file name and the loc with all the instructions of the module. Note
-    // that there will be more than one instruction in this case, and we'll
-    // treat the *last* one of them as the criterion.
-    std::ifstream StartOfSlice(StartOfSliceLoc);
-    if (!StartOfSlice.is_open()) {
-      errs() << "Error opening criterion file: " << StartOfSliceLoc << "\n";
-      return false;
-    }
-    std::string StartFilename;
-    unsigned StartLoc = 0;
-    while (StartOfSlice >> StartFilename >> StartLoc) {
-      if (StartLoc == 0) {
-        errs() << "Error reading criterion file: " << StartOfSliceLoc << "\n";
-        break;
-      }
-      dbgs() << "Start slicing Filename:Loc is defined as "
-             << StartFilename << ":" << StartLoc << "\n";
-
-      Instruction *Criterion = nullptr;
-      for (Module::iterator F = M.begin(); F != M.end(); ++F)
-        for (inst_iterator I = inst_begin(F); I != inst_end(F); ++I)
-          if (MDNode *N = I->getMetadata("dbg")) { 
-            DILocation l(N);
-            if (l.getFilename().str() == StartFilename &&
-                l.getLineNumber() == StartLoc) {
-              Criterion = &*I;
-              DEBUG(dbgs() << "Found instruction matching the LoC: ");
-              DEBUG(Criterion->dump());
-            }
-          }
-
-      if (Criterion != nullptr) {
-        std::set<Value *> Slice;
-        std::unordered_set<DynValue> DynSlice;
-        std::set<DynValue *> DataFlowGraph;
-        getBackwardsSlice(Criterion, Slice, DynSlice, DataFlowGraph);
-        printBackwardsSlice(Criterion, Slice, DynSlice, DataFlowGraph);
-      } else
-        errs() << "Didin't find the starting instruction to slice.\n";
-      StartLoc = 0; // reset the LoC for error checking of while
-    }
-    StartOfSlice.close();
-  } else if (!StartOfSliceInst.empty()) {
-    // User specified the slicing criterion by the inst command, with the
-    // function name and the instruction count. The instruction count can be
-    // known with the help of SourcceLineMapping pass. We simply count the
-    // number of instructions until the count matches.
-    std::ifstream StartOfSlice(StartOfSliceInst);
-    if (!StartOfSlice.is_open()) {
-      errs() << "Error opening criterion file: " << StartOfSliceInst << "\n";
-      return false;
-    }
-    std::string StartFunction;
-    unsigned StartInst = 0;
-    while (StartOfSlice >> StartFunction >> StartInst) {
-      if (StartInst == 0) {
-        errs() << "Error reading criterion file: " << StartOfSliceInst << "\n";
-        break;
-      }
-      dbgs() << "Start slicing Function:Instruction is defined as "
-             << StartFunction << ":" << StartInst << "\n";
-
-      Function *Func = M.getFunction(StartFunction);
-      assert(Func);
-      Instruction *Criterion = nullptr;
-      // Scan the function to find the slicing criterion by inst number
-      for (inst_iterator I = inst_begin(Func), E = inst_end(Func); I != E; ++I)
-        if (--StartInst == 0) {
-          Criterion = &*I;
-          DEBUG(dbgs() << "The start of slice instruction is: ");
-          DEBUG(Criterion->dump());
-          break;
-        }
-
-      if (Criterion != nullptr) {
-        std::set<Value *> Slice;
-        std::unordered_set<DynValue> DynSlice;
-        std::set<DynValue *> DataFlowGraph;
-        getBackwardsSlice(Criterion, Slice, DynSlice, DataFlowGraph);
-        printBackwardsSlice(Criterion, Slice, DynSlice, DataFlowGraph);
-      } else
-        errs() << "Didin't find the starting instruction to slice.\n";
-      StartInst = 0; // reset the inst number for error checking of while
-    }
-    StartOfSlice.close();
-  } else {
-    // In this case, the user did not specify the slicing criterion, i.e. the
-    // start of the slicing instruction. Thus we simply use the first return
-    // instruction in the main function as the slicing criterion.
-    Function *Func = M.getFunction("main");
-    if (!Func)
-      return false;
-
-    for (inst_iterator I = inst_begin(Func), E = inst_end(Func); I != E; ++I)
-      if (isa<ReturnInst>(*I)) {
-        DEBUG(dbgs() << "The start of slice instruction is: " << "\n");
-        DEBUG(I->dump());
-        std::set<Value *> Slice;
-        std::unordered_set<DynValue> DynSlice;
-        std::set<DynValue *> DataFlowGraph;
-        getBackwardsSlice(&*I, Slice, DynSlice, DataFlowGraph);
-        printBackwardsSlice(&*I, Slice, DynSlice, DataFlowGraph);
-        break;
-      }
+  std::vector<Instruction *> Criteria;
+  if (!findSlicingCriteria(M, Criteria))
+    return false;
+  for (unsigned index = 0; index < Criteria.size(); ++index) {
+    std::set<Value *> Slice;
+    std::unordered_set<DynValue> DynSlice;
+    std::set<DynValue *> DataFlowGraph;
+    getBackwardsSlice(Criteria[index], Slice, DynSlice, DataFlowGraph);
+    printBackwardsSlice(Criteria[index], Slice, DynSlice, DataFlowGraph);
   }
 
   // This is an analysis pass, so always return false.
@@ -0,0 +1,229 @@
+//===- StaticSlice.cpp - Static Backwards Slice Analysis ------------------===//
+//
+//                          Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a pass which finds a conservative static backwards
+// slice of the slicing criteria. Only the loads, stores and selects in it can
+// affect the criteria, so the tracing pass needs to record no other.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "giri"
+
+#include "Giri/Giri.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/InstIterator.h"
+
+using namespace llvm;
+using namespace giri;
+
+//===----------------------------------------------------------------------===//
+//                        Pass Statistics
+//===----------------------------------------------------------------------===//
+
+STATISTIC(NumCriteria, "Number of slicing criteria of the static slice");
+STATISTIC(NumSliceValues, "Number of instructions and arguments in the "
+                          "static slice");
+
+//===----------------------------------------------------------------------===//
+//                        StaticSlice Implementations
+//===----------------------------------------------------------------------===//
+
+char StaticSlice::ID = 0;
+
+static RegisterPass<StaticSlice>
+X("static-slice", "Static Backwards Slice Analysis", false, true);
+
+void StaticSlice::findWritersAndCalls(Module &M) {
+  for (Module::iterator F = M.begin(); F != M.end(); ++F)
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+      CallSite CS(&*I);
+      if (CS) {
+        Function *Callee = CS.getCalledFunction();
+        if (Callee)
+          DirectCalls[Callee].push_back(&*I);
+        else
+          IndirectCalls.push_back(&*I);
+
+        // The stores of a defined function are writers themselves.
+        if (Callee && !Callee->isDeclaration())
+          continue;
+      }
+      if (I->mayWriteToMemory())
+        Writers.push_back(&*I);
+    }
+}
+
+void StaticSlice::add(Value *V) {
+  if (!isa<Instruction>(V) && !isa<Argument>(V))
+    return;
+  if (Slice.insert(V).second)
+    Worklist.push_back(V);
+}
+
+std::vector<Instruction *> StaticSlice::getCallSites(Function *F) {
+  std::vector<Instruction *> CallSites = DirectCalls[F];
+  if (F->hasAddressTaken())
+    CallSites.insert(CallSites.end(),
+                     IndirectCalls.begin(), IndirectCalls.end());
+  return CallSites;
+}
+
+void StaticSlice::addControlDependences(BasicBlock *BB) {
+  // The post-dominance frontier of a function is only valid until another
+  // function is analyzed, so the control dependences of all of its basic
+  // blocks are found at once.
+  if (!ControlDeps.count(BB)) {
+    Function *F = BB->getParent();
+    PostDominanceFrontier &PDF = getAnalysis<PostDominanceFrontier>(*F);
+    for (Function::iterator bb = F->begin(); bb != F->end(); ++bb) {
+      std::vector<BasicBlock *> &Deps = ControlDeps[bb];
+      PostDominanceFrontier::iterator i = PDF.find(bb);
+      if (i != PDF.end())
+        Deps.insert(Deps.end(), i->second.begin(), i->second.end());
+    }
+  }
+
+  std::vector<BasicBlock *> &Deps = ControlDeps[BB];
+  for (unsigned index = 0; index < Deps.size(); ++index)
+    add(Deps[index]->getTerminator());
+}
+
+void StaticSlice::addCallers(Function *F) {
+  std::vector<Function *> Functions(1, F);
+  while (!Functions.empty()) {
+    Function *Callee = Functions.back();
+    Functions.pop_back();
+    if (!Called.insert(Callee).second)
+      continue;
+
+    std::vector<Instruction *> CallSites = getCallSites(Callee);
+    for (unsigned index = 0; index < CallSites.size(); ++index) {
+      BasicBlock *BB = CallSites[index]->getParent();
+      addControlDependences(BB);
+      Functions.push_back(BB->getParent());
+    }
+  }
+}
+
+void StaticSlice::addReturns(CallSite CS) {
+  std::vector<Function *> Callees;
+  if (Function *Callee = CS.getCalledFunction()) {
+    Callees.push_back(Callee);
+  } else {
+    Module *M = CS.getInstruction()->getParent()->getParent()->getParent();
+    for (Module::iterator F = M->begin(); F != M->end(); ++F)
+      if (F->hasAddressTaken())
+        Callees.push_back(F);
+  }
+
+  for (unsigned index = 0; index < Callees.size(); ++index)
+    for (Function::iterator BB = Callees[index]->begin();
+         BB != Callees[index]->end(); ++BB)
+      if (isa<ReturnInst>(BB->getTerminator()))
+        add(BB->getTerminator());
+}
+
+void StaticSlice::addMemoryDependences(Instruction *I) {
+  // The locations read by the instruction, or none if it may read any.
+  std::vector<AliasAnalysis::Location> Locations;
+  bool readsAny = false;
+  CallSite CS(I);
+  if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+    Locations.push_back(AA->getLocation(LI));
+  } else if (CS) {
+    if (!AA->onlyAccessesArgPointees(AA->getModRefBehavior(CS))) {
+      readsAny = true;
+    } else {
+      for (CallSite::arg_iterator A = CS.arg_begin(); A != CS.arg_end(); ++A)
+        if ((*A)->getType()->isPointerTy())
+          Locations.push_back(AliasAnalysis::Location(*A));
+    }
+  } else {
+    readsAny = true;
+  }
+
+  for (unsigned index = 0; index < Writers.size(); ++index) {
+    Instruction *W = Writers[index];
+    bool mayWrite = readsAny;
+    for (unsigned l = 0; !mayWrite && l < Locations.size(); ++l)
+      mayWrite = AA->getModRefInfo(W, Locations[l]) & AliasAnalysis::Mod;
+    if (mayWrite)
+      add(W);
+  }
+}
+
+void StaticSlice::addDependences(Value *V) {
+  // An argument depends on the values passed by the call sites.
+  if (Argument *A = dyn_cast<Argument>(V)) {
+    std::vector<Instruction *> CallSites = getCallSites(A->getParent());
+    for (unsigned index = 0; index < CallSites.size(); ++index) {
+      CallSite CS(CallSites[index]);
+      if (A->getArgNo() < CS.arg_size())
+        add(CS.getArgument(A->getArgNo()));
+    }
+    return;
+  }
+
+  Instruction *I = cast<Instruction>(V);
+  for (User::op_iterator O = I->op_begin(); O != I->op_end(); ++O)
+    add(*O);
+
+  // The instruction is executed if its function is called and the branches
+  // on which its basic block is control dependent are taken.
+  addControlDependences(I->getParent());
+  addCallers(I->getParent()->getParent());
+
+  // The incoming value of a phi is chosen by the branch to its basic block.
+  if (PHINode *PN = dyn_cast<PHINode>(I))
+    for (unsigned index = 0; index < PN->getNumIncomingValues(); ++index)
+      add(PN->getIncomingBlock(index)->getTerminator());
+
+  CallSite CS(I);
+  if (CS) {
+    Function *Callee = CS.getCalledFunction();
+    if (!Callee || !Callee->isDeclaration())
+      addReturns(CS);
+    // The loads of a defined function are in its body, but an external
+    // function reads memory unseen.
+    if ((!Callee || Callee->isDeclaration()) && I->mayReadFromMemory())
+      addMemoryDependences(I);
+  } else if (I->mayReadFromMemory()) {
+    addMemoryDependences(I);
+  }
+}
+
+bool StaticSlice::runOnModule(Module &M) {
+  AA = &getAnalysis<AliasAnalysis>();
+
+  std::vector<Instruction *> Criteria;
+  if (!findSlicingCriteria(M, Criteria) || Criteria.empty())
+    report_fatal_error("No slicing criterion for the static slice!");
+  NumCriteria = Criteria.size();
+
+  findWritersAndCalls(M);
+  for (unsigned index = 0; index < Criteria.size(); ++index) {
+    DEBUG(dbgs() << "Static slicing criterion: ");
+    DEBUG(Criteria[index]->dump());
+    add(Criteria[index]);
+  }
+
+  while (!Worklist.empty()) {
+    Value *V = Worklist.front();
+    Worklist.pop_front();
+    addDependences(V);
+  }
+  NumSliceValues = Slice.size();
+
+  // This is an analysis pass, so always return false.
+  return false;
+}
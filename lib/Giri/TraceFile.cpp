@@ -14,16 +14,22 @@
 #define DEBUG_TYPE "giri"
 
 #include "Giri/TraceFile.h"
+#include "Giri/TraceReader.h"
+#include "Giri/TraceSummary.h"
+#include "Utility/Utils.h"
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
 
 #include <cassert>
+#include <map>
 #include <vector>
 #include <iostream>
 #include <fcntl.h>
@@ -42,6 +48,499 @@ using namespace std;
 STATISTIC(NumStaticBuggyVal, "Num. of possible missing matched static values");
 STATISTIC(NumDynBuggyVal, "Number of possible missing matched dynamic values");
 
+//===----------------------------------------------------------------------===//
+//                        Command Line Arguments
+//===----------------------------------------------------------------------===//
+// The option of the tracing pass (TracingNoGiri.cpp), which tells whether the
+// trace has the records of the loads of local allocas
+extern cl::opt<bool> TraceLocalAllocas;
+
+//===----------------------------------------------------------------------===//
+//                          Segment Index
+//===----------------------------------------------------------------------===//
+
+/// Add the range to the blocks, merging it into the last block if they
+/// overlap. The ranges must be added in the order of their first index.
+static void addBlock(SegmentIndex::BlockList &blocks,
+                     const TraceReader::SummaryRange &R) {
+  if (!blocks.empty() && R.first <= blocks.back().last) {
+    SegmentIndex::Block &last = blocks.back();
+    last.last = std::max(last.last, R.last);
+    mergeSummary(last.summary, R.summary);
+    return;
+  }
+  SegmentIndex::Block block = { R.first, R.last, R.summary };
+  blocks.push_back(block);
+}
+
+void SegmentIndex::build(const std::vector<TraceReader::SummaryRange> &ranges) {
+  enabled = true;
+  byThread.resize(TraceSummary::ThreadBits);
+  for (auto R = ranges.begin(); R != ranges.end(); ++R) {
+    addBlock(all, *R);
+    for (unsigned bucket = 0; bucket < byThread.size(); ++bucket)
+      if (summaryMayHoldThread(R->summary, bucket))
+        addBlock(byThread[bucket], *R);
+  }
+  DEBUG(dbgs() << "Indexed " << ranges.size() << " trace segments in "
+               << all.size() << " blocks\n");
+}
+
+//===----------------------------------------------------------------------===//
+//                          Synchronization Order
+//===----------------------------------------------------------------------===//
+
+/// Merge the clock other into the clock.
+/// \return true if the clock changed.
+static bool joinClock(vector<uint64_t> &clock, const vector<uint64_t> &other) {
+  bool changed = false;
+  for (unsigned i = 0; i < other.size(); ++i) {
+    if (other[i] > clock[i]) {
+      clock[i] = other[i];
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/// The thread records of a trace by pthread_t: their index in the trace and
+/// the index of their thread
+typedef map<uintptr_t, vector<pair<unsigned long, ThreadIndex>>> ThreadRecords;
+
+/// Find the index of the thread whose thread record, with the pthread_t, is
+/// the last one before the index.
+/// \return false if there is no such thread.
+static bool findThread(const ThreadRecords &threads,
+                       uintptr_t pthread,
+                       unsigned long index,
+                       ThreadIndex &tid) {
+  auto T = threads.find(pthread);
+  if (T == threads.end())
+    return false;
+  auto I = upper_bound(T->second.begin(), T->second.end(),
+                       make_pair(index, ThreadIndex(0)));
+  if (I == T->second.begin())
+    return false;
+  tid = (--I)->second;
+  return true;
+}
+
+void SyncOrder::build(const Entry *trace, unsigned long maxIndex) {
+  // Find the threads by their pthread_t, and the creation of every thread,
+  // which may be recorded after the first records of the new thread. Each
+  // SK_ThreadCreated record belongs to the last SK_ThreadCreate record of its
+  // thread.
+  ThreadRecords threads;
+  map<uintptr_t, vector<unsigned long>> creations;
+  vector<unsigned long> lastCreate;
+  unsigned numThreads = 0;
+  for (unsigned long index = 0; index <= maxIndex; ++index) {
+    const Entry &entry = trace[index];
+    if (entry.type == RecordType::ENType)
+      continue;
+    numThreads = std::max(numThreads, entry.tid + 1u);
+    if (entry.type == RecordType::THType) {
+      threads[entry.address].push_back(make_pair(index, entry.tid));
+    } else if (entry.type == RecordType::SYType) {
+      enabled = true;
+      if (entry.tid >= lastCreate.size())
+        lastCreate.resize(entry.tid + 1, ~0ul);
+      if (entry.length == SK_ThreadCreate)
+        lastCreate[entry.tid] = index;
+      else if (entry.length == SK_ThreadCreated && entry.address &&
+               lastCreate[entry.tid] != ~0ul)
+        creations[entry.address].push_back(lastCreate[entry.tid]);
+    }
+  }
+  if (!enabled)
+    return;
+
+  // A thread was created by the last creation of its pthread_t before its
+  // thread record.
+  vector<unsigned long> createdBy(numThreads, ~0ul);
+  for (auto T = threads.begin(); T != threads.end(); ++T) {
+    auto C = creations.find(T->first);
+    if (C == creations.end())
+      continue;
+    std::sort(C->second.begin(), C->second.end());
+    for (auto I = T->second.begin(); I != T->second.end(); ++I) {
+      auto Create = lower_bound(C->second.begin(), C->second.end(), I->first);
+      if (Create != C->second.begin() && createdBy[I->second] == ~0ul)
+        createdBy[I->second] = *--Create;
+    }
+  }
+
+  // Run the vector clocks forward through the trace.
+  vector<VectorClock> clocks(numThreads);
+  map<uintptr_t, VectorClock> objects;
+  map<unsigned long, VectorClock> created;
+  snapshots.resize(numThreads);
+  for (unsigned long index = 0; index <= maxIndex; ++index) {
+    const Entry &entry = trace[index];
+    if (entry.type == RecordType::ENType)
+      continue;
+    ThreadIndex tid = entry.tid;
+    VectorClock &clock = clocks[tid];
+    bool changed = false;
+    if (clock.empty()) {
+      // The first record of the thread starts its clock.
+      clock.resize(numThreads);
+      auto C = created.find(createdBy[tid]);
+      if (C != created.end())
+        clock = C->second;
+      clock[tid] = 1;
+      changed = true;
+    }
+
+    if (entry.type == RecordType::SYType && entry.address) {
+      switch (entry.length) {
+      case SK_MutexUnlock:
+        objects[entry.address] = clock;
+        ++clock[tid];
+        changed = true;
+        break;
+      case SK_CondSignal: {
+        VectorClock &object = objects[entry.address];
+        object.resize(numThreads);
+        joinClock(object, clock);
+        ++clock[tid];
+        changed = true;
+        break;
+      }
+      case SK_ThreadCreate:
+        created[index] = clock;
+        ++clock[tid];
+        changed = true;
+        break;
+      case SK_MutexLock:
+      case SK_CondWake: {
+        auto O = objects.find(entry.address);
+        if (O != objects.end())
+          changed |= joinClock(clock, O->second);
+        break;
+      }
+      case SK_ThreadJoin: {
+        ThreadIndex child;
+        if (findThread(threads, entry.address, index, child) &&
+            child != tid && !clocks[child].empty())
+          changed |= joinClock(clock, clocks[child]);
+        break;
+      }
+      default:
+        break;
+      }
+    }
+
+    if (changed) {
+      Snapshot snapshot = { index, clock };
+      snapshots[tid].push_back(snapshot);
+    }
+  }
+
+  DEBUG(dbgs() << "Ordered the synchronization of " << numThreads
+               << " threads\n");
+}
+
+const SyncOrder::VectorClock *SyncOrder::clockAt(ThreadIndex tid,
+                                                 unsigned long index) const {
+  if (tid >= snapshots.size())
+    return nullptr;
+  const vector<Snapshot> &list = snapshots[tid];
+  auto S = upper_bound(list.begin(), list.end(), index,
+                       [](unsigned long i, const Snapshot &snapshot) {
+                         return i < snapshot.index;
+                       });
+  if (S == list.begin())
+    return nullptr;
+  return &(--S)->clock;
+}
+
+bool SyncOrder::happensBefore(unsigned long first, ThreadIndex firstTid,
+                              unsigned long second,
+                              ThreadIndex secondTid) const {
+  if (first >= second)
+    return false;
+  if (!enabled || firstTid == secondTid)
+    return true;
+  const VectorClock *firstClock = clockAt(firstTid, first);
+  const VectorClock *secondClock = clockAt(secondTid, second);
+  if (!firstClock || !secondClock)
+    return false;
+  return (*secondClock)[firstTid] >= (*firstClock)[firstTid];
+}
+
+//===----------------------------------------------------------------------===//
+//                          Branch Decoder
+//===----------------------------------------------------------------------===//
+
+/// Return the number of outcome bits which the terminator records with
+/// -trace-branches, or 0 if it has at most one successor.
+static unsigned getOutcomeBits(const TerminatorInst *T) {
+  if (const BranchInst *BI = dyn_cast<BranchInst>(T))
+    return BI->isConditional() ? 1 : 0;
+  if (const SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+    if (SI->getNumCases() == 0)
+      return 0;
+    return cast<IntegerType>(SI->getCondition()->getType())->getBitWidth();
+  }
+  if (const IndirectBrInst *IBI = dyn_cast<IndirectBrInst>(T)) {
+    unsigned count = IBI->getNumDestinations();
+    return count > 1 ? Log2_32_Ceil(count) : 0;
+  }
+  return 0;
+}
+
+/// Return the successor of the terminator which the outcome selects, or null
+/// if there is none.
+static BasicBlock *getSuccessor(TerminatorInst *T, uint64_t outcome) {
+  if (BranchInst *BI = dyn_cast<BranchInst>(T))
+    return outcome < BI->getNumSuccessors() ? BI->getSuccessor(outcome)
+                                            : nullptr;
+  if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+    IntegerType *Ty = cast<IntegerType>(SI->getCondition()->getType());
+    return SI->findCaseValue(ConstantInt::get(Ty, outcome)).getCaseSuccessor();
+  }
+  if (IndirectBrInst *IBI = dyn_cast<IndirectBrInst>(T))
+    return outcome < IBI->getNumDestinations() ? IBI->getDestination(outcome)
+                                               : nullptr;
+  return nullptr;
+}
+
+bool BranchDecoder::isBranchTrace(const Entry *trace, unsigned long maxIndex) {
+  // The first function entry precedes the first basic block record of a
+  // trace which has to be decoded, which has none of its own.
+  for (unsigned long index = 0; index <= maxIndex; ++index) {
+    if (trace[index].type == RecordType::FNType)
+      return true;
+    if (trace[index].type == RecordType::BBType)
+      return false;
+  }
+  return false;
+}
+
+bool BranchDecoder::endBlock(ThreadIndex tid,
+                             Thread &T,
+                             const Entry *outcomes,
+                             unsigned &position,
+                             std::vector<Entry> &out) {
+  Frame &F = T.frames.back();
+  TerminatorInst *TI = F.block->getTerminator();
+  unsigned id = bbNumPass->getID(F.block);
+  unsigned char *fp = reinterpret_cast<unsigned char *>(F.function);
+  if (isa<ReturnInst>(TI)) {
+    // Like recordBB(), give the last basic block the id of the call on the
+    // call stack, if it called the function.
+    uintptr_t callID = 0;
+    if (T.calls.empty()) {
+      callID = static_cast<unsigned>(~0);
+    } else if (T.calls.back().function == F.function) {
+      callID = T.calls.back().id;
+      T.calls.pop_back();
+    }
+    out.push_back(Entry(RecordType::BBType, id, tid, fp, callID));
+    T.frames.pop_back();
+    return true;
+  }
+
+  uint64_t outcome = 0;
+  if (unsigned bits = getOutcomeBits(TI)) {
+    if (!outcomes || position + bits > outcomes->id)
+      return false;
+    for (unsigned i = 0; i < bits; ++i)
+      outcome |= static_cast<uint64_t>(branchBit(*outcomes, position + i)) << i;
+    position += bits;
+  }
+  BasicBlock *Succ = getSuccessor(TI, outcome);
+  if (!Succ)
+    return false;
+  out.push_back(Entry(RecordType::BBType, id, tid, fp));
+  F.block = Succ;
+  return true;
+}
+
+bool BranchDecoder::reach(ThreadIndex tid,
+                          Thread &T,
+                          Instruction *I,
+                          std::vector<Entry> &out) {
+  // Without outcome bits, a function can only take as many steps as it has
+  // basic blocks before it loops.
+  unsigned position = 0;
+  size_t depth = 0, steps = 0;
+  while (!T.frames.empty() && T.frames.back().block != I->getParent()) {
+    Frame &F = T.frames.back();
+    if (depth != T.frames.size()) {
+      depth = T.frames.size();
+      steps = 0;
+    }
+    if (F.inCall || ++steps > F.block->getParent()->size() ||
+        !endBlock(tid, T, nullptr, position, out))
+      return false;
+  }
+  return !T.frames.empty();
+}
+
+bool BranchDecoder::leave(ThreadIndex tid, Thread &T, std::vector<Entry> &out) {
+  unsigned position = 0;
+  size_t depth = T.frames.size(), steps = 0;
+  while (T.frames.size() == depth) {
+    Frame &F = T.frames.back();
+    if (F.inCall || ++steps > F.block->getParent()->size() ||
+        !endBlock(tid, T, nullptr, position, out))
+      return false;
+  }
+  return true;
+}
+
+void BranchDecoder::finish(ThreadIndex tid, Thread &T, std::vector<Entry> &out) {
+  // Return from the functions as far as the control flow graph leads, e.g.,
+  // from main() before the trace ends.
+  while (!T.frames.empty() && leave(tid, T, out))
+    ;
+
+  // Terminate the basic blocks which cannot end, the innermost first.
+  for (auto F = T.frames.rbegin(); F != T.frames.rend(); ++F)
+    out.push_back(Entry(RecordType::BBType, bbNumPass->getID(F->block), tid,
+                        reinterpret_cast<unsigned char *>(F->function)));
+  T.frames.clear();
+}
+
+void BranchDecoder::decode(const Entry *trace,
+                           unsigned long maxIndex,
+                           std::vector<Entry> &out) {
+  vector<Thread> threads;
+  // The index of the last thread with each pthread_t
+  map<uintptr_t, ThreadIndex> pthreads;
+  bool ended = false;
+  out.reserve(maxIndex + 1);
+  for (unsigned long index = 0; index <= maxIndex && !ended; ++index) {
+    const Entry &entry = trace[index];
+    if (entry.type == RecordType::ENType) {
+      for (unsigned tid = 0; tid < threads.size(); ++tid)
+        finish(tid, threads[tid], out);
+      out.push_back(entry);
+      ended = true;
+      continue;
+    }
+
+    ThreadIndex tid = entry.tid;
+    if (tid >= threads.size())
+      threads.resize(tid + 1);
+    Thread &T = threads[tid];
+    bool decoded = true;
+    bool keep = true;
+    switch (entry.type) {
+    case RecordType::THType:
+      pthreads[entry.address] = tid;
+      break;
+
+    case RecordType::FNType: {
+      // The function is called by the innermost function which waits for a
+      // call, and the functions above it have returned. Without such a
+      // function, it is the first function of the thread.
+      while (decoded && !T.frames.empty() && !T.frames.back().inCall)
+        decoded = leave(tid, T, out);
+      BasicBlock *BB = bbNumPass->getBlock(entry.id);
+      if (decoded && BB) {
+        Frame F = { BB, entry.address, false };
+        T.frames.push_back(F);
+      } else {
+        decoded = false;
+      }
+      keep = false;
+      break;
+    }
+
+    case RecordType::BRType: {
+      unsigned position = 0;
+      size_t depth = 0, steps = 0;
+      while (decoded && position < entry.id) {
+        if (T.frames.empty() || T.frames.back().inCall) {
+          decoded = false;
+          break;
+        }
+        // Between two outcomes, a function ends at most as many basic blocks
+        // as it has.
+        if (depth != T.frames.size()) {
+          depth = T.frames.size();
+          steps = 0;
+        }
+        unsigned last = position;
+        decoded = ++steps <= T.frames.back().block->getParent()->size() &&
+                  endBlock(tid, T, &entry, position, out);
+        if (position != last)
+          steps = 0;
+      }
+      keep = false;
+      break;
+    }
+
+    case RecordType::CLType: {
+      Instruction *I = lsNumPass->getInstByID(entry.id);
+      decoded = I && reach(tid, T, I, out);
+      if (!decoded)
+        break;
+      T.frames.back().inCall = true;
+      // Like recordCall(), put the calls of defined functions on the call
+      // stack.
+      CallInst *CI = dyn_cast<CallInst>(I);
+      Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+      if (Callee && !Callee->isDeclaration()) {
+        Call C = { entry.id, entry.address };
+        T.calls.push_back(C);
+      }
+      break;
+    }
+
+    case RecordType::RTType:
+      // The functions called by the call have returned.
+      while (decoded && !T.frames.empty() && !T.frames.back().inCall)
+        decoded = leave(tid, T, out);
+      decoded = decoded && !T.frames.empty();
+      if (decoded)
+        T.frames.back().inCall = false;
+      // Like recordReturn(), take the call off the call stack if the last
+      // basic block of the function it called did not.
+      if (!T.calls.empty() && T.calls.back().id == entry.id &&
+          T.calls.back().function == entry.address)
+        T.calls.pop_back();
+      break;
+
+    case RecordType::SYType:
+      // A joined thread has finished.
+      if (entry.length == SK_ThreadJoin) {
+        auto J = pthreads.find(entry.address);
+        if (J != pthreads.end() && J->second != tid &&
+            J->second < threads.size())
+          finish(J->second, threads[J->second], out);
+      }
+      // Fall through.
+    case RecordType::LDType:
+    case RecordType::STType:
+    case RecordType::PDType:
+      if (Instruction *I = lsNumPass->getInstByID(entry.id))
+        decoded = reach(tid, T, I, out);
+      break;
+
+    default:
+      // Gaps, strided accesses and thread records do not tell where the
+      // thread is.
+      break;
+    }
+
+    if (!decoded)
+      report_fatal_error("Cannot decode the branches of thread " +
+                         Twine(tid) + " at record " + Twine(index) +
+                         " of the trace");
+    if (keep)
+      out.push_back(entry);
+  }
+
+  if (!ended) {
+    for (unsigned tid = 0; tid < threads.size(); ++tid)
+      finish(tid, threads[tid], out);
+  }
+}
+
 //===----------------------------------------------------------------------===//
 //                          Public TraceFile Interfaces
 //===----------------------------------------------------------------------===//
@@ -49,32 +548,69 @@ TraceFile::TraceFile(string Filename,
                      const QueryBasicBlockNumbers *bbNums,
                      const QueryLoadStoreNumbers *lsNums) :
   bbNumPass(bbNums), lsNumPass(lsNums),
-  trace(0), totalLoadsTraced(0), lostLoadsTraced(0) {
+  trace(0), totalLoadsTraced(0), lostLoadsTraced(0), gapLoadsTraced(0) {
   // Open the trace file for read-only access.
-  int fd = open(Filename.c_str(), O_RDONLY);
-  assert((fd > 0) && "Cannot open file!\n");
-
-  // Attempt to get the file size.
-  struct stat finfo;
-  int ret = fstat(fd, &finfo);
-  assert((ret == 0) && "Cannot fstat() file!\n");
-  // Calculate the index of the last record in the trace.
-  maxIndex = finfo.st_size / sizeof(Entry) - 1;
-
-  // Note that we map the whole file in the private memory space. If we don't
-  // have enough VM at this time, this will definitely fail.
-  trace = (Entry *)mmap(0,
-                        finfo.st_size,
-                        PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE,
-                        fd,
-                        0);
-  assert((trace != MAP_FAILED) && "Trace mmap() failed!\n");
+  TraceReader Reader(Filename);
+  assert(Reader.isOpen() && "Cannot open file!\n");
+
+  if (Reader.isFlat()) {
+    // Calculate the index of the last record in the trace.
+    maxIndex = Reader.size() - 1;
+
+    // Note that we map the whole file in the private memory space. If we don't
+    // have enough VM at this time, this will definitely fail.
+    trace = (Entry *)mmap(0,
+                          Reader.size() * sizeof(Entry),
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE,
+                          Reader.getFD(),
+                          0);
+    assert((trace != MAP_FAILED) && "Trace mmap() failed!\n");
+  } else {
+    // The trace was written in segments, by per-thread buffers or in the
+    // compact format.  Decode the records of all threads and merge them into
+    // one array in the order of their sequence numbers.
+    trace = (Entry *)mmap(0,
+                          Reader.size() * sizeof(Entry),
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1,
+                          0);
+    assert((trace != MAP_FAILED) && "Trace mmap() failed!\n");
+    unsigned long index = 0;
+    while (Reader.next(trace[index]))
+      ++index;
+    maxIndex = index - 1;
+  }
+
+  if (BranchDecoder::isBranchTrace(trace, maxIndex)) {
+    // Regenerate the basic block records of a trace which recorded the
+    // outcomes of the branches instead. The records move to other indices,
+    // so the summaries of the segments do not apply to the decoded trace.
+    vector<Entry> decoded;
+    BranchDecoder(bbNumPass, lsNumPass).decode(trace, maxIndex, decoded);
+    munmap(trace, Reader.size() * sizeof(Entry));
+    trace = (Entry *)mmap(0,
+                          decoded.size() * sizeof(Entry),
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1,
+                          0);
+    assert((trace != MAP_FAILED) && "Trace mmap() failed!\n");
+    std::copy(decoded.begin(), decoded.end(), trace);
+    maxIndex = decoded.size() - 1;
+  } else if (Reader.hasSummaries()) {
+    // Let the searches skip the segments which cannot hold their records.
+    Segments.build(Reader.getSummaries());
+  }
 
   // Fixup lost loads.
   fixupLostLoads();
   buildTraceFunAddrMap();
 
+  // Order the records of the threads by their synchronization.
+  Sync.build(trace, maxIndex);
+
   DEBUG(dbgs() << "TraceFile " << Filename << " successfully initialized.\n");
 }
 
@@ -90,10 +626,18 @@ DynValue *TraceFile::getLastDynValue(Value  *V) {
   assert(id && "Basic block does not have ID!\n");
 
   // Next, scan backwards through the trace (starting from the end) until we
-  // find a matching basic block ID.
-  for (unsigned long index = maxIndex; index > 0; --index) {
-    if (trace[index].type == RecordType::BBType && trace[index].id == id)
-      return new DynValue(I, index);
+  // find a matching basic block ID.  Skip the segments which hold none.
+  auto mayHold = [=](const SegmentSummary &S) {
+    return summaryMayHoldID(S, RecordType::BBType, id);
+  };
+  unsigned long index = maxIndex;
+  unsigned long low;
+  while (index > 0 &&
+         Segments.previous(Segments.blocks(), index, mayHold, low)) {
+    for (; index >= low && index > 0; --index) {
+      if (trace[index].type == RecordType::BBType && trace[index].id == id)
+        return new DynValue(I, index);
+    }
   }
 
   // If this is the first block, verify that it is the for the value for which
@@ -292,12 +836,37 @@ struct EntryCompare {
   }
 };
 
+/// Add the memory written by a store to the set of written memory locations.
+static void addToStores(set<Entry, EntryCompare> &Stores, Entry newEntry) {
+  // Add this entry to the store if it wasn't there already.  Note that the
+  // entry we're adding may overlap with multiple previous stores, so continue
+  // merging store intervals until there are no more.
+  set<Entry>::iterator st;
+  while ((st = Stores.find(newEntry)) != Stores.end()) {
+    // An overlapping store was performed previous.  Remove it and create a
+    // new store record that encompasses this record and the existing record.
+    uintptr_t address = (st->address < newEntry.address) ?
+                         st->address : newEntry.address;
+    uintptr_t endst   =  st->address + st->length - 1;
+    uintptr_t end     =  newEntry.address + newEntry.length - 1;
+    uintptr_t maxend  = (endst < end) ? end : endst;
+    uintptr_t length  = maxend - address + 1;
+    newEntry.address = address;
+    newEntry.length = length;
+    Stores.erase(st);
+  }
+
+  Stores.insert(newEntry);
+}
+
 /// \brief Scan forward through the entire trace and record store instructions,
 /// creating a set of memory intervals that have been written.
 ///
 /// Along the way, determine if there are load records for which no previous
 /// store record can match.  Mark these load records so that we don't try to
 /// find their matching stores when peforming the dynamic backwards slice.
+/// The basic block records which perform the accesses of every strided
+/// access record are collected as well.
 /// This function will be called in the constructor.
 /// This algorithm should be O(n*logn) where n is the number of elements in the
 /// trace.
@@ -305,36 +874,19 @@ void TraceFile::fixupLostLoads() {
   // Set of written memory locations
   set<Entry, EntryCompare> Stores;
 
+  // The strided records whose accesses are not all performed yet, by thread
+  // and basic block
+  map<pair<ThreadIndex, unsigned>, vector<unsigned> > Pending;
+
   // Loop through the entire trace to look for lost loads.
   for (unsigned long index = 0;
        trace[index].type != RecordType::ENType;
        ++index)
     // Take action on the various record types.
     switch (trace[index].type) {
-      case RecordType::STType: {
-        // Add this entry to the store if it wasn't there already.  Note that
-        // the entry we're adding may overlap with multiple previous stores,
-        // so continue merging store intervals until there are no more.
-        Entry newEntry = trace[index];
-        set<Entry>::iterator st;
-        while ((st = Stores.find(newEntry)) != Stores.end()) {
-          // An overlapping store was performed previous.  Remove it and create
-          // a new store record that encompasses this record and the existing
-          // record.
-          uintptr_t address = (st->address < newEntry.address) ?
-                               st->address : newEntry.address;
-          uintptr_t endst   =  st->address + st->length - 1;
-          uintptr_t end     =  newEntry.address + newEntry.length - 1;
-          uintptr_t maxend  = (endst < end) ? end : endst;
-          uintptr_t length  = maxend - address + 1;
-          newEntry.address = address;
-          newEntry.length = length;
-          Stores.erase(st);
-        }
-
-        Stores.insert(newEntry);
+      case RecordType::STType:
+        addToStores(Stores, trace[index]);
         break;
-      }
       case RecordType::LDType: {
         // If there is no overlapping entry for the load, then it is a lost
         // load.  Change its address to zero.
@@ -344,9 +896,76 @@ void TraceFile::fixupLostLoads() {
         }
         break;
       }
+      case RecordType::AFType: {
+        const Entry &entry = trace[index];
+        Instruction *I = lsNumPass->getInstByID(entry.id);
+        if (!I || stridedCount(entry) == 0)
+          break;
+        unsigned position = Strided.size();
+        Strided.push_back(StridedRecord());
+        Strided.back().index = index;
+        StridedByID[entry.id].push_back(position);
+        unsigned bbID = bbNumPass->getID(I->getParent());
+        Pending[make_pair(entry.tid, bbID)].push_back(position);
+        if (!isa<StoreInst>(I))
+          break;
+        StridedStores.push_back(position);
+
+        // The stores write memory between the lowest and the highest of
+        // their accesses.
+        int64_t span = static_cast<int64_t>(stridedStride(entry)) *
+                       (stridedCount(entry) - 1);
+        Entry newEntry = entry;
+        newEntry.type = RecordType::STType;
+        newEntry.address = span < 0 ? entry.address + span : entry.address;
+        newEntry.length = (span < 0 ? -span : span) + entry.repeat;
+        addToStores(Stores, newEntry);
+        break;
+      }
+      case RecordType::BBType: {
+        // The execution of a basic block performs the next access of the
+        // strided records waiting for it. The records of one instruction
+        // which continue each other take their turns.
+        auto P = Pending.find(make_pair(trace[index].tid, trace[index].id));
+        if (P == Pending.end())
+          break;
+        vector<unsigned> &records = P->second;
+        vector<unsigned> ids;
+        for (auto R = records.begin(); R != records.end();) {
+          StridedRecord &record = Strided[*R];
+          const Entry &entry = trace[record.index];
+          if (std::find(ids.begin(), ids.end(), entry.id) != ids.end()) {
+            ++R;
+            continue;
+          }
+          ids.push_back(entry.id);
+          record.blocks.push_back(index);
+          if (record.blocks.size() == stridedCount(entry))
+            R = records.erase(R);
+          else
+            ++R;
+        }
+        if (records.empty())
+          Pending.erase(P);
+        break;
+      }
+      case RecordType::GPType:
+        // Remember where the run-time stopped writing some records.
+        Gaps.push_back(std::make_pair(index, trace[index].id));
+        break;
       default:
         break;
     }
+
+  // Remember how far the strided stores reach, so that the searches for
+  // older stores can stop early.
+  unsigned long end = 0;
+  for (auto S = StridedStores.begin(); S != StridedStores.end(); ++S) {
+    const StridedRecord &record = Strided[*S];
+    if (!record.blocks.empty() && record.blocks.back() > end)
+      end = record.blocks.back();
+    StridedStoresEnd.push_back(end);
+  }
 }
 
 /// Build a map from functions to their runtime trace address
@@ -390,16 +1009,25 @@ void TraceFile::buildTraceFunAddrMap(void) {
 /// returned.
 unsigned long TraceFile::findPreviousID(unsigned long start_index,
                                         RecordType type,
-                                        pthread_t tid,
+                                        ThreadIndex tid,
                                         const unsigned id) {
   // Start searching from the specified index and continue until we find an
-  // entry with the correct ID.
+  // entry with the correct ID.  Skip the segments which hold none.
+  auto mayHold = [=](const SegmentSummary &S) {
+    return summaryMayHoldID(S, type, id);
+  };
   unsigned long index = start_index;
-  while (true) {
-    if (trace[index].type == type &&
-        trace[index].tid == tid &&
-        trace[index].id == id)
-      return index;
+  unsigned long low;
+  while (Segments.previous(Segments.blocks(tid), index, mayHold, low)) {
+    while (true) {
+      if (trace[index].type == type &&
+          trace[index].tid == tid &&
+          trace[index].id == id)
+        return index;
+      if (index == low)
+        break;
+      --index;
+    }
     if (index == 0)
       break;
     --index;
@@ -435,7 +1063,7 @@ unsigned long TraceFile::findPreviousID(unsigned long start_index,
 unsigned long TraceFile::findPreviousID(Function *fun,
                                         unsigned long start_index,
                                         RecordType type,
-                                        pthread_t tid,
+                                        ThreadIndex tid,
                                         const set<unsigned> &ids) {
   // Get the runtime trace address of this function fun
   // If this function is not called or called through indirect call we won't
@@ -506,7 +1134,7 @@ unsigned long TraceFile::findPreviousID(Function *fun,
 unsigned long TraceFile::findPreviousID(Function *fun,
                                         unsigned long start_index,
                                         RecordType type,
-                                        pthread_t tid,
+                                        ThreadIndex tid,
                                         const unsigned id) {
   set<unsigned> ids;
   ids.insert(id);
@@ -522,7 +1150,7 @@ unsigned long TraceFile::findPreviousID(Function *fun,
 /// \param nestedID - The ID of the basic block to use to find nesting levels.
 unsigned long TraceFile::findPreviousNestedID(unsigned long start_index,
                                               RecordType type,
-                                              pthread_t tid,
+                                              ThreadIndex tid,
                                               const unsigned id,
                                               const unsigned nestedID) {
   // Assert that we're starting our backwards scan on a basic block entry.
@@ -535,35 +1163,44 @@ unsigned long TraceFile::findPreviousNestedID(unsigned long start_index,
   // Start searching from the specified index and continue until we find an
   // entry with the correct ID.
   // This works because entry id belongs to basicblock nestedID. So
-  // any more occurance of nestedID before id means a recursion.
-  unsigned long index = start_index;
+  // any more occurance of nestedID before id means a recursion.  Segments
+  // which hold neither entry cannot change the nesting level, so skip them.
+  auto mayHold = [=](const SegmentSummary &S) {
+    return summaryMayHoldID(S, type, id) ||
+           summaryMayHoldID(S, RecordType::BBType, nestedID);
+  };
+  unsigned long index = start_index - 1;
+  unsigned long low;
   unsigned nesting = 0;
-  do {
-    // Check the next index.
-    --index;
-    // We have found an entry matching our criteria.  If the nesting level is
-    // zero, then this is our entry.  Otherwise, we know that we've found a
-    // matching entry within a nested basic block entry and should therefore
-    // decrease the nesting level.
-    if (trace[index].type == type &&
-        trace[index].tid == tid &&
-        trace[index].id == id) {
-      if (nesting == 0) {
-        return index;
-      } else {
+  while (Segments.previous(Segments.blocks(tid), index, mayHold, low)) {
+    while (true) {
+      // We have found an entry matching our criteria.  If the nesting level
+      // is zero, then this is our entry.  Otherwise, we know that we've found
+      // a matching entry within a nested basic block entry and should
+      // therefore decrease the nesting level.
+      if (trace[index].type == type &&
+          trace[index].tid == tid &&
+          trace[index].id == id) {
+        if (nesting == 0)
+          return index;
         --nesting;
-        continue;
+      } else if (trace[index].type == RecordType::BBType &&
+                 trace[index].tid == tid &&
+                 trace[index].id == nestedID) {
+        // If this is a basic block entry with an idential ID to the first
+        // basic block on which we started, we know that we've hit a
+        // recursive (i.e., nested) execution of the basic block.
+        ++nesting;
       }
-    }
 
-    // If this is a basic block entry with an idential ID to the first basic
-    // block on which we started, we know that we've hit a recursive
-    // (i.e., nested) execution of the basic block.
-    if (trace[index].type == RecordType::BBType &&
-        trace[index].tid == tid &&
-        trace[index].id == nestedID)
-      ++nesting;
-  } while (index != 0);
+      if (index == low)
+        break;
+      --index;
+    }
+    if (index == 0)
+      break;
+    --index;
+  }
 
   // We've searched and didn't find our ID at the proper nesting level.
   report_fatal_error("No proper basic block at the nesting level");
@@ -575,36 +1212,40 @@ unsigned long TraceFile::findNextNestedID(unsigned long start_index,
                                           RecordType type,
                                           const unsigned id,
                                           const unsigned nestID,
-                                          pthread_t tid) {
+                                          ThreadIndex tid) {
   // This works because entry id belongs to basicblock nestedID. So any more
-  // occurance of nestedID before id means a recursion.
+  // occurance of nestedID before id means a recursion.  Segments which hold
+  // neither entry cannot change the nesting level, so skip them.
+  auto mayHold = [=](const SegmentSummary &S) {
+    return summaryMayHoldID(S, type, id) ||
+           summaryMayHoldID(S, RecordType::BBType, nestID);
+  };
   unsigned nesting = 0;
   unsigned long index = start_index;
-  while (true) {
-    // If we've searched past the end of the trace file, stop searching.
-    if (index > maxIndex)
-      break;
+  unsigned long high;
+  while (index <= maxIndex &&
+         Segments.next(Segments.blocks(tid), index, mayHold, high)) {
+    // Stop searching at the end of the block or of the trace file.
+    for (; index <= high && index <= maxIndex; ++index) {
+      // If we've found the entry for which we're searching, check the nesting
+      // level.  If it's zero, we've found our entry.  If it's non-zero,
+      // decrease the nesting level and keep looking.
+      if (trace[index].type == type &&
+          trace[index].id == id &&
+          trace[index].tid == tid) {
+        if (nesting == 0)
+          return index;
+        else
+          --nesting;
+      }
 
-    // If we've found the entry for which we're searching, check the nesting
-    // level.  If it's zero, we've found our entry.  If it's non-zero, decrease
-    // the nesting level and keep looking.
-    if (trace[index].type == type &&
-        trace[index].id == id &&
-        trace[index].tid == tid) {
-      if (nesting == 0)
-        return index;
-      else
-        --nesting;
+      // If we find a store/any instruction matching the nesting ID, then
+      // we've left one level of recursion.
+      if (trace[index].type == RecordType::BBType &&
+          trace[index].id == nestID &&
+          trace[index].tid == tid)
+        ++nesting;
     }
-
-    // If we find a store/any instruction matching the nesting ID, then we've
-    // left one level of recursion.
-    if (trace[index].type == RecordType::BBType &&
-        trace[index].id == nestID &&
-        trace[index].tid == tid)
-      ++nesting;
-
-    ++index;
   }
 
   errs() << "start_index: " << start_index
@@ -630,17 +1271,23 @@ unsigned long TraceFile::findNextNestedID(unsigned long start_index,
 /// address is returned.
 unsigned long TraceFile::findNextAddress(unsigned long start_index,
                                          RecordType type,
-                                         pthread_t tid,
+                                         ThreadIndex tid,
                                          const uintptr_t address) {
   // Start searching from the specified index and continue until we find an
-  // entry with the correct type.
+  // entry with the correct type.  Skip the segments which hold none.
+  auto mayHold = [=](const SegmentSummary &S) {
+    return summaryMayHoldType(S, type);
+  };
   unsigned long index = start_index;
-  while (index <= maxIndex) {
-    if (trace[index].type == type &&
-        trace[index].tid == tid &&
-        trace[index].address == address)
-      return index;
-    ++index;
+  unsigned long high;
+  while (index <= maxIndex &&
+         Segments.next(Segments.blocks(tid), index, mayHold, high)) {
+    for (; index <= high && index <= maxIndex; ++index) {
+      if (trace[index].type == type &&
+          trace[index].tid == tid &&
+          trace[index].address == address)
+        return index;
+    }
   }
 
   errs() << "start_index: " << start_index
@@ -865,58 +1512,356 @@ static inline bool overlaps(const Entry &first, const Entry &second) {
   return true;
 }
 
+/// This method finds the first gap record of at least the given level before
+/// the index in the trace. From the gap on, the run-time may have dropped the
+/// records which the level names.
+///
+/// \param index - The index in the trace file before which to search.
+/// \param level - The lowest TraceGap level of the gap.
+/// \return The index of the gap record, or -1 if there is none.
+long TraceFile::findGap(unsigned long index, unsigned level) const {
+  for (auto G = Gaps.begin(); G != Gaps.end() && G->first < index; ++G)
+    if (G->second >= level)
+      return G->first;
+  return -1;
+}
+
+/// This method searches backwards in the trace file for an entry of the
+/// specified type and ID, but not beyond the stop index.
+///
+/// \param start_index - The index in the trace file which will be examined
+///                      first for a match.
+/// \param stop_index - The index before the first index to examine.
+/// \return true if an entry was found.
+bool TraceFile::hasPreviousID(unsigned long start_index,
+                              unsigned long stop_index,
+                              RecordType type,
+                              ThreadIndex tid,
+                              const unsigned id) {
+  auto mayHold = [=](const SegmentSummary &S) {
+    return summaryMayHoldID(S, type, id);
+  };
+  unsigned long index = start_index;
+  unsigned long low;
+  while (index > stop_index &&
+         Segments.previous(Segments.blocks(tid), index, mayHold, low)) {
+    for (; index > stop_index; --index) {
+      if (trace[index].type == type &&
+          trace[index].tid == tid &&
+          trace[index].id == id)
+        return true;
+      if (index == low)
+        break;
+    }
+    if (index <= stop_index)
+      break;
+    --index;
+  }
+  return false;
+}
+
+/// Return true if the instruction A comes before the instruction B of the
+/// same basic block.
+static bool comesBefore(const Instruction *A, const Instruction *B) {
+  const BasicBlock *BB = A->getParent();
+  for (BasicBlock::const_iterator I = A; I != BB->end(); ++I)
+    if (&*I == B)
+      return A != B;
+  return false;
+}
+
+/// Find the last of the accesses of a strided record, up to the access
+/// limit, which overlaps the memory of the entry.
+/// \return The index of the access, or -1 if there is none.
+static long lastOverlappingAccess(const Entry &record,
+                                  long limit,
+                                  const Entry &entry) {
+  if (limit < 0)
+    return -1;
+  int64_t stride = stridedStride(record);
+  int64_t size = record.repeat;
+  int64_t length = entry.length ? entry.length : 1;
+  // The offset of the memory of the entry from the first access
+  int64_t offset = static_cast<int64_t>(entry.address - record.address);
+
+  // Access k covers [k * stride, k * stride + size) relative to the first
+  // access. Find the last one which starts before the end of the entry, or,
+  // with a negative stride, which ends after its beginning.
+  long last = limit;
+  if (stride > 0) {
+    if (offset + length <= 0)
+      return -1;
+    last = std::min<int64_t>(limit, (offset + length - 1) / stride);
+  } else if (stride < 0) {
+    if (size - offset <= 0)
+      return -1;
+    last = std::min<int64_t>(limit, (size - offset - 1) / -stride);
+  }
+  int64_t start = last * stride;
+  if (start < offset + length && start + size > offset)
+    return last;
+  return -1;
+}
+
+/// This method finds the strided access record of the load or store
+/// instruction which performed its access in the execution of the basic
+/// block at the index.
+///
+/// \param id - The ID of the load or store instruction.
+/// \param block_index - The index of the basic block record of the execution.
+/// \param tid - The thread of the execution.
+/// \param[out] access - The access, as a load or store entry.
+/// \return true if the access was found.
+bool TraceFile::findStridedAccess(unsigned id,
+                                  unsigned long block_index,
+                                  ThreadIndex tid,
+                                  Entry &access) {
+  auto ID = StridedByID.find(id);
+  if (ID == StridedByID.end())
+    return false;
+
+  // Look at the records of the thread written before the execution, from the
+  // most recent one, until a record whose accesses all precede it.
+  const vector<unsigned> &records = ID->second;
+  auto R = std::upper_bound(records.begin(), records.end(), block_index,
+                            [this](unsigned long index, unsigned position) {
+                              return index < Strided[position].index;
+                            });
+  while (R != records.begin()) {
+    const StridedRecord &record = Strided[*--R];
+    const Entry &entry = trace[record.index];
+    if (entry.tid != tid)
+      continue;
+    auto B = std::lower_bound(record.blocks.begin(), record.blocks.end(),
+                              block_index);
+    if (B != record.blocks.end() && *B == block_index) {
+      int64_t k = B - record.blocks.begin();
+      Instruction *I = lsNumPass->getInstByID(id);
+      access = Entry(isa<StoreInst>(I) ? RecordType::STType :
+                                         RecordType::LDType,
+                     id, tid, nullptr, entry.repeat);
+      access.address = entry.address + k * stridedStride(entry);
+      return true;
+    }
+    if (B == record.blocks.end() && record.blocks.size() == stridedCount(entry))
+      break;
+  }
+  return false;
+}
+
+/// This method searches the strided access records for the most recent store
+/// which writes memory read by the load entry. A strided access takes place
+/// just before the basic block record of its execution, after the other
+/// records of the execution and in the static order of the instructions.
+///
+/// \param store_index - The last index in the trace file before which
+///                      accesses are examined.
+/// \param before - If not NULL, the accesses of the execution of the basic
+///                 block at store_index + 1 which come before this
+///                 instruction are examined too.
+/// \param load_entry - The load entry
+/// \param low - The index in the trace after which accesses are examined.
+/// \param[out] found_index - The index of the basic block record of the
+///                           execution which performed the store.
+/// \param[out] found_store - The store instruction.
+/// \param[out] found_entry - The store, as a store entry.
+/// \return true if a store was found.
+bool TraceFile::findPreviousStridedStore(long store_index,
+                                         Instruction *before,
+                                         const Entry &load_entry,
+                                         long low,
+                                         long &found_index,
+                                         Instruction *&found_store,
+                                         Entry &found_entry) {
+  // Only the records written before the accesses examined matter.
+  auto S = std::upper_bound(StridedStores.begin(), StridedStores.end(),
+                            store_index,
+                            [this](long index, unsigned position) {
+                              return index < (long)Strided[position].index;
+                            });
+  bool found = false;
+  while (S != StridedStores.begin()) {
+    --S;
+    // No earlier record reaches past the store found or the lower bound.
+    long end = StridedStoresEnd[S - StridedStores.begin()];
+    if (end <= low || (found && end < found_index))
+      break;
+
+    const StridedRecord &record = Strided[*S];
+    const Entry &entry = trace[record.index];
+    Instruction *SI = lsNumPass->getInstByID(entry.id);
+    long limit = std::upper_bound(record.blocks.begin(), record.blocks.end(),
+                                  (unsigned long)store_index) -
+                 record.blocks.begin();
+    if (before && limit < (long)record.blocks.size() &&
+        (long)record.blocks[limit] == store_index + 1 &&
+        comesBefore(SI, before))
+      ++limit;
+
+    long k = lastOverlappingAccess(entry, limit - 1, load_entry);
+    if (k < 0)
+      continue;
+    long index = record.blocks[k];
+    if (index <= low)
+      continue;
+    if (found && (index < found_index ||
+                  (index == found_index && !comesBefore(found_store, SI))))
+      continue;
+    found = true;
+    found_index = index;
+    found_store = SI;
+    found_entry = Entry(RecordType::STType, entry.id, entry.tid, nullptr,
+                        entry.repeat);
+    found_entry.address = entry.address + k * stridedStride(entry);
+  }
+  return found;
+}
+
+/// This method searches backwards in the trace file for the most recent store
+/// which writes memory read by the load entry, recorded one by one or by a
+/// strided access record.
+///
+/// \param store_index - The index in the trace file which will be examined
+///                      first for a match.
+/// \param[in,out] strided - If not NULL, the strided stores of the
+///                          execution of the basic block at store_index + 1
+///                          which come before this instruction are examined
+///                          too. Set to the strided store found, or to NULL.
+/// \param load_entry - The load entry
+/// \param gap - The index of a gap record at which the search ends, or -1 to
+///              search to the beginning of the trace.
+/// \param[out] store_entry - The store found.
+/// \return The index of the store, or of the basic block record of the
+/// strided store, or -1 if there is none.
+long TraceFile::findPreviousStore(long store_index,
+                                  Instruction *&strided,
+                                  const Entry &load_entry,
+                                  long gap,
+                                  Entry &store_entry) {
+  Instruction *before = strided;
+  strided = nullptr;
+  long start_index = store_index;
+
+  // Skip the segments which write no memory in the range of the load.
+  auto mayHold = [&](const SegmentSummary &S) {
+    return summaryMayHoldAccess(S, RecordType::STType,
+                                load_entry.address, load_entry.length);
+  };
+  unsigned long index = store_index;
+  unsigned long low;
+  long found = -1;
+  while (store_index > gap && found < 0 &&
+         Segments.previous(Segments.blocks(), index, mayHold, low)) {
+    for (store_index = index;
+         store_index >= (long)low && store_index > gap;
+         --store_index) {
+      if (trace[store_index].type == RecordType::STType &&
+          overlaps(trace[store_index], load_entry)) {
+        found = store_index;
+        store_entry = trace[found];
+        break;
+      }
+    }
+    index = store_index;
+  }
+
+  // A strided store may have been performed after the store found.
+  if (!StridedStores.empty())
+    findPreviousStridedStore(start_index, before, load_entry,
+                             std::max(found, gap), found, strided,
+                             store_entry);
+  return found;
+}
+
+/// Add the dynamic store at the index in the trace to the worklist. For a
+/// strided store, the index is the one of its basic block record.
+void TraceFile::addStoreToWorklist(DynValue &DV,
+                                   Worklist_t &Sources,
+                                   long store_index,
+                                   Instruction *strided) {
+  if (strided) {
+    DynValue NDV = DynValue(strided, store_index);
+    addToWorklist(NDV, Sources, DV);
+    return;
+  }
+
+  // Find the LLVM store instruction(s) that match this dynamic store
+  // instruction.
+  Instruction *SI = lsNumPass->getInstByID(trace[store_index].id);
+  assert(SI);
+
+  // Scan forward through the trace to get the basic block in which the
+  // store was executed.
+  unsigned storeBBID = bbNumPass->getID(SI->getParent());
+  unsigned long bbindex = findNextNestedID(store_index,
+                                           RecordType::BBType,
+                                           storeBBID,
+                                           trace[store_index].id,
+                                           trace[store_index].tid);
+  // Record the store instruction as a source.
+  // FIXME: This should handle *all* stores with the ID.  It is possible
+  // that this occurs through function cloning.
+  DynValue NDV = DynValue(SI, bbindex);
+  addToWorklist(NDV, Sources, DV);
+}
+
 /// This method, given a dynamic value that reads from memory, will find the
 /// dynamic value(s) that stores into the same memory.
 ///
+/// If the trace records the synchronization of the threads, the stores of
+/// other threads which do not happen before the load race with it: each of
+/// them may or may not have written the value read. They are all added as
+/// sources, and the search goes on until a store which happens before the
+/// load.
+///
 /// \param DV[in] - the dynamic value of the load instruction
 /// \param Sources[out] - the work list to add the related values
 /// \param store_index - the index in the trace file to start with
+/// \param load_index - the index of the load record in the trace file
 /// \param load_entry - the load entry
+/// \param strided - if not NULL, the strided stores of the execution of the
+///                  basic block at store_index + 1 which come before this
+///                  instruction are searched too
 void TraceFile::findAllStoresForLoad(DynValue &DV,
                                      Worklist_t &Sources,
                                      long store_index,
-                                     const Entry load_entry) {
-  while (store_index >= 0) {
-    if (trace[store_index].type == RecordType::STType &&
-        overlaps(trace[store_index], load_entry)) {
-      // Find the LLVM store instruction(s) that match this dynamic store
-      // instruction.
-      Instruction *SI = lsNumPass->getInstByID(trace[store_index].id);
-      assert(SI);
-
-      // Scan forward through the trace to get the basic block in which the
-      // store was executed.
-      unsigned storeBBID = bbNumPass->getID(SI->getParent());
-      unsigned long bbindex = findNextNestedID(store_index,
-                                               RecordType::BBType,
-                                               storeBBID,
-                                               trace[store_index].id,
-                                               trace[store_index].tid);
-      // Record the store instruction as a source.
-      // FIXME: This should handle *all* stores with the ID.  It is possible
-      // that this occurs through function cloning.
-      DynValue NDV = DynValue(SI, bbindex);
-      addToWorklist(NDV, Sources, DV);
+                                     unsigned long load_index,
+                                     const Entry load_entry,
+                                     Instruction *strided) {
+  // Stores may have been dropped after a gap, so a store before it is not
+  // known to be the most recent one.
+  long gap = findGap(load_index, TG_NoAccesses);
+  Entry store_entry;
+  store_index = findPreviousStore(store_index, strided, load_entry, gap,
+                                  store_entry);
+  bool racing = false;
+  while (store_index >= 0 &&
+         !Sync.happensBefore(store_index, store_entry.tid,
+                             load_index, load_entry.tid)) {
+    addStoreToWorklist(DV, Sources, store_index, strided);
+    racing = true;
+    store_index = findPreviousStore(store_index - 1, strided, load_entry, gap,
+                                    store_entry);
+  }
 
-      Entry &store_entry = trace[store_index];
-      if (load_entry.address < store_entry.address) {
-        Entry new_entry;
-        new_entry.address = load_entry.address;
-        new_entry.length = store_entry.address - load_entry.address;
-        findAllStoresForLoad(DV, Sources, store_index - 1, new_entry);
-      }
+  if (store_index >= 0) {
+    addStoreToWorklist(DV, Sources, store_index, strided);
 
-      unsigned long store_end = store_entry.address + store_entry.length;
-      unsigned long load_end = load_entry.address + load_entry.length;
-      if (store_end < load_end) {
-        Entry new_entry;
-        new_entry.address = load_entry.address;
-        new_entry.length = load_end - store_end;
-        findAllStoresForLoad(DV, Sources, store_index - 1, new_entry);
-      }
-      break;
+    if (load_entry.address < store_entry.address) {
+      Entry new_entry = load_entry;
+      new_entry.length = store_entry.address - load_entry.address;
+      findAllStoresForLoad(DV, Sources, store_index - 1, load_index, new_entry,
+                           strided);
+    }
+
+    unsigned long store_end = store_entry.address + store_entry.length;
+    unsigned long load_end = load_entry.address + load_entry.length;
+    if (store_end < load_end) {
+      Entry new_entry = load_entry;
+      new_entry.length = load_end - store_end;
+      findAllStoresForLoad(DV, Sources, store_index - 1, load_index, new_entry,
+                           strided);
     }
-    --store_index;
   }
 
   // It is possible that this load reads data that was stored by something
@@ -925,7 +1870,12 @@ void TraceFile::findAllStoresForLoad(DynValue &DV,
 
   // If we can't find the source of the load, then just ignore it.  The trail
   // ends here.
-  if (store_index == -1) {
+  if (store_index == -1 && !racing && gap >= 0) {
+    // The search ends at the gap rather than at an older store.
+    DEBUG(dbgs() << "The source of the load may be in the gap at index "
+                 << gap << "\n");
+    ++gapLoadsTraced;
+  } else if (store_index == -1 && !racing) {
     // This load may be uninitialized or we don't support a special function
     // which may be storing to this load
     DEBUG(dbgs() << "We can't find the source of the load:");
@@ -937,6 +1887,83 @@ void TraceFile::findAllStoresForLoad(DynValue &DV,
   }
 }
 
+/// Find the last store to the alloca in the basic block, before the given
+/// instruction or, if it is NULL, before the end of the block.
+static StoreInst *findLocalStore(const AllocaInst *AI,
+                                 BasicBlock *BB,
+                                 Instruction *Before) {
+  BasicBlock::iterator I = Before ? BasicBlock::iterator(Before) : BB->end();
+  while (I != BB->begin()) {
+    --I;
+    if (StoreInst *SI = dyn_cast<StoreInst>(I))
+      if (SI->getPointerOperand() == AI)
+        return SI;
+  }
+  return nullptr;
+}
+
+/// This method finds the store read by a load of an alloca whose address does
+/// not escape. The loads and stores of such allocas are not traced; since no
+/// other function can access the alloca, the store is the last one which the
+/// activation of the function executed before the load. It is found in the
+/// basic block records of the activation, skipping the records of the
+/// functions it called, and in the static order of the instructions of each
+/// block.
+///
+/// \param[in] DV - The dynamic value of the load.
+/// \param[in] AI - The alloca read by the load.
+/// \param[out] Sources - The store is added to this container.
+void TraceFile::getSourcesForLocalLoad(DynValue &DV,
+                                       const AllocaInst *AI,
+                                       Worklist_t &Sources) {
+  ++totalLoadsTraced;
+
+  // Look for the store before the load in its own basic block first.
+  LoadInst *LI = cast<LoadInst>(DV.V);
+  if (StoreInst *SI = findLocalStore(AI, LI->getParent(), LI)) {
+    DynValue NDV = DynValue(SI, DV.index);
+    addToWorklist(NDV, Sources, DV);
+    return;
+  }
+
+  // Then scan back through the basic blocks which the activation executed
+  // earlier.  The records between a return and its call belong to a callee.
+  Function *F = LI->getParent()->getParent();
+  ThreadIndex tid = trace[DV.index].tid;
+  unsigned depth = 0;
+  for (unsigned long index = DV.index; index-- > 0;) {
+    const Entry &entry = trace[index];
+    if (entry.tid != tid)
+      continue;
+    if (entry.type == RecordType::RTType) {
+      ++depth;
+    } else if (entry.type == RecordType::CLType) {
+      // The call which entered the function ends the activation.
+      if (depth == 0)
+        break;
+      --depth;
+    } else if (entry.type == RecordType::BBType && depth == 0) {
+      BasicBlock *BB = bbNumPass->getBlock(entry.id);
+      if (!BB || BB->getParent() != F)
+        continue;
+      if (StoreInst *SI = findLocalStore(AI, BB, nullptr)) {
+        DynValue NDV = DynValue(SI, index);
+        addToWorklist(NDV, Sources, DV);
+        return;
+      }
+      // The entry block starts the activation.
+      if (BB == &F->getEntryBlock())
+        break;
+    }
+  }
+
+  // The load reads memory the activation never wrote.
+  DEBUG(dbgs() << "We can't find the store to the local alloca:");
+  DEBUG(AI->print(dbgs()));
+  DEBUG(dbgs() << "\n");
+  ++lostLoadsTraced;
+}
+
 /// This method, given a dynamic value that reads from memory, will find the
 /// dynamic value(s) that stores into the same memory.
 ///
@@ -964,45 +1991,82 @@ void TraceFile::getSourcesForLoad(DynValue &DV,
   if (!normalize(DV))
     return;
 
+  // The loads of allocas whose address does not escape are not traced, unless
+  // the trace was made with -trace-local-allocas.
+  if (LoadInst *LI = dyn_cast<LoadInst>(I))
+    if (const AllocaInst *AI = getLocalAlloca(LI->getPointerOperand()))
+      if (!TraceLocalAllocas) {
+        getSourcesForLocalLoad(DV, AI, Sources);
+        return;
+      }
+
+  // A strided load has no record of its own. Its access is the one which its
+  // strided access record assigns to the execution of its basic block.
+  Entry access;
+  if (isa<LoadInst>(I) &&
+      findStridedAccess(loadID, DV.index, trace[DV.index].tid, access)) {
+    ++totalLoadsTraced;
+    findAllStoresForLoad(DV, Sources, DV.index - 1, DV.index, access, I);
+    return;
+  }
+
+  // After a gap, the run-time may have stopped writing the records of the
+  // load.  A record found before the gap belongs to an older execution.
+  ThreadIndex tid = trace[DV.index].tid;
+  long gap = findGap(DV.index, TG_NoAccesses);
+  if (gap >= 0 && !hasPreviousID(DV.index, gap, RecordType::LDType, tid,
+                                 loadID)) {
+    DEBUG(dbgs() << "The load was not traced after the gap at index " << gap
+                 << "\n");
+    totalLoadsTraced += count;
+    gapLoadsTraced += count;
+    return;
+  }
+
   // Search back in the log to find the first load entry that both belongs to
   // the basic block of the load.  Remember that we must handle nested basic
   // block execution when doing this.
-  std::vector<unsigned long> load_indices(count);
+  std::vector<unsigned long> load_indices;
   unsigned long start_index = findPreviousNestedID(DV.index,
                                                    RecordType::LDType,
                                                    trace[DV.index].tid,
                                                    loadID,
                                                    bbID);
-  load_indices[0]= start_index;
+  load_indices.push_back(start_index);
   // If there are more load records to find, search back through the log to
   // find the most recently executed load with the same ID as this load.  Note
   // that these should be immediently before the load record; therefore, we
-  // should not need to worry about nesting.
-  for (unsigned index = 1; index < count; ++index) {
+  // should not need to worry about nesting.  A record into which the run-time
+  // merged several loads counts for all of them.
+  unsigned found = trace[start_index].repeat + 1;
+  while (found < count) {
     start_index = findPreviousID(start_index - 1,
                                  RecordType::LDType,
                                  trace[DV.index].tid,
                                  loadID);
-    load_indices[index]= start_index;
+    load_indices.push_back(start_index);
+    found += trace[start_index].repeat + 1;
   }
 
   // For each load, trace it back to the instruction which stored to an
-  // overlapping memory location.
-  for (unsigned index = 0; index < count; ++index) {
+  // overlapping memory location.  The range of a merged record covers all of
+  // its loads, so it is traced back at once.
+  for (unsigned index = 0; index < load_indices.size(); ++index) {
     // Scan back through the trace to find the most recent store(s) that
     // stored to these locations.
-    ++totalLoadsTraced;
     long block_index = load_indices[index];
+    totalLoadsTraced += trace[block_index].repeat + 1;
 
     // Don't bother performing the scan if the address is zero.  This means
     // that it's a lost load for which no matching store exists.
     if (!trace[block_index].address) {
-      ++lostLoadsTraced;
+      lostLoadsTraced += trace[block_index].repeat + 1;
       continue;
     }
 
     long store_index = block_index - 1;
-    findAllStoresForLoad(DV, Sources, store_index, trace[block_index]);
+    findAllStoresForLoad(DV, Sources, store_index, block_index,
+                         trace[block_index]);
 
     /*
     while ((store_index >= 0) &&
@@ -1213,7 +2277,7 @@ bool TraceFile::getSourcesForSpecialCall(DynValue &DV,
 unsigned long TraceFile::matchReturnWithCall(unsigned long start_index,
                                              const unsigned bbID,
                                              const unsigned callID,
-                                             pthread_t tid) {
+                                             ThreadIndex tid) {
   // Assert that we're starting our backwards scan on a basic block entry.
   assert(trace[start_index].type == RecordType::BBType);
   assert(start_index > 0);
@@ -1450,6 +2514,14 @@ void TraceFile::getSourceForSelect(DynValue &DV, Worklist_t &Sources) {
                                              RecordType::PDType,
                                              trace[DV.index].tid,
                                              selectID);
+  // The run-time stops writing select records at a gap, so a record before
+  // it belongs to an older execution.
+  long gap = findGap(DV.index, TG_NoSelects);
+  if (gap >= 0 && (selectIndex == maxIndex || (long)selectIndex < gap)) {
+    DEBUG(dbgs() << "The select was not traced after the gap at index "
+                 << gap << "\n");
+    return;
+  }
   if (selectIndex == maxIndex) { // Could not find required trace entry
     errs() << __func__ << " failed to find.\n";
     return;
@@ -0,0 +1,371 @@
+//===- TraceReader.cpp - Read the records of a trace file in order --------===//
+//
+//                          Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the sequential reader of trace files.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Giri/TraceReader.h"
+#include "Giri/TraceCompression.h"
+#include "Giri/TraceEncoding.h"
+#include "Giri/TraceSummary.h"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace giri;
+using namespace llvm;
+
+/// Number of entries read at once from a flat trace
+static const unsigned FlatBufferEntries = 4096;
+
+/// Read exactly len bytes at the given offset of the file.
+/// \return true if all the bytes were read.
+static bool readAt(int fd, void *buf, size_t len, uint64_t offset) {
+  char *p = static_cast<char *>(buf);
+  while (len > 0) {
+    ssize_t readsize = pread(fd, p, len, offset);
+    if (readsize < 0 && errno == EINTR)
+      continue;
+    if (readsize <= 0)
+      return false;
+    p += readsize;
+    len -= readsize;
+    offset += readsize;
+  }
+  return true;
+}
+
+TraceReader::TraceReader(const std::string &Filename) :
+  fd(-1), flat(true), compact(false), sequenced(false), compressed(false),
+  summaries(false), done(false),
+  numEntries(0), position(0), bufferPos(0), bufferEnd(0) {
+  if (Filename == "-") {
+    fd = STDIN_FILENO;
+    return;
+  }
+
+  fd = open(Filename.c_str(), O_RDONLY);
+  if (fd == -1)
+    return;
+
+  struct stat finfo;
+  if (fstat(fd, &finfo) != 0) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  // A segmented trace starts with a header; anything else is a flat array of
+  // entries.
+  TraceHeader header;
+  if (finfo.st_size >= (off_t)sizeof(header) &&
+      readAt(fd, &header, sizeof(header), 0) &&
+      strncmp(header.magic, GIRI_TRACE_MAGIC, sizeof(header.magic)) == 0) {
+    flat = false;
+    if (!openSegments(Filename, header, finfo.st_size)) {
+      close(fd);
+      fd = -1;
+    }
+    return;
+  }
+
+  numEntries = finfo.st_size / sizeof(Entry);
+}
+
+TraceReader::~TraceReader() {
+  if (fd != -1 && fd != STDIN_FILENO)
+    close(fd);
+  for (auto I = threadFiles.begin(); I != threadFiles.end(); ++I)
+    close(*I);
+}
+
+bool TraceReader::openSegments(const std::string &Filename,
+                               const TraceHeader &header,
+                               uint64_t fileSize) {
+  compact = header.version == GIRI_TRACE_VERSION_COMPACT;
+  sequenced = header.flags & TF_PerThread;
+  compressed = header.flags & TF_Compressed;
+  summaries = header.flags & TF_Summaries;
+  if (!compact && (header.version != GIRI_TRACE_VERSION ||
+                   header.entrySize != sizeof(Entry))) {
+    errs() << "Unsupported trace format version " << header.version
+           << " with entries of " << header.entrySize << " bytes\n";
+    return false;
+  }
+
+  // Assign each segment to the stream of the thread which wrote it. The
+  // segments of the per-thread trace files, which must have the same layout
+  // as the trace file, come first: the trace file itself only holds the last
+  // records written by the crash handler.
+  std::map<uint64_t, unsigned> threadStreams;
+  if (header.flags & TF_ThreadFiles) {
+    uint32_t flags = header.flags & ~TF_ThreadFiles;
+    for (unsigned index = 0;; ++index) {
+      std::string name = Filename + "." + std::to_string(index);
+      int file = open(name.c_str(), O_RDONLY);
+      if (file == -1)
+        break;
+      threadFiles.push_back(file);
+
+      struct stat finfo;
+      TraceHeader threadHeader;
+      if (fstat(file, &finfo) != 0 ||
+          finfo.st_size < (off_t)sizeof(threadHeader) ||
+          !readAt(file, &threadHeader, sizeof(threadHeader), 0) ||
+          strncmp(threadHeader.magic, GIRI_TRACE_MAGIC,
+                  sizeof(threadHeader.magic)) != 0 ||
+          threadHeader.version != header.version ||
+          threadHeader.flags != flags) {
+        errs() << "Ignoring the malformed thread trace file " << name << "\n";
+        continue;
+      }
+      scanSegments(file, threadHeader.headerSize, finfo.st_size,
+                   threadStreams);
+    }
+  }
+  scanSegments(fd, header.headerSize, fileSize, threadStreams);
+
+  // Room for the END record supplied if the trace has none
+  ++numEntries;
+
+  for (unsigned index = 0; index < streams.size(); ++index)
+    if (loadSegment(streams[index]))
+      pushHead(index);
+  return true;
+}
+
+void TraceReader::scanSegments(int file,
+                               uint64_t offset,
+                               uint64_t fileSize,
+                               std::map<uint64_t, unsigned> &threadStreams) {
+  while (offset + sizeof(SegmentHeader) <= fileSize) {
+    SegmentHeader segment;
+    if (!readAt(file, &segment, sizeof(segment), offset) ||
+        segment.magic != GIRI_SEGMENT_MAGIC)
+      break;
+    offset += sizeof(segment);
+    // A segment may be cut short if the program was killed while writing it.
+    if (offset + segment.size > fileSize)
+      break;
+
+    // The summary of the segment follows its records.
+    SegmentSummary summary;
+    clearSummary(summary);
+    uint64_t size = segment.size;
+    if (summaries) {
+      if (size < sizeof(summary))
+        break;
+      size -= sizeof(summary);
+      if (!readAt(file, &summary, sizeof(summary), offset + size))
+        break;
+    }
+
+    auto I = threadStreams.find(segment.thread);
+    if (I == threadStreams.end()) {
+      I = threadStreams.insert(std::make_pair(segment.thread,
+                                              streams.size())).first;
+      streams.push_back(ThreadStream());
+      streams.back().nextSegment = 0;
+      streams.back().pos = 0;
+      streams.back().range = 0;
+    }
+    Segment S = {
+      file, offset, size, segment.thread, segment.firstSeq, segment.count,
+      summary
+    };
+    streams[I->second].segments.push_back(S);
+    numEntries += segment.count;
+    offset += segment.size;
+  }
+
+  if (offset != fileSize)
+    errs() << "Ignoring " << fileSize - offset
+           << " bytes of incomplete segments at the end of the trace\n";
+}
+
+bool TraceReader::loadSegment(ThreadStream &stream) {
+  while (stream.nextSegment < stream.segments.size()) {
+    const Segment &S = stream.segments[stream.nextSegment++];
+    if (S.count == 0)
+      continue;
+    stream.entries.resize(S.count);
+    stream.seqs.resize(S.count);
+    stream.pos = 0;
+    if (compact)
+      return decodeSegment(S, stream);
+    if (compressed)
+      return copySegment(S, stream);
+    bool ok = readAt(S.fd, &stream.entries[0], S.count * sizeof(Entry),
+                     S.offset);
+    if (sequenced) {
+      uint64_t seqOffset = S.offset + S.count * sizeof(Entry);
+      ok = ok && readAt(S.fd, &stream.seqs[0], S.count * sizeof(uint64_t),
+                        seqOffset);
+    } else {
+      // The records of unsequenced segments are in trace order.
+      for (unsigned i = 0; i < S.count; ++i)
+        stream.seqs[i] = S.firstSeq + i;
+    }
+    if (!ok) {
+      errs() << "Cannot read trace segment at offset " << S.offset << "\n";
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool TraceReader::readPayload(const Segment &S) {
+  std::vector<unsigned char> &buffer = compressed ? packed : encoded;
+  buffer.resize(S.size);
+  if (S.size && !readAt(S.fd, &buffer[0], S.size, S.offset)) {
+    errs() << "Cannot read trace segment at offset " << S.offset << "\n";
+    return false;
+  }
+  if (!compressed)
+    return true;
+
+  uint64_t rawSize;
+  if (S.size < sizeof(rawSize)) {
+    errs() << "Truncated compressed trace segment at offset " << S.offset
+           << "\n";
+    return false;
+  }
+  memcpy(&rawSize, &packed[0], sizeof(rawSize));
+  encoded.resize(rawSize);
+  if (!decompressBlock(&packed[sizeof(rawSize)], S.size - sizeof(rawSize),
+                       encoded.data(), rawSize)) {
+    errs() << "Malformed compressed trace segment at offset " << S.offset
+           << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool TraceReader::copySegment(const Segment &S, ThreadStream &stream) {
+  if (!readPayload(S))
+    return false;
+
+  size_t entriesSize = S.count * sizeof(Entry);
+  size_t seqsSize = sequenced ? S.count * sizeof(uint64_t) : 0;
+  if (encoded.size() != entriesSize + seqsSize) {
+    errs() << "Trace segment at offset " << S.offset << " holds "
+           << encoded.size() << " bytes instead of " << S.count
+           << " records\n";
+    return false;
+  }
+  memcpy(&stream.entries[0], &encoded[0], entriesSize);
+  if (sequenced) {
+    memcpy(&stream.seqs[0], &encoded[entriesSize], seqsSize);
+  } else {
+    for (unsigned i = 0; i < S.count; ++i)
+      stream.seqs[i] = S.firstSeq + i;
+  }
+  return true;
+}
+
+bool TraceReader::decodeSegment(const Segment &S, ThreadStream &stream) {
+  if (!readPayload(S))
+    return false;
+
+  RecordDecoder decoder;
+  decoder.reset(S.thread, S.firstSeq, sequenced);
+  const unsigned char *p = encoded.data();
+  const unsigned char *end = p + encoded.size();
+  for (unsigned i = 0; i < S.count; ++i) {
+    p = decoder.decode(p, end, stream.entries[i], stream.seqs[i]);
+    if (!p) {
+      errs() << "Malformed record " << i << " in trace segment at offset "
+             << S.offset << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+void TraceReader::pushHead(unsigned index) {
+  ThreadStream &stream = streams[index];
+  heads.push(Head(stream.seqs[stream.pos], index));
+}
+
+bool TraceReader::next(Entry &entry) {
+  if (done)
+    return false;
+
+  bool found = flat ? nextFlat(entry) : nextMerged(entry);
+  if (!found) {
+    // The trace was not terminated properly.  Supply the END record so that
+    // clients always find one.
+    entry = Entry(RecordType::ENType, 0);
+  }
+
+  if (entry.type == RecordType::ENType)
+    done = true;
+  ++position;
+  return true;
+}
+
+bool TraceReader::nextFlat(Entry &entry) {
+  if (bufferPos == bufferEnd) {
+    // Refill the buffer.  A partial entry at the end of the file is dropped.
+    buffer.resize(FlatBufferEntries);
+    char *p = reinterpret_cast<char *>(&buffer[0]);
+    size_t len = FlatBufferEntries * sizeof(Entry);
+    size_t total = 0;
+    while (total < len) {
+      ssize_t readsize = read(fd, p + total, len - total);
+      if (readsize < 0 && errno == EINTR)
+        continue;
+      if (readsize <= 0)
+        break;
+      total += readsize;
+    }
+    bufferPos = 0;
+    bufferEnd = total / sizeof(Entry);
+    if (bufferEnd == 0)
+      return false;
+  }
+
+  entry = buffer[bufferPos++];
+  return true;
+}
+
+bool TraceReader::nextMerged(Entry &entry) {
+  if (heads.empty())
+    return false;
+
+  // Take the record with the smallest sequence number of all the streams,
+  // and advance its stream.
+  unsigned index = heads.top().second;
+  heads.pop();
+  ThreadStream &stream = streams[index];
+  if (summaries) {
+    // Note where the records of the segment end up in the merged order.
+    if (stream.pos == 0) {
+      SummaryRange R = {
+        position, position, stream.segments[stream.nextSegment - 1].summary
+      };
+      stream.range = ranges.size();
+      ranges.push_back(R);
+    }
+    ranges[stream.range].last = position;
+  }
+  entry = stream.entries[stream.pos++];
+  if (stream.pos < stream.entries.size() || loadSegment(stream))
+    pushHead(index);
+  return true;
+}
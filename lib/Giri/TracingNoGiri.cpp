@@ -22,13 +22,19 @@
 #include "Utility/VectorExtras.h"
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
+#include <algorithm>
 #include <vector>
 #include <string>
 
@@ -41,6 +47,39 @@ using namespace llvm;
 // this shared command line option was defined in the Utility so
 extern llvm::cl::opt<std::string> TraceFilename;
 
+// The slicer reads the records of the local allocas as well if they are traced
+// (TraceFile.cpp)
+cl::opt<bool>
+TraceLocalAllocas("trace-local-allocas",
+                  cl::desc("Trace the loads and stores of allocas whose "
+                           "address does not escape"),
+                  cl::init(false));
+
+static cl::opt<bool>
+BatchBlocks("trace-batch-blocks",
+            cl::desc("Record the loads, stores and selects of a basic block "
+                     "with one run-time call"),
+            cl::init(false));
+
+static cl::opt<bool>
+TraceStrided("trace-strided",
+             cl::desc("Record the loads and stores of innermost loops whose "
+                      "address advances by a constant stride once per "
+                      "execution of the loop"),
+             cl::init(false));
+
+static cl::opt<bool>
+TraceBranches("trace-branches",
+              cl::desc("Record function entries and the outcomes of the "
+                       "branches instead of every basic block"),
+              cl::init(false));
+
+static cl::opt<bool>
+TraceSlice("trace-slice",
+           cl::desc("Record only the loads, stores and selects in the static "
+                    "backwards slice of the slicing criteria"),
+           cl::init(false));
+
 //===----------------------------------------------------------------------===//
 //                        Pass Statistics
 //===----------------------------------------------------------------------===//
@@ -54,6 +93,13 @@ STATISTIC(NumLoadStrings, "Number of load instructions processed");
 STATISTIC(NumStoreStrings, "Number of store instructions processed");
 STATISTIC(NumCalls, "Number of call instructions processed");
 STATISTIC(NumExtFuns, "Number of special external calls processed, e.g. memcpy");
+STATISTIC(NumSyncCalls, "Number of pthread synchronization calls processed");
+STATISTIC(NumBatches, "Number of batched run-time calls");
+STATISTIC(NumLocalAccesses, "Number of local alloca accesses not instrumented");
+STATISTIC(NumStridedAccesses, "Number of loads and stores recorded as strided");
+STATISTIC(NumBranches, "Number of branches whose outcome is recorded");
+STATISTIC(NumUnslicedAccesses,
+          "Number of loads, stores and selects outside the static slice");
 
 //===----------------------------------------------------------------------===//
 //                        TracingNoGiri Implementations
@@ -83,7 +129,9 @@ bool TracingNoGiri::doInitialization(Module & M) {
   Int32Type = IntegerType::getInt32Ty(M.getContext());
   Int64Type = IntegerType::getInt64Ty(M.getContext());
   VoidPtrType = PointerType::getUnqual(Int8Type);
+  VoidPtrPtrType = PointerType::getUnqual(VoidPtrType);
   VoidType = Type::getVoidTy(M.getContext());
+  BatchRecordType = StructType::get(Int32Type, Int32Type, Int64Type, nullptr);
 
   // Get a reference to the run-time's initialization function
   Init = cast<Function>(M.getOrInsertFunction("recordInit",
@@ -181,10 +229,86 @@ bool TracingNoGiri::doInitialization(Module & M) {
                                                       Int32Type,
                                                       Int8Type,
                                                       nullptr));
+
+  RecordSync = cast<Function>(M.getOrInsertFunction("recordSync",
+                                                    VoidType,
+                                                    Int32Type,
+                                                    Int32Type,
+                                                    VoidPtrType,
+                                                    nullptr));
+
+  // Add the functions for recording the accesses of a basic block at once.
+  RecordBatch = cast<Function>(M.getOrInsertFunction("recordBatch",
+                                                     VoidType,
+                                                     VoidPtrType,
+                                                     VoidPtrPtrType,
+                                                     Int32Type,
+                                                     nullptr));
+
+  RecordBlockBatch = cast<Function>(M.getOrInsertFunction("recordBlockBatch",
+                                                          VoidType,
+                                                          Int32Type,
+                                                          VoidPtrType,
+                                                          Int32Type,
+                                                          VoidPtrType,
+                                                          VoidPtrPtrType,
+                                                          Int32Type,
+                                                          nullptr));
+
+  // Add the function for recording the accesses of a loop at once.
+  RecordStrided = cast<Function>(M.getOrInsertFunction("recordStrided",
+                                                       VoidType,
+                                                       Int32Type,
+                                                       VoidPtrType,
+                                                       Int32Type,
+                                                       Int64Type,
+                                                       Int32Type,
+                                                       nullptr));
+
+  // Add the functions for recording the control flow without basic block
+  // records.
+  RecordFunctionEntry =
+    cast<Function>(M.getOrInsertFunction("recordFunctionEntry",
+                                         VoidType,
+                                         Int32Type,
+                                         VoidPtrType,
+                                         nullptr));
+
+  RecordBranch = cast<Function>(M.getOrInsertFunction("recordBranch",
+                                                      VoidType,
+                                                      Int64Type,
+                                                      Int32Type,
+                                                      nullptr));
   createCtor(M);
   return true;
 }
 
+bool TracingNoGiri::doInitialization(Function &F) {
+  BatchSlots = nullptr;
+  BatchRecords.clear();
+  StridedAccesses.clear();
+  if (!BatchBlocks || F.isDeclaration())
+    return false;
+
+  // Every batch of the function reuses the slots, so there are as many as
+  // the basic block with the most batched accesses needs.
+  unsigned size = 0;
+  for (Function::iterator BB = F.begin(); BB != F.end(); ++BB) {
+    unsigned accesses = 0;
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I)
+      if (isBatched(*I))
+        ++accesses;
+    size = std::max(size, accesses);
+  }
+  if (size == 0)
+    return false;
+
+  ArrayType *SlotsType = ArrayType::get(VoidPtrType, size);
+  BatchSlots = new AllocaInst(SlotsType, "giri.slots",
+                              skipAllocas(F.getEntryBlock()));
+  return true;
+}
+
 void TracingNoGiri::createCtor(Module &M) {
   // Create the ctor function.
   Type *VoidTy = Type::getVoidTy(M.getContext());
@@ -243,6 +367,23 @@ void TracingNoGiri::instrumentBasicBlock(BasicBlock &BB) {
   // Get a pointer to the function in which the basic block belongs.
   Value *FP = castTo(BB.getParent(), VoidPtrType, "", BB.getTerminator());
 
+  // Without basic block records, the entry block records the entry of the
+  // function, after the allocas, and the terminators record their outcomes.
+  // The reader follows the control flow graph from there.
+  if (TraceBranches) {
+    if (BatchBlocks)
+      flushBatch(BB.getTerminator());
+    if (&BB == &BB.getParent()->getEntryBlock()) {
+      std::vector<Value *> args = make_vector<Value *>(BBID, FP, 0);
+      Instruction *E = CallInst::Create(RecordFunctionEntry, args, "",
+                                        skipAllocas(BB));
+      instrumentLock(E);
+      instrumentUnlock(E);
+    }
+    instrumentBranch(BB);
+    return;
+  }
+
   Value *LastBB;
   if (isa<ReturnInst>(BB.getTerminator()))
      LastBB = ConstantInt::get(Int32Type, 1);
@@ -250,10 +391,19 @@ void TracingNoGiri::instrumentBasicBlock(BasicBlock &BB) {
      LastBB = ConstantInt::get(Int32Type, 0);
 
   // Insert code at the end of the basic block to record that it was executed.
+  // With batching, the same call records the accesses of the block since
+  // its last call, and takes the lock itself.
   std::vector<Value *> args = make_vector<Value *>(BBID, FP, LastBB, 0);
-  instrumentLock(BB.getTerminator());
-  Instruction *RBB = CallInst::Create(RecordBB, args, "", BB.getTerminator());
-  instrumentUnlock(RBB);
+  if (BatchBlocks) {
+    takeBatch(BB.getTerminator(), args);
+    CallInst::Create(RecordBlockBatch, args, "", BB.getTerminator());
+    ++NumBatches;
+  } else {
+    instrumentLock(BB.getTerminator());
+    Instruction *RBB = CallInst::Create(RecordBB, args, "",
+                                        BB.getTerminator());
+    instrumentUnlock(RBB);
+  }
 
   // Insert code at the beginning of the basic block to record that it started
   // execution.
@@ -264,7 +414,270 @@ void TracingNoGiri::instrumentBasicBlock(BasicBlock &BB) {
   instrumentUnlock(S);
 }
 
+void TracingNoGiri::instrumentBranch(BasicBlock &BB) {
+  TerminatorInst *T = BB.getTerminator();
+  Value *Outcome;
+  unsigned bits;
+  if (BranchInst *BI = dyn_cast<BranchInst>(T)) {
+    if (BI->isUnconditional())
+      return;
+    // The outcome is the index of the successor, 0 if the branch is taken.
+    Outcome = BinaryOperator::CreateNot(BI->getCondition(), "", T);
+    bits = 1;
+  } else if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+    if (SI->getNumCases() == 0)
+      return;
+    // The reader matches the value of the condition against the cases.
+    Outcome = SI->getCondition();
+    bits = cast<IntegerType>(Outcome->getType())->getBitWidth();
+    if (bits > 64)
+      report_fatal_error("-trace-branches does not support switches on "
+                         "integers wider than 64 bits");
+  } else if (IndirectBrInst *IBI = dyn_cast<IndirectBrInst>(T)) {
+    unsigned count = IBI->getNumDestinations();
+    if (count <= 1)
+      return;
+    // The outcome is the index of the destination whose address is taken.
+    Outcome = ConstantInt::get(Int64Type, 0);
+    for (unsigned i = 1; i < count; ++i) {
+      Value *Dest = BlockAddress::get(BB.getParent(), IBI->getDestination(i));
+      Value *Taken = new ICmpInst(T, ICmpInst::ICMP_EQ, IBI->getAddress(),
+                                  Dest);
+      Outcome = SelectInst::Create(Taken, ConstantInt::get(Int64Type, i),
+                                   Outcome, "", T);
+    }
+    bits = Log2_32_Ceil(count);
+  } else if (isa<InvokeInst>(T)) {
+    report_fatal_error("-trace-branches does not support invoke "
+                       "instructions");
+  } else {
+    // Returns and unreachables have no successor.
+    return;
+  }
+
+  std::vector<Value *> args = make_vector<Value *>(
+    castTo(Outcome, Int64Type, "", T),
+    ConstantInt::get(Int32Type, bits), 0);
+  CallInst::Create(RecordBranch, args, "", T);
+  ++NumBranches;
+}
+
+bool TracingNoGiri::inSlice(Instruction &I) {
+  return !TraceSlice || SlicePass->contains(&I);
+}
+
+bool TracingNoGiri::isBatched(Instruction &I) {
+  if (LoadInst *LI = dyn_cast<LoadInst>(&I))
+    return TraceLocalAllocas || !getLocalAlloca(LI->getPointerOperand());
+  if (StoreInst *SI = dyn_cast<StoreInst>(&I))
+    return TraceLocalAllocas || !getLocalAlloca(SI->getPointerOperand());
+  return isa<SelectInst>(I);
+}
+
+void TracingNoGiri::addToBatch(Instruction *I,
+                               RecordType type,
+                               Value *V,
+                               uint64_t length) {
+  assert(BatchSlots && "No slots for the batched records!\n");
+  std::vector<Value *> indices = make_vector<Value *>(
+    ConstantInt::get(Int32Type, 0),
+    ConstantInt::get(Int32Type, BatchRecords.size()), 0);
+  Value *Slot = GetElementPtrInst::CreateInBounds(BatchSlots, indices, "", I);
+  new StoreInst(V, Slot, I);
+
+  std::vector<Constant *> fields = make_vector<Constant *>(
+    ConstantInt::get(Int32Type, static_cast<unsigned>(type)),
+    ConstantInt::get(Int32Type, lsNumPass->getID(I)),
+    ConstantInt::get(Int64Type, length), 0);
+  BatchRecords.push_back(ConstantStruct::get(BatchRecordType, fields));
+}
+
+void TracingNoGiri::takeBatch(Instruction *I, std::vector<Value *> &args) {
+  unsigned count = BatchRecords.size();
+  if (count == 0) {
+    args.push_back(ConstantPointerNull::get(cast<PointerType>(VoidPtrType)));
+    args.push_back(ConstantPointerNull::get(cast<PointerType>(VoidPtrPtrType)));
+    args.push_back(ConstantInt::get(Int32Type, 0));
+    return;
+  }
+
+  Module *M = I->getParent()->getParent()->getParent();
+  ArrayType *RecordsType = ArrayType::get(BatchRecordType, count);
+  GlobalVariable *Records =
+    new GlobalVariable(*M, RecordsType, true, GlobalValue::InternalLinkage,
+                       ConstantArray::get(RecordsType, BatchRecords),
+                       "giri.batch");
+  BatchRecords.clear();
+  args.push_back(ConstantExpr::getBitCast(Records, VoidPtrType));
+  args.push_back(castTo(BatchSlots, VoidPtrPtrType, "", I));
+  args.push_back(ConstantInt::get(Int32Type, count));
+}
+
+void TracingNoGiri::flushBatch(Instruction *I) {
+  if (BatchRecords.empty())
+    return;
+  std::vector<Value *> args;
+  takeBatch(I, args);
+  CallInst::Create(RecordBatch, args, "", I);
+  ++NumBatches;
+}
+
+/// Return true if the loop calls a function. The records of a call would fall
+/// between the accesses of the loop and the basic block records which place
+/// them.
+static bool hasCalls(const Loop *L) {
+  for (Loop::block_iterator BB = L->block_begin(); BB != L->block_end(); ++BB)
+    for (BasicBlock::iterator I = (*BB)->begin(); I != (*BB)->end(); ++I)
+      if ((isa<CallInst>(I) || isa<InvokeInst>(I)) &&
+          !isa<DbgInfoIntrinsic>(I))
+        return true;
+  return false;
+}
+
+/// Return true if the expression can be computed in the loop preheader. It
+/// must not divide by a value which may be zero.
+static bool isSafeToCompute(const SCEV *S) {
+  if (const SCEVUDivExpr *D = dyn_cast<SCEVUDivExpr>(S)) {
+    const SCEVConstant *RHS = dyn_cast<SCEVConstant>(D->getRHS());
+    return RHS && !RHS->getValue()->isZero() && isSafeToCompute(D->getLHS());
+  }
+  if (const SCEVCastExpr *C = dyn_cast<SCEVCastExpr>(S))
+    return isSafeToCompute(C->getOperand());
+  if (const SCEVNAryExpr *N = dyn_cast<SCEVNAryExpr>(S))
+    for (SCEVNAryExpr::op_iterator I = N->op_begin(); I != N->op_end(); ++I)
+      if (!isSafeToCompute(*I))
+        return false;
+  return true;
+}
+
+void TracingNoGiri::instrumentStridedAccesses(Function &F) {
+  LoopInfo &LI = getAnalysis<LoopInfo>();
+  DominatorTree &DT = getAnalysis<DominatorTree>();
+  SE = &getAnalysis<ScalarEvolution>();
+
+  std::vector<Loop *> Worklist(LI.begin(), LI.end());
+  while (!Worklist.empty()) {
+    Loop *L = Worklist.back();
+    Worklist.pop_back();
+    if (!L->empty()) {
+      Worklist.insert(Worklist.end(), L->begin(), L->end());
+      continue;
+    }
+
+    // The loop must be entered from its preheader and left from one block,
+    // its header or its latch, and the number of its iterations must be
+    // known when it is entered.
+    BasicBlock *Header = L->getHeader();
+    BasicBlock *Latch = L->getLoopLatch();
+    BasicBlock *Exiting = L->getExitingBlock();
+    if (!L->getLoopPreheader() || !Latch ||
+        (Exiting != Header && Exiting != Latch) || hasCalls(L))
+      continue;
+    const SCEV *Taken = SE->getBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(Taken) || !isSafeToCompute(Taken))
+      continue;
+    Taken = SE->getTruncateOrZeroExtend(Taken, Int64Type);
+    const SCEV *Iterations =
+      SE->getAddExpr(Taken, SE->getConstant(Int64Type, 1));
+
+    // Every iteration executes the basic blocks which dominate the latch,
+    // except that the last one ends in the header if the loop exits there.
+    for (Loop::block_iterator BB = L->block_begin(); BB != L->block_end(); ++BB)
+      if (DT.dominates(*BB, Latch))
+        instrumentStridedAccesses(L, *BB,
+                                  (*BB == Header || Exiting == Latch) ?
+                                  Iterations : Taken);
+  }
+}
+
+void TracingNoGiri::instrumentStridedAccesses(Loop *L,
+                                              BasicBlock *BB,
+                                              const SCEV *Count) {
+  Instruction *Preheader = L->getLoopPreheader()->getTerminator();
+  SCEVExpander Expander(*SE, "giri.strided");
+  Value *NumAccesses = nullptr;
+
+  // The accesses of a strided record take place at the end of the basic
+  // block, so no access recorded one by one may follow them.
+  for (BasicBlock::iterator I = BB->end(); I != BB->begin();) {
+    Instruction *Inst = --I;
+    Value *Pointer;
+    Type *AccessType;
+    if (LoadInst *LI = dyn_cast<LoadInst>(Inst)) {
+      if (!LI->isSimple())
+        break;
+      Pointer = LI->getPointerOperand();
+      AccessType = LI->getType();
+    } else if (StoreInst *SI = dyn_cast<StoreInst>(Inst)) {
+      if (!SI->isSimple())
+        break;
+      Pointer = SI->getPointerOperand();
+      AccessType = SI->getOperand(0)->getType();
+    } else {
+      continue;
+    }
+    if ((!TraceLocalAllocas && getLocalAlloca(Pointer)) || !inSlice(*Inst))
+      continue;
+
+    // The address must advance by the same number of bytes in every
+    // iteration of this loop.
+    const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(Pointer));
+    if (!AR || AR->getLoop() != L || !AR->isAffine() ||
+        !isSafeToCompute(AR->getStart()))
+      break;
+    const SCEVConstant *Step =
+      dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+    uint64_t size = TD->getTypeStoreSize(AccessType);
+    if (!Step || Step->getValue()->getValue().getMinSignedBits() > 32 ||
+        size == 0 || size > UINT8_MAX)
+      break;
+
+    if (!NumAccesses)
+      NumAccesses = Expander.expandCodeFor(Count, Int64Type, Preheader);
+    Value *Base = Expander.expandCodeFor(AR->getStart(),
+                                         AR->getStart()->getType(),
+                                         Preheader);
+    Base = castTo(Base, VoidPtrType, "", Preheader);
+    Value *Stride = ConstantInt::getSigned(Int32Type,
+                                           Step->getValue()->getSExtValue());
+    std::vector<Value *> args =
+      make_vector<Value *>(ConstantInt::get(Int32Type, lsNumPass->getID(Inst)),
+                           Base, Stride, NumAccesses,
+                           ConstantInt::get(Int32Type, size), 0);
+    Instruction *RS = CallInst::Create(RecordStrided, args, "", Preheader);
+    instrumentLock(RS);
+    instrumentUnlock(RS);
+
+    StridedAccesses.insert(Inst);
+    ++NumStridedAccesses;
+  }
+}
+
 void TracingNoGiri::visitLoadInst(LoadInst &LI) {
+  // The slicer finds the store read from a local alloca without a record.
+  if (!TraceLocalAllocas && getLocalAlloca(LI.getPointerOperand())) {
+    ++NumLocalAccesses;
+    return;
+  }
+
+  // The strided record in the preheader of its loop records it.
+  if (StridedAccesses.count(&LI))
+    return;
+
+  // The value read cannot affect the slicing criteria.
+  if (!inSlice(LI)) {
+    ++NumUnslicedAccesses;
+    return;
+  }
+
+  if (BatchBlocks) {
+    Value *Pointer = castTo(LI.getPointerOperand(), VoidPtrType, "", &LI);
+    addToBatch(&LI, RecordType::LDType, Pointer,
+               TD->getTypeStoreSize(LI.getType()));
+    ++NumLoads;
+    return;
+  }
+
   instrumentLock(&LI);
 
   // Get the ID of the load instruction.
@@ -284,6 +697,21 @@ void TracingNoGiri::visitLoadInst(LoadInst &LI) {
 }
 
 void TracingNoGiri::visitSelectInst(SelectInst &SI) {
+  if (!inSlice(SI)) {
+    ++NumUnslicedAccesses;
+    return;
+  }
+
+  if (BatchBlocks) {
+    // The slot of a select holds its condition.
+    Value *Predicate = castTo(SI.getCondition(), Int64Type, "", &SI);
+    Predicate = CastInst::Create(Instruction::IntToPtr, Predicate,
+                                 VoidPtrType, "", &SI);
+    addToBatch(&SI, RecordType::PDType, Predicate, 0);
+    ++NumSelects;
+    return;
+  }
+
   instrumentLock(&SI);
 
   // Cast the predicate (boolean) value into an 8-bit value.
@@ -300,6 +728,28 @@ void TracingNoGiri::visitSelectInst(SelectInst &SI) {
 }
 
 void TracingNoGiri::visitStoreInst(StoreInst &SI) {
+  if (!TraceLocalAllocas && getLocalAlloca(SI.getPointerOperand())) {
+    ++NumLocalAccesses;
+    return;
+  }
+
+  if (StridedAccesses.count(&SI))
+    return;
+
+  // No load in the static slice may read the value written.
+  if (!inSlice(SI)) {
+    ++NumUnslicedAccesses;
+    return;
+  }
+
+  if (BatchBlocks) {
+    Value *Pointer = castTo(SI.getPointerOperand(), VoidPtrType, "", &SI);
+    addToBatch(&SI, RecordType::STType, Pointer,
+               TD->getTypeStoreSize(SI.getOperand(0)->getType()));
+    ++NumStores;
+    return;
+  }
+
   instrumentLock(&SI);
 
   // Cast the pointer into a void pointer type.
@@ -333,6 +783,8 @@ bool TracingNoGiri::visitSpecialCall(CallInst &CI) {
 
   // Check the name of the function against a list of known special functions.
   std::string name = CalledFunc->getName().str();
+  if (name.compare(0, 8, "pthread_") == 0)
+    return visitSyncCall(CI, name);
   if (name.substr(0,12) == "llvm.memset.") {
     instrumentLock(&CI);
 
@@ -532,11 +984,104 @@ bool TracingNoGiri::visitSpecialCall(CallInst &CI) {
   return false;
 }
 
+Instruction *TracingNoGiri::instrumentSync(CallInst &CI,
+                                           unsigned kind,
+                                           Value *Object,
+                                           Instruction *After) {
+  // Cast the object into a void pointer. A pthread_t is an integer.
+  if (Object->getType()->isIntegerTy())
+    Object = CastInst::Create(Instruction::IntToPtr, Object, VoidPtrType,
+                              Object->getName(), &CI);
+  else
+    Object = castTo(Object, VoidPtrType, Object->getName(), &CI);
+
+  // Get the ID of the call instruction.
+  Value *CallID = ConstantInt::get(Int32Type, lsNumPass->getID(&CI));
+  Value *Kind = ConstantInt::get(Int32Type, kind);
+  std::vector<Value *> args = make_vector(CallID, Kind, Object, 0);
+  CallInst *RS = CallInst::Create(RecordSync, args);
+  if (After)
+    RS->insertAfter(After);
+  else
+    RS->insertBefore(&CI);
+
+  instrumentLock(RS);
+  instrumentUnlock(RS);
+
+  // The unlock follows the record.
+  BasicBlock::iterator Last = RS;
+  return ++Last;
+}
+
+bool TracingNoGiri::visitSyncCall(CallInst &CI, const std::string &name) {
+  // A release is recorded before the call, so that it precedes the acquires
+  // which observe it, and an acquire is recorded after the call.
+  if (name == "pthread_mutex_lock") {
+    instrumentSync(CI, SK_MutexLock, CI.getOperand(0), &CI);
+  } else if (name == "pthread_mutex_trylock") {
+    // Only a lock which was taken acquires the mutex. Otherwise the record
+    // names no object, and readers ignore it.
+    Value *Mutex = castTo(CI.getOperand(0), VoidPtrType, "", &CI);
+    Instruction *Taken = new ICmpInst(ICmpInst::ICMP_EQ, &CI,
+                                      ConstantInt::get(CI.getType(), 0));
+    Taken->insertAfter(&CI);
+    Value *Null = ConstantPointerNull::get(cast<PointerType>(VoidPtrType));
+    Instruction *Object = SelectInst::Create(Taken, Mutex, Null);
+    Object->insertAfter(Taken);
+    instrumentSync(CI, SK_MutexLock, Object, Object);
+  } else if (name == "pthread_mutex_unlock") {
+    instrumentSync(CI, SK_MutexUnlock, CI.getOperand(0), nullptr);
+  } else if (name == "pthread_cond_signal" ||
+             name == "pthread_cond_broadcast") {
+    instrumentSync(CI, SK_CondSignal, CI.getOperand(0), nullptr);
+  } else if (name == "pthread_cond_wait" ||
+             name == "pthread_cond_timedwait") {
+    // Waiting releases the mutex, and takes it again before returning.
+    instrumentSync(CI, SK_MutexUnlock, CI.getOperand(1), nullptr);
+    Instruction *Last = instrumentSync(CI, SK_CondWake, CI.getOperand(0), &CI);
+    instrumentSync(CI, SK_MutexLock, CI.getOperand(1), Last);
+  } else if (name == "pthread_create") {
+    instrumentSync(CI, SK_ThreadCreate, CI.getOperand(0), nullptr);
+    // The pthread_t is only set if the thread was created, so a failed call
+    // names no thread.
+    Value *Thread = castTo(CI.getOperand(0), VoidPtrType, "", &CI);
+    Instruction *Created = new ICmpInst(ICmpInst::ICMP_EQ, &CI,
+                                        ConstantInt::get(CI.getType(), 0));
+    Created->insertAfter(&CI);
+    Value *Null = ConstantPointerNull::get(cast<PointerType>(VoidPtrType));
+    Instruction *Object = SelectInst::Create(Created, Thread, Null);
+    Object->insertAfter(Created);
+    instrumentSync(CI, SK_ThreadCreated, Object, Object);
+  } else if (name == "pthread_join") {
+    instrumentSync(CI, SK_ThreadJoin, CI.getOperand(0), &CI);
+  } else {
+    return false;
+  }
+
+  ++NumSyncCalls; // Update statistics
+  return true;
+}
+
 void TracingNoGiri::visitCallInst(CallInst &CI) {
   // Attempt to get the called function.
   Function *CalledFunc = CI.getCalledFunction();
-  if (!CalledFunc)
+
+  // The records of the accesses before the call precede the records of the
+  // call and of the function it calls.
+  if (!isTracerFunction(CalledFunc) &&
+      !(CalledFunc && !CalledFunc->getName().str().compare(0,9,"llvm.dbg.")))
+    flushBatch(&CI);
+
+  // Without basic block records, the reader needs the calls through function
+  // pointers to tell the functions they call from callbacks of external code.
+  if (!CalledFunc) {
+    if (TraceBranches &&
+        !isa<InlineAsm>(CI.getCalledValue()->stripPointerCasts())) {
+      instrumentCall(CI, RecordExtCall);
+      ++NumCalls;
+    }
     return;
+  }
 
   // Do not instrument calls to tracing run-time functions or debug functions.
   if (isTracerFunction(CalledFunc))
@@ -557,28 +1102,13 @@ void TracingNoGiri::visitCallInst(CallInst &CI) {
   if (isa<InlineAsm>(CI.getCalledValue()->stripPointerCasts()))
     return;
 
-  instrumentLock(&CI);
-  // Get the ID of the store instruction.
-  Value *CallID = ConstantInt::get(Int32Type, lsNumPass->getID(&CI));
-  // Get the called function value and cast it to a void pointer.
-  Value *FP = castTo(CI.getCalledValue(), VoidPtrType, "", &CI);
-  // Create the call to the run-time to record the call instruction.
-  std::vector<Value *> args = make_vector<Value *>(CallID, FP, 0);
   // Do not add calls to function call stack for external functions
   // as return records won't be used/needed for them, so call a special record function
   // FIXME!!!! Do we still need it after adding separate return records????
-  Instruction *RC;
   if (CalledFunc->isDeclaration())
-    RC = CallInst::Create(RecordExtCall, args, "", &CI);
+    instrumentCall(CI, RecordExtCall);
   else
-    RC = CallInst::Create(RecordCall, args, "", &CI);
-  instrumentUnlock(RC);
-
-  // Create the call to the run-time to record the return of call instruction.
-  CallInst *CallInst = CallInst::Create(RecordReturn, args, "", &CI);
-  CI.moveBefore(CallInst);
-  instrumentLock(CallInst);
-  instrumentUnlock(CallInst);
+    instrumentCall(CI, RecordCall);
 
   ++NumCalls; // Update statistics
 
@@ -622,15 +1152,67 @@ void TracingNoGiri::visitCallInst(CallInst &CI) {
   visitSpecialCall(CI);
 }
 
+void TracingNoGiri::instrumentCall(CallInst &CI, Function *RecordFn) {
+  instrumentLock(&CI);
+  // Get the ID of the store instruction.
+  Value *CallID = ConstantInt::get(Int32Type, lsNumPass->getID(&CI));
+  // Get the called function value and cast it to a void pointer.
+  Value *FP = castTo(CI.getCalledValue(), VoidPtrType, "", &CI);
+  // Create the call to the run-time to record the call instruction.
+  std::vector<Value *> args = make_vector<Value *>(CallID, FP, 0);
+  Instruction *RC = CallInst::Create(RecordFn, args, "", &CI);
+  instrumentUnlock(RC);
+
+  // Create the call to the run-time to record the return of call instruction.
+  CallInst *CallInst = CallInst::Create(RecordReturn, args, "", &CI);
+  CI.moveBefore(CallInst);
+  instrumentLock(CallInst);
+  instrumentUnlock(CallInst);
+}
+
+void TracingNoGiri::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<DataLayout>();
+  AU.addRequired<QueryBasicBlockNumbers>();
+  AU.addPreserved<QueryBasicBlockNumbers>();
+
+  AU.addRequired<QueryLoadStoreNumbers>();
+  AU.addPreserved<QueryLoadStoreNumbers>();
+
+  // We will need the loops and their induction variables to find the
+  // strided accesses
+  if (TraceStrided) {
+    AU.addRequired<DominatorTree>();
+    AU.addRequired<LoopInfo>();
+    AU.addRequired<ScalarEvolution>();
+  }
+
+  // The static slice is found before any basic block is instrumented. It
+  // refers to the original instructions, so the instrumentation keeps it.
+  if (TraceSlice) {
+    AU.addRequired<StaticSlice>();
+    AU.addPreserved<StaticSlice>();
+  }
+  AU.setPreservesCFG();
+}
+
 bool TracingNoGiri::runOnBasicBlock(BasicBlock &BB) {
   // Fetch the analysis results for numbering basic blocks.
   // Will be run once per module
   TD        = &getAnalysis<DataLayout>();
   bbNumPass = &getAnalysis<QueryBasicBlockNumbers>();
   lsNumPass = &getAnalysis<QueryLoadStoreNumbers>();
+  SlicePass = TraceSlice ? &getAnalysis<StaticSlice>() : nullptr;
+
+  // The strided accesses of a function are found before any of its basic
+  // blocks is instrumented, when its entry block is visited first.
+  if (TraceStrided && &BB == &BB.getParent()->getEntryBlock())
+    instrumentStridedAccesses(*BB.getParent());
 
-  // Instrument the basic block so that it records its execution.
-  instrumentBasicBlock(BB);
+  // Instrument the basic block so that it records its execution.  With
+  // batching, its record also holds the accesses of the block, so it is
+  // added after they are visited.
+  if (!BatchBlocks)
+    instrumentBasicBlock(BB);
 
   // Scan through all instructions in the basic block and instrument them as
   // necessary.  Use a worklist to contain the instructions to avoid any
@@ -639,6 +1221,8 @@ bool TracingNoGiri::runOnBasicBlock(BasicBlock &BB) {
   for (BasicBlock::iterator I = BB.begin(); I != BB.end(); ++I)
     Worklist.push_back(I);
   visit(Worklist.begin(), Worklist.end());
+  if (BatchBlocks)
+    instrumentBasicBlock(BB);
 
   // Update the number of basic blocks with phis.
   if (hasPHI(BB))
@@ -0,0 +1,201 @@
+//===- ProfileSrcLines.cpp - Rank source lines by trace records -----------===//
+//
+//                      Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements an analysis pass that reads the execution profile
+// written by the tracing run-time and reports which functions and source
+// lines produce the records of the trace. It helps to decide which code to
+// exclude from tracing, or which records to compress.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "giriutil"
+
+#include "Utility/ProfileSrcLines.h"
+#include "Utility/SourceLineMapping.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace dg;
+using namespace std;
+
+//===----------------------------------------------------------------------===//
+//                            Pass Statistics
+//===----------------------------------------------------------------------===//
+STATISTIC(NumCounters, "Number of counters in the execution profile");
+STATISTIC(NumUnknownIDs, "Number of counters whose id is not in the module");
+STATISTIC(NumProfiledLines, "Number of source lines with records");
+
+//===----------------------------------------------------------------------===//
+//                        Command Line Arguments.
+//===----------------------------------------------------------------------===//
+static cl::opt<string>
+ProfileFilename("profile-file",
+                cl::desc("Execution profile filename"),
+                cl::init("trace.profile"));
+
+static cl::opt<string>
+ProfileOutput("profile-output",
+              cl::desc("The output filename of the profile report"),
+              cl::init("-"));
+
+static cl::opt<unsigned>
+ProfileTop("profile-top",
+           cl::desc("Number of functions and source lines to report "
+                    "(0 for all)"),
+           cl::init(0));
+
+//===----------------------------------------------------------------------===//
+//                        ProfileSrcLines Pass Implementations
+//===----------------------------------------------------------------------===//
+
+char ProfileSrcLines::ID = 0;
+
+static RegisterPass<dg::ProfileSrcLines>
+X("profile-srclines", "Rank source lines by the records of a trace");
+
+uint64_t ProfileSrcLines::readProfile(const string &profile_file,
+                                      vector<ProfileCounter> &counters) {
+  int fd = open(profile_file.c_str(), O_RDONLY);
+  if (fd == -1)
+    report_fatal_error("Error opening profile file: " + profile_file + "!\n");
+
+  ProfileHeader header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, GIRI_PROFILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != GIRI_PROFILE_VERSION)
+    report_fatal_error("Not an execution profile: " + profile_file + "!\n");
+
+  counters.resize(header.count);
+  size_t size = header.count * sizeof(ProfileCounter);
+  if (read(fd, counters.data(), size) != static_cast<ssize_t>(size))
+    report_fatal_error("Truncated execution profile: " + profile_file + "!\n");
+  close(fd);
+
+  NumCounters = header.count;
+  return header.records;
+}
+
+string ProfileSrcLines::locateBlock(BasicBlock *BB) {
+  for (BasicBlock::iterator it = BB->begin(); it != BB->end(); ++it) {
+    string srcLineInfo = SourceLineMappingPass::locateSrcInfo(it);
+    if (!srcLineInfo.empty() && srcLineInfo != "NIL")
+      return srcLineInfo;
+  }
+  return "NIL";
+}
+
+void
+ProfileSrcLines::attributeCounters(const vector<ProfileCounter> &counters) {
+  for (auto C = counters.begin(); C != counters.end(); ++C) {
+    Function *F;
+    string srcLineInfo;
+    if (C->type == static_cast<uint32_t>(RecordType::BBType)) {
+      BasicBlock *BB = bbNumPass->getBlock(C->id);
+      if (!BB) {
+        ++NumUnknownIDs;
+        continue;
+      }
+      F = BB->getParent();
+      srcLineInfo = locateBlock(BB);
+    } else {
+      Instruction *I = lsNumPass->getInstByID(C->id);
+      if (!I) {
+        ++NumUnknownIDs;
+        continue;
+      }
+      F = I->getParent()->getParent();
+      srcLineInfo = SourceLineMappingPass::locateSrcInfo(I);
+      if (srcLineInfo.empty())
+        srcLineInfo = "NIL";
+    }
+
+    Records &function = FunctionRecords[F->getName().str()];
+    Records &line = LineRecords[srcLineInfo];
+    switch (static_cast<RecordType>(C->type)) {
+    case RecordType::BBType:
+      function.blocks += C->count;
+      line.blocks += C->count;
+      break;
+    case RecordType::LDType:
+      function.loads += C->count;
+      line.loads += C->count;
+      break;
+    default:
+      function.stores += C->count;
+      line.stores += C->count;
+      break;
+    }
+  }
+
+  NumProfiledLines = LineRecords.size();
+}
+
+/// Order the entries by decreasing number of records, and then by name.
+static bool moreRecords(const pair<string, ProfileSrcLines::Records> &a,
+                        const pair<string, ProfileSrcLines::Records> &b) {
+  if (a.second.total() != b.second.total())
+    return a.second.total() > b.second.total();
+  return a.first < b.first;
+}
+
+void ProfileSrcLines::printRanking(raw_ostream &Output,
+                                   const string &title,
+                                   const map<string, Records> &records,
+                                   uint64_t numRecords) {
+  vector<pair<string, Records> > ranking(records.begin(), records.end());
+  std::sort(ranking.begin(), ranking.end(), moreRecords);
+  if (ProfileTop && ranking.size() > ProfileTop)
+    ranking.resize(ProfileTop);
+
+  Output << "========================================================\n";
+  Output << "Records per " << title << "\n";
+  Output << "========================================================\n";
+  Output << "     Records      %       Blocks        Loads       Stores  "
+         << title << "\n";
+  for (auto R = ranking.begin(); R != ranking.end(); ++R) {
+    const Records &r = R->second;
+    double percent = numRecords ? 100.0 * r.total() / numRecords : 0.0;
+    Output << format("%12llu %6.2f %12llu %12llu %12llu  ",
+                     (unsigned long long)r.total(), percent,
+                     (unsigned long long)r.blocks,
+                     (unsigned long long)r.loads,
+                     (unsigned long long)r.stores)
+           << R->first << "\n";
+  }
+}
+
+bool ProfileSrcLines::runOnModule(Module &M) {
+  // Get references to other passes used by this pass.
+  bbNumPass = &getAnalysis<QueryBasicBlockNumbers>();
+  lsNumPass = &getAnalysis<QueryLoadStoreNumbers>();
+
+  vector<ProfileCounter> counters;
+  uint64_t numRecords = readProfile(ProfileFilename, counters);
+  attributeCounters(counters);
+
+  string errinfo;
+  raw_fd_ostream Output(ProfileOutput.c_str(), errinfo);
+  Output << "Records in the trace: " << numRecords << "\n";
+  printRanking(Output, "function", FunctionRecords, numRecords);
+  printRanking(Output, "source line", LineRecords, numRecords);
+
+  // This is an analysis pass, so always return false.
+  return false;
+}
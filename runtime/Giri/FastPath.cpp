@@ -0,0 +1,79 @@
+//===- FastPath.cpp - Inlinable fast path of the tracing run-time ---------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the record functions whose only job is to append one
+// record to the trace. It is not part of librtgiri: it is compiled into the
+// bitcode module libgirifast.bc, which is linked into the instrumented module
+// before code generation. The functions are always_inline, so running the
+// -always-inline pass afterwards replaces the calls inserted by the tracing
+// pass with a bump pointer append into the append window of the run-time.
+//
+// recordLock() and recordUnlock() are inlined as well, so that an append of
+// the fast path takes the mutex of the entry cache directly, or no lock at all
+// with per-thread buffers.
+//
+// Records which do not fit into the window, records of threads which have no
+// index yet, and all the records of the modes which keep the window empty take
+// the slow path into the run-time. The definitions of these functions in the
+// run-time are weak, so the ones of this file take over when it is linked in.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Giri/Runtime.h"
+
+#define GIRI_INLINE __attribute__((always_inline))
+
+/// Append one record, filling in the index of the calling thread.
+static inline GIRI_INLINE void append(Entry entry) {
+  Entry *next = giri_append_window.next;
+  unsigned tid = giri_thread_index;
+  if (__builtin_expect(next == giri_append_window.end ||
+                       tid == GIRI_NO_THREAD_INDEX, 0)) {
+    giri_append_slow(&entry);
+    return;
+  }
+  entry.tid = tid;
+  *next = entry;
+  giri_append_window.next = next + 1;
+}
+
+extern "C" GIRI_INLINE
+void recordLoad(unsigned id, unsigned char *p, uintptr_t length) {
+  append(Entry(RecordType::LDType, id, 0, p, length));
+}
+
+extern "C" GIRI_INLINE
+void recordStore(unsigned id, unsigned char *p, uintptr_t length) {
+  append(Entry(RecordType::STType, id, 0, p, length));
+}
+
+extern "C" GIRI_INLINE
+void recordSelect(unsigned id, unsigned char flag) {
+  append(Entry(RecordType::PDType,
+               id,
+               0,
+               reinterpret_cast<unsigned char *>(flag)));
+}
+
+extern "C" GIRI_INLINE
+void recordLock(const char *inst_name) {
+  pthread_mutex_t *mutex = giri_append_lock.mutex;
+  if (!mutex)
+    return;
+  if (__builtin_expect(giri_append_lock.timed, 0))
+    giri_lock_timed();
+  else
+    pthread_mutex_lock(mutex);
+}
+
+extern "C" GIRI_INLINE
+void recordUnlock(const char *inst_name) {
+  if (pthread_mutex_t *mutex = giri_append_lock.mutex)
+    pthread_mutex_unlock(mutex);
+}
@@ -14,11 +14,15 @@
 //===----------------------------------------------------------------------===//
 
 #include "Giri/Runtime.h"
+#include "Giri/TraceCompression.h"
+#include "Giri/TraceEncoding.h"
+#include "Giri/TraceSummary.h"
 
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -27,10 +31,19 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <stack>
-#include <unordered_map>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef DEBUG_GIRI_RUNTIME
 #define DEBUG(...) fprintf(stderr, __VA_ARGS__)
@@ -44,20 +57,48 @@
 //                           Forward declearation
 //===----------------------------------------------------------------------===//
 extern "C" void recordInit(const char *name);
-extern "C" void recordLock(const char *inst_name);
-extern "C" void recordUnlock(const char *inst_name);
 extern "C" void recordStartBB(unsigned id, unsigned char *fp);
 extern "C" void recordBB(unsigned id, unsigned char *fp, unsigned lastBB);
-extern "C" void recordLoad(unsigned id, unsigned char *p, uintptr_t);
 extern "C" void recordStrLoad(unsigned id, char *p);
-extern "C" void recordStore(unsigned id, unsigned char *p, uintptr_t);
 extern "C" void recordStrStore(unsigned id, char *p);
 extern "C" void recordStrcatStore(unsigned id, char *p, char *s);
 extern "C" void recordCall(unsigned id, unsigned char *p);
 extern "C" void recordExtCall(unsigned id, unsigned char *p);
 extern "C" void recordReturn(unsigned id, unsigned char *p);
 extern "C" void recordExtCallRet(unsigned callID, unsigned char *fp);
-extern "C" void recordSelect(unsigned id, unsigned char flag);
+extern "C" void recordSync(unsigned id, unsigned kind, unsigned char *object);
+extern "C" void recordBatch(const BatchRecord *records,
+                            unsigned char **slots,
+                            unsigned count);
+extern "C" void recordBlockBatch(unsigned id, unsigned char *fp,
+                                 unsigned lastBB,
+                                 const BatchRecord *records,
+                                 unsigned char **slots,
+                                 unsigned count);
+extern "C" void recordStrided(unsigned id, unsigned char *base, int32_t stride,
+                              uint64_t count, unsigned size);
+extern "C" void recordFunctionEntry(unsigned id, unsigned char *fp);
+extern "C" void recordBranch(uint64_t outcome, unsigned bits);
+extern "C" unsigned long giri_flush_stalls(void);
+extern "C" void giri_trace_enable(void);
+extern "C" void giri_trace_disable(void);
+static inline void addEntry(const Entry &entry);
+struct ThreadStacks;
+static void flushBranches(ThreadStacks *stacks);
+
+// The record functions defined by the fast path (see FastPath.cpp) are weak,
+// so that the definitions of the fast path take over when it is linked into
+// the traced program.
+#define GIRI_FAST_PATH __attribute__((weak))
+extern "C" void recordLoad(unsigned id, unsigned char *p, uintptr_t)
+  GIRI_FAST_PATH;
+extern "C" void recordStore(unsigned id, unsigned char *p, uintptr_t)
+  GIRI_FAST_PATH;
+extern "C" void recordSelect(unsigned id, unsigned char flag) GIRI_FAST_PATH;
+extern "C" void recordLock(const char *inst_name) GIRI_FAST_PATH;
+extern "C" void recordUnlock(const char *inst_name) GIRI_FAST_PATH;
+
+static inline ThreadIndex getThreadIndex();
 
 //===----------------------------------------------------------------------===//
 //                       Basic Block and Function Stack
@@ -74,7 +115,6 @@ struct BBRecord {
   BBRecord(unsigned id, unsigned char *address) :
     id(id), address(address) {}
 };
-static std::unordered_map<pthread_t, std::stack<BBRecord>> BBStack;
 
 // A stack containing basic blocks currently being executed
 struct FunRecord {
@@ -84,12 +124,1111 @@ struct FunRecord {
   FunRecord(unsigned id, unsigned char *fnAddress) :
     id(id), fnAddress(fnAddress) {}
 };
-static std::unordered_map<pthread_t, std::stack<FunRecord>> FNStack;
+
+/// Number of records for which every shadow stack is preallocated
+static const size_t ShadowStackDepth = 256;
+
+/// \class A stack backed by a vector with preallocated storage, so that
+/// pushing a record does not allocate unless the stack grows deeper than it
+/// ever was.
+template <typename T>
+class ShadowStack : public std::stack<T, std::vector<T>> {
+public:
+  ShadowStack() { this->c.reserve(ShadowStackDepth); }
+
+  /// Return the records on the stack, from the bottom to the top.
+  const std::vector<T> &records() const { return this->c; }
+};
+
+/// \class The shadow stacks of one thread.
+struct ThreadStacks {
+  explicit ThreadStacks(ThreadIndex tid) : tid(tid), tracedBlocks(0),
+                                            branchCount(0) {
+    branchBits[0] = branchBits[1] = 0;
+  }
+
+  ThreadIndex tid; ///< The thread owning the stacks
+  ShadowStack<BBRecord> BBStack; ///< Basic blocks being executed
+  ShadowStack<FunRecord> FNStack; ///< Functions being executed
+  /// Number of basic blocks on BBStack which belong to a traced function. It
+  /// is only maintained if GIRI_TRACE_FUNCTIONS is set.
+  unsigned tracedBlocks;
+  /// The pending outcome bits of the branches executed by the thread, which
+  /// are not written yet (see recordBranch())
+  uint64_t branchBits[2];
+  unsigned branchCount; ///< Number of pending outcome bits
+};
+
+/// The stacks of the live threads, and of the threads which exited with
+/// basic blocks still on their stacks. These are reached by finish() to
+/// terminate the active basic blocks.
+static std::vector<ThreadStacks *> StacksRegistry;
+/// The mutex protecting StacksRegistry
+static pthread_mutex_t StacksRegistryMutex = PTHREAD_MUTEX_INITIALIZER;
+/// The key whose destructor releases the stacks of an exiting thread
+static pthread_key_t StacksKey;
+static pthread_once_t StacksKeyOnce = PTHREAD_ONCE_INIT;
+/// The stacks of the calling thread
+static thread_local ThreadStacks *MyStacks = nullptr;
+
+/// Free the stacks of a thread which is exiting, unless basic blocks are still
+/// active on them.
+static void releaseThreadStacks(void *stacks) {
+  ThreadStacks *TS = static_cast<ThreadStacks *>(stacks);
+  if (TS->branchCount) {
+    recordLock("thread exit");
+    flushBranches(TS);
+    recordUnlock("thread exit");
+  }
+  MyStacks = nullptr;
+  if (!TS->BBStack.empty())
+    return;
+  pthread_mutex_lock(&StacksRegistryMutex);
+  for (auto I = StacksRegistry.begin(); I != StacksRegistry.end(); ++I)
+    if (*I == TS) {
+      StacksRegistry.erase(I);
+      break;
+    }
+  pthread_mutex_unlock(&StacksRegistryMutex);
+  delete TS;
+}
+
+static void createStacksKey() {
+  pthread_key_create(&StacksKey, releaseThreadStacks);
+}
+
+/// Create and register the stacks of the calling thread.
+static ThreadStacks *newThreadStacks() {
+  pthread_once(&StacksKeyOnce, createStacksKey);
+  MyStacks = new ThreadStacks(getThreadIndex());
+  pthread_setspecific(StacksKey, MyStacks);
+  pthread_mutex_lock(&StacksRegistryMutex);
+  StacksRegistry.push_back(MyStacks);
+  pthread_mutex_unlock(&StacksRegistryMutex);
+  return MyStacks;
+}
+
+/// Get the shadow stacks of the calling thread, creating them on first use.
+static inline ThreadStacks *getThreadStacks() {
+  if (!MyStacks)
+    return newThreadStacks();
+  return MyStacks;
+}
+
+/// Get the basic block stack of the calling thread.
+static inline ShadowStack<BBRecord> &getBBStack() {
+  return getThreadStacks()->BBStack;
+}
+
+/// Get the function call stack of the calling thread.
+static inline ShadowStack<FunRecord> &getFNStack() {
+  return getThreadStacks()->FNStack;
+}
+
+//===----------------------------------------------------------------------===//
+//                        Run-time Options
+//===----------------------------------------------------------------------===//
+//
+// The run-time is configured through the following environment variables,
+// which are read once by recordInit():
+//
+//  GIRI_PER_THREAD_BUFFERS    - If non-zero, every thread appends to its own
+//                               buffer and no global lock is taken.
+//  GIRI_THREAD_BUFFER_ENTRIES - Number of records in each per-thread buffer.
+//  GIRI_PER_THREAD_FILES      - If non-zero, every thread writes its buffer to
+//                               a trace file of its own, <trace>.<index>.
+//                               Implies GIRI_PER_THREAD_BUFFERS.
+//  GIRI_ASYNC_FLUSH           - If non-zero, the entry cache is written by a
+//                               background thread from rotating segments.
+//  GIRI_SEGMENT_SIZE          - Size in bytes of the entry cache window or
+//                               buffer, or of each rotating segment.
+//  GIRI_FLUSH_SEGMENTS        - Number of rotating segments (at least 2).
+//  GIRI_TRACE_WRITER          - "mmap" (the default) to write the entry cache
+//                               through a mapped window of the trace file, or
+//                               "pwrite" to write it from an anonymous buffer.
+//                               The asynchronous writer always uses pwrite().
+//  GIRI_PREALLOCATE_SIZE      - The smallest number of bytes of the trace file
+//                               reserved at once with fallocate() when the
+//                               entry cache is written with pwrite().
+//  GIRI_TRACE_FORMAT          - 1 for fixed-size records (the default), or 2
+//                               for the compact variable-length records. The
+//                               compact format implies GIRI_ASYNC_FLUSH unless
+//                               per-thread buffers are used.
+//  GIRI_COMPRESS              - If non-zero, every segment is compressed. Like
+//                               the compact format, it implies a segmented
+//                               trace and GIRI_ASYNC_FLUSH.
+//  GIRI_COALESCE              - If non-zero, a load or store record which
+//                               continues the previous record of its thread
+//                               is merged into it. The inlined fast path is
+//                               not used.
+//  GIRI_STREAMING_STORES      - If non-zero, records are written to the entry
+//                               cache and the per-thread buffers with
+//                               non-temporal stores, which leave the caches
+//                               to the traced program. The inlined fast path
+//                               is not used.
+//  GIRI_FLIGHT_RECORDER       - If non-zero, only this many of the most recent
+//                               records are kept in memory, and written to the
+//                               trace file at exit.
+//  GIRI_START_DISABLED        - If non-zero, nothing is traced until the
+//                               program calls giri_trace_enable().
+//  GIRI_TRACE_TYPES           - The letters of the record types to trace
+//                               (e.g., "BCR", or "Y" for synchronization).
+//                               Thread and end records are always written.
+//  GIRI_TRACE_THREADS         - Comma-separated indices of the threads to
+//                               trace.
+//  GIRI_TRACE_FUNCTIONS       - Comma-separated names (or 0x addresses) of the
+//                               functions to trace, including the functions
+//                               they call. Names are looked up with dlsym(),
+//                               so the program must export its symbols.
+//  GIRI_TRACE_BUDGET          - The size in bytes which the trace should not
+//                               exceed. As the trace grows towards it, records
+//                               are coalesced, then select records are
+//                               dropped, then loads and stores, and finally
+//                               everything, each step marked by a gap record.
+//                               Thread, gap and end records are always
+//                               written. The entry cache and the per-thread
+//                               buffers are capped to 5% of the budget.
+//  GIRI_BUDGET_FUNCTIONS      - Comma-separated names (or 0x addresses) of the
+//                               functions whose loads and stores are dropped
+//                               near the budget (all functions if unset).
+//  GIRI_TELEMETRY             - If non-zero, the run-time measures its own
+//                               costs and writes them to the JSON report
+//                               <trace>.telemetry.json at exit.
+//  GIRI_PROFILE               - If non-zero, the records of every basic block,
+//                               load and store are counted, and the counts are
+//                               written to <trace>.profile at exit.
+//
+
+/// Return true if the environment variable is set to a non-zero value.
+static bool getEnvFlag(const char *name) {
+  const char *value = getenv(name);
+  return value && *value && strcmp(value, "0") != 0;
+}
+
+/// Return the numeric value of the environment variable, or the default
+/// value if it is not set or malformed.
+static unsigned long getEnvULong(const char *name, unsigned long value) {
+  const char *str = getenv(name);
+  if (!str || !*str)
+    return value;
+  char *end;
+  unsigned long result = strtoul(str, &end, 0);
+  if (*end != '\0' || result == 0) {
+    ERROR("[GIRI] Ignoring malformed value of %s: %s\n", name, str);
+    return value;
+  }
+  return result;
+}
+
+//===----------------------------------------------------------------------===//
+//                        Trace Control and Filters
+//===----------------------------------------------------------------------===//
+//
+// The record functions test the single flag TraceFiltered before adding a
+// record, and only consult the filters when it is set. The shadow stacks are
+// maintained whether a record is traced or not, so a slice computed within an
+// enabled window sees the same stacks as with full tracing. When tracing is
+// enabled again, call records for the functions active on each thread are
+// added first, as the flight recorder does at the start of its window.
+//
+
+/// Set while tracing is disabled by giri_trace_disable()
+static std::atomic<bool> TraceDisabled(false);
+
+/// Set if tracing is disabled or any filter is configured
+static std::atomic<bool> TraceFiltered(false);
+
+/// Incremented whenever tracing is enabled again
+static std::atomic<unsigned> TraceEpoch(0);
+
+/// Bit mask of the traced record types, indexed by their type code
+static unsigned TracedTypes = ~0u;
+
+/// The traced threads, by index. Every thread is traced if it is empty.
+static std::vector<bool> TracedThreads;
+
+/// The sorted addresses of the traced functions. Every function is traced if
+/// it is empty.
+static std::vector<uintptr_t> TracedFunctions;
+
+static inline unsigned typeBit(RecordType type) {
+  return 1u << encodeType(type);
+}
+
+/// Return true if the function is in the list of traced functions.
+static bool isTracedFunction(uintptr_t address) {
+  return std::binary_search(TracedFunctions.begin(), TracedFunctions.end(),
+                            address);
+}
+
+/// Return true if the record of the thread owning the stacks passes the
+/// filters.
+static bool passesFilters(const Entry &entry, const ThreadStacks *stacks) {
+  if (!(TracedTypes & typeBit(entry.type)))
+    return false;
+  if (!TracedThreads.empty() &&
+      (entry.tid >= TracedThreads.size() || !TracedThreads[entry.tid]))
+    return false;
+  if (!TracedFunctions.empty() && stacks->tracedBlocks == 0) {
+    // A call enters the function it calls, and the matching return leaves it.
+    return (entry.type == RecordType::CLType ||
+            entry.type == RecordType::RTType) &&
+           isTracedFunction(entry.address);
+  }
+  return true;
+}
+
+/// Read a comma-separated list of function names (or 0x addresses) into the
+/// sorted addresses of the functions. Names are looked up with dlsym().
+static void readFunctionList(const char *option, const char *functions,
+                             std::vector<uintptr_t> &addresses) {
+  std::string list(functions);
+  for (size_t start = 0; start < list.size();) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+    std::string name = list.substr(start, end - start);
+    start = end + 1;
+    if (name.empty())
+      continue;
+
+    void *address;
+    if (name.compare(0, 2, "0x") == 0)
+      address = reinterpret_cast<void *>(strtoull(name.c_str(), NULL, 16));
+    else
+      address = dlsym(RTLD_DEFAULT, name.c_str());
+    if (!address) {
+      ERROR("[GIRI] Cannot find the function %s of %s (was the program "
+            "linked with -rdynamic?)\n", name.c_str(), option);
+      continue;
+    }
+    addresses.push_back(reinterpret_cast<uintptr_t>(address));
+  }
+  std::sort(addresses.begin(), addresses.end());
+}
+
+/// Read the filters from the environment.
+static void initTraceFilters() {
+  if (const char *types = getenv("GIRI_TRACE_TYPES")) {
+    TracedTypes = 0;
+    for (const char *p = types; *p; ++p) {
+      RecordType type = static_cast<RecordType>(*p);
+      switch (type) {
+      case RecordType::BBType: case RecordType::LDType:
+      case RecordType::STType: case RecordType::CLType:
+      case RecordType::RTType: case RecordType::PDType:
+      case RecordType::SYType: case RecordType::AFType:
+      case RecordType::FNType: case RecordType::BRType:
+        TracedTypes |= typeBit(type);
+        break;
+      default:
+        ERROR("[GIRI] Ignoring unknown record type '%c' in GIRI_TRACE_TYPES\n",
+              *p);
+        break;
+      }
+    }
+  }
+
+  if (const char *threads = getenv("GIRI_TRACE_THREADS")) {
+    TracedThreads.resize(UINT16_MAX + 1);
+    for (const char *p = threads; *p;) {
+      char *end;
+      unsigned long index = strtoul(p, &end, 0);
+      if (end == p || index > UINT16_MAX || (*end && *end != ',')) {
+        ERROR("[GIRI] Ignoring malformed value of GIRI_TRACE_THREADS: %s\n",
+              threads);
+        TracedThreads.clear();
+        break;
+      }
+      TracedThreads[index] = true;
+      p = *end ? end + 1 : end;
+    }
+  }
+
+  if (const char *functions = getenv("GIRI_TRACE_FUNCTIONS")) {
+    readFunctionList("GIRI_TRACE_FUNCTIONS", functions, TracedFunctions);
+    // If none of the functions was found, trace none rather than all of them.
+    if (TracedFunctions.empty())
+      TracedFunctions.push_back(0);
+  }
+
+  TraceDisabled = getEnvFlag("GIRI_START_DISABLED");
+  TraceFiltered = TraceDisabled || TracedTypes != ~0u ||
+                  !TracedThreads.empty() || !TracedFunctions.empty();
+}
+
+//===----------------------------------------------------------------------===//
+//                        Record Coalescing
+//===----------------------------------------------------------------------===//
+//
+// Loops which walk over arrays, and the string functions, produce runs of
+// load or store records of one instruction which access consecutive memory.
+// With GIRI_COALESCE set, a load or store record which directly follows the
+// previous record of its thread is merged into it if it was written by the
+// same instruction, accesses the same number of bytes, and starts where the
+// previous record ends. The merged record covers all the accesses and counts
+// them in Entry::repeat. Since only the last record of a thread is extended,
+// no other record of the thread, such as a basic block record, can fall
+// between the merged accesses, and they all belong to one execution of the
+// basic block.
+//
+
+/// If set, load and store records are merged into the previous record of
+/// their thread when they continue it. The trace budget sets it while the
+/// program runs.
+static std::atomic<bool> CoalesceRecords(false);
+
+/// Merge the entry into the last record of its thread if it continues it.
+/// \return true if the entry was merged.
+static inline bool coalesce(Entry &last, const Entry &entry) {
+  if (entry.type != last.type || entry.id != last.id ||
+      entry.tid != last.tid || !isDataAddress(entry.type) ||
+      last.repeat == UINT8_MAX || entry.length == 0)
+    return false;
+  if (entry.length * (last.repeat + 1) != last.length ||
+      entry.address != last.address + last.length)
+    return false;
+  last.length += entry.length;
+  ++last.repeat;
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+//                        Trace Budget
+//===----------------------------------------------------------------------===//
+//
+// With GIRI_TRACE_BUDGET set, the trace degrades as its size approaches the
+// budget rather than filling the disk. At 60% of the budget, load and store
+// records are coalesced; at 75%, select records are no longer written; at
+// 90%, the loads and stores of the functions of GIRI_BUDGET_FUNCTIONS (or of
+// every function) are no longer written; and at the budget, nothing but the
+// end of the trace is. Every step adds a gap record whose id is the new
+// level, so the reader knows from where on the trace is incomplete. The size
+// of the trace is only known when the records are written to the file, so
+// the steps are taken at the granularity of a flush, and the entry cache and
+// the per-thread buffers are made small enough for every step to be taken
+// before the trace grows past the next one.
+//
+
+/// The size of the trace in bytes at which nothing more is traced, or 0
+static uint64_t TraceBudget = 0;
+
+/// Number of bytes written to the trace file so far
+static std::atomic<uint64_t> TraceBytes(0);
+
+/// The size of the trace at which the next step is taken
+static std::atomic<uint64_t> NextBudgetStep(UINT64_MAX);
+
+/// The current step, a TraceGap or 0
+static std::atomic<unsigned> BudgetLevel(0);
+
+/// The sorted addresses of the functions whose loads and stores are dropped
+/// at TG_NoAccesses. The loads and stores of every function are dropped if it
+/// is empty.
+static std::vector<uintptr_t> BudgetFunctions;
+
+/// The percentage of the budget at which each step is taken
+static const unsigned BudgetSteps[] = { 60, 75, 90, 100 };
+
+/// The largest part of the budget, in percent, written by one flush. It is
+/// below the spacing of the steps.
+static const unsigned BudgetFlushPercent = 5;
+
+/// Return the size of a flush of the given number of bytes, capped to
+/// BudgetFlushPercent of the budget but not below minimum.
+static uint64_t capToBudget(uint64_t bytes, uint64_t minimum) {
+  if (!TraceBudget)
+    return bytes;
+  uint64_t cap = TraceBudget / 100 * BudgetFlushPercent;
+  return std::max(minimum, std::min(bytes, cap));
+}
+
+/// Return the size of the trace at which the step to the level is taken.
+static uint64_t budgetStep(unsigned level) {
+  if (level > TG_Stopped)
+    return UINT64_MAX;
+  return TraceBudget / 100 * BudgetSteps[level - 1];
+}
+
+/// Take the steps up to the size of the trace, and add a gap record for
+/// each of them.
+static void raiseBudgetLevel(uint64_t used) {
+  unsigned level = BudgetLevel.load();
+  while (level < TG_Stopped && used >= budgetStep(level + 1)) {
+    // Another thread may take the same step; only one of them records it.
+    if (!BudgetLevel.compare_exchange_strong(level, level + 1))
+      continue;
+    ++level;
+    CoalesceRecords = true;
+    addEntry(Entry(RecordType::GPType, level, getThreadIndex(), nullptr,
+                   used));
+    ERROR("[GIRI] The trace reached %llu bytes of its budget of %llu bytes "
+          "(gap level %u)\n", (unsigned long long)used,
+          (unsigned long long)TraceBudget, level);
+  }
+  NextBudgetStep = budgetStep(level + 1);
+}
+
+/// Return true if the record of the thread owning the stacks is still
+/// written within the budget.
+static bool passesBudget(const Entry &entry, const ThreadStacks *stacks) {
+  if (!TraceBudget)
+    return true;
+  uint64_t used = TraceBytes.load(std::memory_order_relaxed);
+  if (__builtin_expect(used >= NextBudgetStep.load(std::memory_order_relaxed),
+                       false))
+    raiseBudgetLevel(used);
+
+  unsigned level = BudgetLevel.load(std::memory_order_relaxed);
+  if (level < TG_NoSelects)
+    return true;
+  if (level >= TG_Stopped)
+    return false;
+  if (entry.type == RecordType::PDType)
+    return false;
+  if (level < TG_NoAccesses || !isMemoryAccess(entry.type))
+    return true;
+  if (BudgetFunctions.empty())
+    return false;
+  const std::vector<FunRecord> &FNS = stacks->FNStack.records();
+  uintptr_t function =
+    FNS.empty() ? 0 : reinterpret_cast<uintptr_t>(FNS.back().fnAddress);
+  return !std::binary_search(BudgetFunctions.begin(), BudgetFunctions.end(),
+                             function);
+}
+
+/// Read the budget from the environment.
+static void initTraceBudget() {
+  TraceBudget = getEnvULong("GIRI_TRACE_BUDGET", 0);
+  if (!TraceBudget)
+    return;
+  if (const char *functions = getenv("GIRI_BUDGET_FUNCTIONS"))
+    readFunctionList("GIRI_BUDGET_FUNCTIONS", functions, BudgetFunctions);
+  NextBudgetStep = budgetStep(TG_Coalesced);
+  TraceFiltered = true;
+}
+
+//===----------------------------------------------------------------------===//
+//                        Branch Outcomes
+//===----------------------------------------------------------------------===//
+//
+// Programs instrumented with -trace-branches write no basic block records.
+// Every function records its entry, and every conditional branch, switch and
+// indirect branch appends the bits of its outcome to the pending bits of its
+// thread, which takes no lock. The bits are written as one branch outcomes
+// record when they fill it, and before any other record of the thread, so
+// that every record follows the branches which were executed before it.
+// Since the fast path cannot see the pending bits, the append window is kept
+// empty once the first function entry is recorded. Readers regenerate the
+// basic block records from the control flow graph, which needs the whole
+// control flow of every thread: the flight recorder, GIRI_TRACE_FUNCTIONS
+// and GIRI_START_DISABLED drop parts of it, and traces of forked children
+// start in the middle of their functions.
+//
+
+/// Set once the program recorded a function entry, i.e., was instrumented
+/// with -trace-branches
+static std::atomic<bool> BranchTrace(false);
+
+/// Return the pending outcome bits of the thread owning the stacks as a branch
+/// outcomes record.
+static Entry branchEntry(const ThreadStacks *stacks) {
+  Entry entry(RecordType::BRType, stacks->branchCount, stacks->tid,
+              reinterpret_cast<unsigned char *>(stacks->branchBits[0]),
+              stacks->branchBits[1]);
+  return entry;
+}
+
+/// Drop the pending outcome bits of the thread owning the stacks.
+static inline void clearBranches(ThreadStacks *stacks) {
+  stacks->branchBits[0] = stacks->branchBits[1] = 0;
+  stacks->branchCount = 0;
+}
+
+//===----------------------------------------------------------------------===//
+//                        Streaming Stores
+//===----------------------------------------------------------------------===//
+//
+// The trace buffers are written once and never read again by the program, yet
+// every record stored into them pulls a line of the buffer into the caches and
+// evicts a part of the working set of the traced program. With
+// GIRI_STREAMING_STORES set, the entry cache and the per-thread buffers gather
+// their records in a staging line, and write them to the buffer a group at a
+// time with non-temporal stores, which bypass the caches. A group fills whole
+// cache lines of the buffer. The last group stays in the stage until the next
+// record arrives, so that the last record can still be coalesced. The
+// non-temporal stores are weakly ordered, so the stage is drained and fenced
+// before the buffer is written to the file or handed to the writer thread.
+//
+
+/// If set, records are written to the trace buffers with non-temporal stores.
+static bool StreamingStores = false;
+
+/// Number of records written to the buffer at once. Eight records are three
+/// cache lines.
+static const unsigned StreamRecords = 8;
+static_assert(StreamRecords * sizeof(Entry) % 64 == 0,
+              "A group of records must fill whole cache lines");
+
+/// Alignment of the buffers to which records are streamed
+static const size_t StreamAlignment = 64;
+
+/// Write one group of records to the buffer, bypassing the caches.
+static inline void streamGroup(Entry *dst, const Entry *src) {
+#ifdef __SSE2__
+  __m128i *d = reinterpret_cast<__m128i *>(dst);
+  const __m128i *s = reinterpret_cast<const __m128i *>(src);
+  for (unsigned i = 0; i < StreamRecords * sizeof(Entry) / sizeof(*d); ++i)
+    _mm_stream_si128(d + i, _mm_loadu_si128(s + i));
+#else
+  memcpy(dst, src, StreamRecords * sizeof(Entry));
+#endif
+}
+
+/// \class The staging line of a trace buffer, which holds the records of the
+/// current group until the group is complete.
+class StreamStage {
+public:
+  StreamStage() : staged(0) {}
+
+  /// Return the last record added to the buffer.
+  Entry &last() { return records[staged - 1]; }
+
+  /// Add the record which belongs at the given slot of the buffer. The
+  /// previous group is streamed to the buffer once it is complete.
+  void add(Entry *slot, const Entry &entry) {
+    if (staged == StreamRecords) {
+      streamGroup(slot - StreamRecords, records);
+      staged = 0;
+    }
+    records[staged++] = entry;
+  }
+
+  /// Store the staged records in front of next, the end of the records of
+  /// the buffer, and wait until the streamed ones are visible. This is
+  /// async-signal-safe.
+  void drain(Entry *next) {
+    memcpy(next - staged, records, staged * sizeof(Entry));
+    staged = 0;
+#ifdef __SSE2__
+    _mm_sfence();
+#endif
+  }
+
+  /// Forget the staged records.
+  void clear() { staged = 0; }
+
+private:
+  Entry records[StreamRecords]; ///< The records of the current group
+  unsigned staged; ///< Number of records in the stage
+};
+
+//===----------------------------------------------------------------------===//
+//                        Telemetry
+//===----------------------------------------------------------------------===//
+//
+// With GIRI_TELEMETRY set, the run-time measures what tracing costs and writes
+// a JSON report next to the trace file at exit. The record functions are not
+// touched: the records are counted by thread and type when they are written
+// to the trace file. recordLock() first tries to take the lock, and only
+// measures the time it waits if the lock is contended. Flushes of the trace
+// buffers are timed, and the latencies are kept in histograms with one bucket
+// per power of two nanoseconds.
+//
+// No report is written if the program is terminated by a signal.
+//
+
+/// If set, the run-time measures itself and writes a report at exit
+static bool Telemetry = false;
+
+/// The name of the telemetry report
+static std::string TelemetryPath;
+
+/// The time at which the run-time was initialized
+static uint64_t TelemetryStart = 0;
+
+/// Return the time of the monotonic clock in nanoseconds.
+static inline uint64_t nowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return uint64_t(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+/// \class A histogram of latencies. Bucket i counts the latencies of at least
+/// 2^i and less than 2^(i+1) nanoseconds; bucket 0 also counts zero.
+struct LatencyHistogram {
+  static const unsigned NumBuckets = 40;
+
+  LatencyHistogram() : count(0), totalNs(0), maxNs(0) {
+    memset(buckets, 0, sizeof(buckets));
+  }
+
+  void add(uint64_t ns) {
+    unsigned bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    ++buckets[std::min(bucket, NumBuckets - 1)];
+    ++count;
+    totalNs += ns;
+    maxNs = std::max(maxNs, ns);
+  }
+
+  void merge(const LatencyHistogram &other) {
+    for (unsigned i = 0; i < NumBuckets; ++i)
+      buckets[i] += other.buckets[i];
+    count += other.count;
+    totalNs += other.totalNs;
+    maxNs = std::max(maxNs, other.maxNs);
+  }
+
+  uint64_t count; ///< Number of latencies
+  uint64_t totalNs; ///< Sum of the latencies
+  uint64_t maxNs; ///< Highest latency
+  uint64_t buckets[NumBuckets]; ///< Number of latencies in each bucket
+};
+
+/// \class The measurements of one thread. Only the thread itself updates
+/// them, so they need no lock.
+struct ThreadTelemetry {
+  ThreadTelemetry() : tid(GIRI_NO_THREAD_INDEX), lockAcquires(0),
+                      lockContended(0) {}
+
+  unsigned tid; ///< The index of the thread, once it has one
+  uint64_t lockAcquires; ///< Number of calls of recordLock()
+  uint64_t lockContended; ///< Number of calls which waited for the lock
+  LatencyHistogram lockWait; ///< Time spent waiting for the lock
+  LatencyHistogram bufferFlush; ///< Time spent flushing per-thread buffers
+};
+
+/// The measurements of all the threads, kept after the threads exit
+static std::vector<ThreadTelemetry *> TelemetryRegistry;
+/// The mutex protecting TelemetryRegistry and RecordCounts
+static pthread_mutex_t TelemetryMutex = PTHREAD_MUTEX_INITIALIZER;
+/// The measurements of the calling thread
+static thread_local ThreadTelemetry *MyTelemetry = nullptr;
+
+/// The number of records of each type, by encodeType()
+typedef std::array<uint64_t, GIRI_NUM_RECORD_TYPES> TypeCounts;
+
+/// The number of records written to the trace, by thread and encodeType()
+static std::vector<TypeCounts> RecordCounts;
+
+/// Latencies of writing the entry cache, or one of its segments, to the file
+static LatencyHistogram CacheFlushes;
+/// Time the producers waited for the writer thread of the entry cache
+static LatencyHistogram WriterStalls;
+/// Time spent writing the trace at exit
+static uint64_t ExitFlushNs = 0;
+
+/// Get the measurements of the calling thread, creating them on first use.
+static ThreadTelemetry *getThreadTelemetry() {
+  if (!MyTelemetry) {
+    MyTelemetry = new ThreadTelemetry();
+    pthread_mutex_lock(&TelemetryMutex);
+    TelemetryRegistry.push_back(MyTelemetry);
+    pthread_mutex_unlock(&TelemetryMutex);
+  }
+  MyTelemetry->tid = giri_thread_index;
+  return MyTelemetry;
+}
+
+/// Count the records written to the trace by thread and type.
+static void countRecords(const Entry *entries, unsigned long count) {
+  if (!Telemetry || count == 0)
+    return;
+  pthread_mutex_lock(&TelemetryMutex);
+  for (unsigned long i = 0; i < count; ++i) {
+    if (entries[i].tid >= RecordCounts.size())
+      RecordCounts.resize(entries[i].tid + 1, TypeCounts());
+    ++RecordCounts[entries[i].tid][encodeType(entries[i].type)];
+  }
+  pthread_mutex_unlock(&TelemetryMutex);
+}
+
+/// Take the mutex, counting the acquisition and timing the wait if the mutex
+/// is contended.
+static void lockWithTelemetry(pthread_mutex_t *mutex) {
+  ThreadTelemetry *T = getThreadTelemetry();
+  ++T->lockAcquires;
+  if (pthread_mutex_trylock(mutex) == 0)
+    return;
+  ++T->lockContended;
+  uint64_t start = nowNs();
+  pthread_mutex_lock(mutex);
+  T->lockWait.add(nowNs() - start);
+}
+
+/// Print the histogram as a JSON object, leaving out the empty buckets at the
+/// end.
+static void printHistogram(FILE *out, const LatencyHistogram &H) {
+  unsigned used = LatencyHistogram::NumBuckets;
+  while (used > 0 && H.buckets[used - 1] == 0)
+    --used;
+  fprintf(out, "{\"count\": %" PRIu64 ", \"total_ns\": %" PRIu64
+          ", \"max_ns\": %" PRIu64 ", \"buckets\": [",
+          H.count, H.totalNs, H.maxNs);
+  for (unsigned i = 0; i < used; ++i)
+    fprintf(out, "%s%" PRIu64, i ? ", " : "", H.buckets[i]);
+  fprintf(out, "]}");
+}
+
+/// Print the record counts as a JSON object with one member per type.
+static void printCounts(FILE *out, const TypeCounts &counts) {
+  fprintf(out, "{");
+  for (unsigned code = 0; code < GIRI_NUM_RECORD_TYPES; ++code) {
+    RecordType type;
+    decodeType(code, type);
+    fprintf(out, "%s\"%c\": %" PRIu64, code ? ", " : "",
+            static_cast<char>(type), counts[code]);
+  }
+  fprintf(out, "}");
+}
+
+/// Write the telemetry report. Called at exit, once the trace is written.
+/// \param mode - The way the trace was buffered
+/// \param format - The version of the trace format
+/// \param compressed - Whether the segments were compressed
+static void writeTelemetryReport(const char *mode,
+                                 unsigned format,
+                                 bool compressed) {
+  FILE *out = fopen(TelemetryPath.c_str(), "w");
+  if (!out) {
+    ERROR("[GIRI] Cannot write the telemetry report %s: %s\n",
+          TelemetryPath.c_str(), strerror(errno));
+    return;
+  }
+
+  pthread_mutex_lock(&TelemetryMutex);
+  TypeCounts total = TypeCounts();
+  for (auto I = RecordCounts.begin(); I != RecordCounts.end(); ++I)
+    for (unsigned code = 0; code < GIRI_NUM_RECORD_TYPES; ++code)
+      total[code] += (*I)[code];
+
+  // Merge the measurements of the threads by index. The measurements of
+  // threads which never got an index only took the lock.
+  unsigned numThreads = RecordCounts.size();
+  for (auto I = TelemetryRegistry.begin(); I != TelemetryRegistry.end(); ++I)
+    if ((*I)->tid != GIRI_NO_THREAD_INDEX)
+      numThreads = std::max(numThreads, (*I)->tid + 1);
+  std::vector<ThreadTelemetry> threads(numThreads + 1);
+  for (auto I = TelemetryRegistry.begin(); I != TelemetryRegistry.end(); ++I) {
+    unsigned index = std::min((*I)->tid, numThreads);
+    threads[index].lockAcquires += (*I)->lockAcquires;
+    threads[index].lockContended += (*I)->lockContended;
+    threads[index].lockWait.merge((*I)->lockWait);
+    threads[index].bufferFlush.merge((*I)->bufferFlush);
+  }
+
+  fprintf(out, "{\n  \"mode\": \"%s\",\n", mode);
+  fprintf(out, "  \"format\": %u,\n  \"compressed\": %s,\n", format,
+          compressed ? "true" : "false");
+  fprintf(out, "  \"wall_ns\": %" PRIu64 ",\n", nowNs() - TelemetryStart);
+  fprintf(out, "  \"exit_flush_ns\": %" PRIu64 ",\n", ExitFlushNs);
+  fprintf(out, "  \"records\": ");
+  printCounts(out, total);
+  fprintf(out, ",\n  \"cache_flushes\": ");
+  printHistogram(out, CacheFlushes);
+  fprintf(out, ",\n  \"writer_stalls\": ");
+  printHistogram(out, WriterStalls);
+  fprintf(out, ",\n  \"threads\": [");
+  for (unsigned index = 0; index <= numThreads; ++index) {
+    const ThreadTelemetry &T = threads[index];
+    bool hasRecords = index < RecordCounts.size();
+    if (index == numThreads && T.lockAcquires == 0)
+      break;
+    fprintf(out, "%s\n    {\"index\": ", index ? "," : "");
+    if (index == numThreads)
+      fprintf(out, "null");
+    else
+      fprintf(out, "%u", index);
+    fprintf(out, ", \"records\": ");
+    printCounts(out, hasRecords ? RecordCounts[index] : TypeCounts());
+    fprintf(out, ",\n     \"lock_acquires\": %" PRIu64
+            ", \"lock_contended\": %" PRIu64 ",\n     \"lock_wait\": ",
+            T.lockAcquires, T.lockContended);
+    printHistogram(out, T.lockWait);
+    fprintf(out, ",\n     \"buffer_flushes\": ");
+    printHistogram(out, T.bufferFlush);
+    fprintf(out, "}");
+  }
+  fprintf(out, "\n  ]\n}\n");
+  pthread_mutex_unlock(&TelemetryMutex);
+  fclose(out);
+}
+
+//===----------------------------------------------------------------------===//
+//                        Execution Profile
+//===----------------------------------------------------------------------===//
+//
+// With GIRI_PROFILE set, the run-time counts the records of every basic
+// block, load and store in dense arrays indexed by their ids, and writes the
+// non-zero counters to <trace>.profile at exit (see ProfileHeader). Like the
+// record counts of the telemetry, the counters are updated when the records
+// are written to the trace file, so the inlined fast path is not touched and
+// the profile describes the trace: records dropped by the filters or by the
+// flight recorder are not counted.
+//
+// No profile is written if the program is terminated by a signal.
+//
+
+/// If set, the run-time writes an execution profile at exit
+static bool Profile = false;
+
+/// The name of the execution profile
+static std::string ProfilePath;
+
+/// The record types which are counted by id
+static const RecordType ProfiledTypes[] = {
+  RecordType::BBType, RecordType::LDType, RecordType::STType
+};
+
+/// The counters of each of the ProfiledTypes, indexed by id
+static std::vector<uint64_t> ProfileCounters[3];
+/// Number of records written to the trace
+static uint64_t ProfileRecords = 0;
+/// The mutex protecting ProfileCounters and ProfileRecords
+static pthread_mutex_t ProfileMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// Count the records written to the trace by type and id.
+static void profileRecords(const Entry *entries, unsigned long count) {
+  if (!Profile || count == 0)
+    return;
+  pthread_mutex_lock(&ProfileMutex);
+  ProfileRecords += count;
+  for (unsigned long i = 0; i < count; ++i) {
+    std::vector<uint64_t> *counters;
+    switch (entries[i].type) {
+    case RecordType::BBType: counters = &ProfileCounters[0]; break;
+    case RecordType::LDType: counters = &ProfileCounters[1]; break;
+    case RecordType::STType: counters = &ProfileCounters[2]; break;
+    default: continue;
+    }
+    if (entries[i].id >= counters->size())
+      counters->resize(entries[i].id + 1, 0);
+    ++(*counters)[entries[i].id];
+  }
+  pthread_mutex_unlock(&ProfileMutex);
+}
+
+/// Account for records written to the trace in the telemetry and the
+/// execution profile.
+static inline void recordsWritten(const Entry *entries, unsigned long count) {
+  countRecords(entries, count);
+  profileRecords(entries, count);
+}
+
+/// Write the execution profile. Called at exit, once the trace is written.
+static void writeProfile() {
+  std::vector<ProfileCounter> counters;
+  pthread_mutex_lock(&ProfileMutex);
+  for (unsigned i = 0; i < 3; ++i)
+    for (unsigned id = 0; id < ProfileCounters[i].size(); ++id)
+      if (ProfileCounters[i][id]) {
+        ProfileCounter counter;
+        counter.type = static_cast<uint32_t>(ProfiledTypes[i]);
+        counter.id = id;
+        counter.count = ProfileCounters[i][id];
+        counters.push_back(counter);
+      }
+  ProfileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, GIRI_PROFILE_MAGIC, sizeof(header.magic));
+  header.version = GIRI_PROFILE_VERSION;
+  header.count = counters.size();
+  header.records = ProfileRecords;
+  pthread_mutex_unlock(&ProfileMutex);
+
+  FILE *out = fopen(ProfilePath.c_str(), "wb");
+  if (!out) {
+    ERROR("[GIRI] Cannot write the execution profile %s: %s\n",
+          ProfilePath.c_str(), strerror(errno));
+    return;
+  }
+  if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+      fwrite(counters.data(), sizeof(ProfileCounter), counters.size(), out) !=
+          counters.size())
+    ERROR("[GIRI] Error while writing the execution profile %s: %s\n",
+          ProfilePath.c_str(), strerror(errno));
+  fclose(out);
+}
 
 //===----------------------------------------------------------------------===//
 //                        Trace Entry Cache
 //===----------------------------------------------------------------------===//
 
+/// If set, the records are written in the compact format (version 2)
+static bool CompactTrace = false;
+
+/// If set, the payload of every segment is compressed
+static bool CompressTrace = false;
+
+/// Number of records encoded at once by the writer thread. In compressed
+/// traces, this is also the largest number of records of one segment.
+static const unsigned EncodeChunkEntries = 4096;
+
+/// The largest payload of a segment of a compressed trace
+static const size_t ChunkPayloadBytes =
+  EncodeChunkEntries * GIRI_MAX_ENCODED_RECORD;
+
+/// Size of the scratch buffers used to write segments: the payload of a
+/// chunk, followed by its compressed form.
+static const size_t ScratchBytes =
+  ChunkPayloadBytes + sizeof(uint64_t) + GIRI_COMPRESS_BOUND(ChunkPayloadBytes);
+
+/// Compress the payload of a segment into the buffer, after its size.
+/// \return the size of the compressed payload.
+static size_t compressPayload(const void *payload,
+                              size_t size,
+                              unsigned char *buffer) {
+  uint64_t rawSize = size;
+  memcpy(buffer, &rawSize, sizeof(rawSize));
+  return sizeof(rawSize) + compressBlock(payload, size,
+                                         buffer + sizeof(rawSize));
+}
+
+/// Set once the program was terminated by a signal
+static std::atomic<bool> Crashed(false);
+
+/// The scratch buffer of the crash path for the records written in compact
+/// or compressed format (see Crash Handling below)
+static unsigned char CrashEncoded[ScratchBytes];
+
+/// Write the whole buffer to the file at the given offset. On the crash path,
+/// an error is reported without stdio and the rest of the trace is still
+/// written, since abort() would only raise another signal.
+static void writeAt(int fd, const void *buf, size_t len, uint64_t offset) {
+  const char *p = static_cast<const char *>(buf);
+  TraceBytes += len;
+  while (len > 0) {
+    ssize_t written = pwrite(fd, p, len, offset);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      if (Crashed) {
+        const char msg[] = "[GIRI] Error writing trace segment\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        return;
+      }
+      ERROR("[GIRI] Error writing trace segment: %s\n", strerror(errno));
+      abort();
+    }
+    p += written;
+    len -= written;
+    offset += written;
+  }
+}
+
+/// Write the header of a segmented trace file.
+/// \return the offset of the first segment.
+static uint64_t writeTraceHeader(int fd, uint32_t flags) {
+  TraceHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, GIRI_TRACE_MAGIC, sizeof(header.magic));
+  header.version = CompactTrace ? GIRI_TRACE_VERSION_COMPACT
+                                : GIRI_TRACE_VERSION;
+  header.flags = flags | TF_Summaries |
+                 (CompressTrace ? uint32_t(TF_Compressed) : 0u);
+  header.entrySize = sizeof(Entry);
+  header.headerSize = sizeof(header);
+  writeAt(fd, &header, sizeof(header), 0);
+  return sizeof(header);
+}
+
+/// Write the records as one unsequenced segment at the given offset of the
+/// trace file, or as one segment per chunk of records if the trace is
+/// compressed. In the compact format, the records are encoded in chunks using
+/// the scratch buffer, which holds ScratchBytes bytes. Every segment ends
+/// with the summary of its records.
+/// \return the offset following the segment.
+static uint64_t writeTraceSegment(int fd,
+                                  uint64_t offset,
+                                  const Entry *entries,
+                                  unsigned count,
+                                  uint64_t firstSeq,
+                                  unsigned char *scratch) {
+  if (count == 0)
+    return offset;
+
+  SegmentHeader header;
+  header.magic = GIRI_SEGMENT_MAGIC;
+  header.thread = 0;
+  SegmentSummary summary;
+
+  if (CompressTrace) {
+    // Every chunk is compressed on its own, so that readers can decompress
+    // one segment at a time.
+    unsigned char *compressed = scratch + ChunkPayloadBytes;
+    for (unsigned i = 0; i < count; i += EncodeChunkEntries) {
+      unsigned chunk = std::min(count - i, EncodeChunkEntries);
+      const void *payload = entries + i;
+      size_t size = chunk * sizeof(Entry);
+      if (CompactTrace) {
+        RecordEncoder encoder;
+        encoder.reset(0, firstSeq + i, false);
+        unsigned char *p = scratch;
+        for (unsigned j = i; j < i + chunk; ++j)
+          p = encoder.encode(p, entries[j], 0);
+        payload = scratch;
+        size = p - scratch;
+      }
+      size = compressPayload(payload, size, compressed);
+      summarize(summary, entries + i, nullptr, chunk, firstSeq + i);
+      header.count = chunk;
+      header.firstSeq = firstSeq + i;
+      header.size = size + sizeof(summary);
+      writeAt(fd, &header, sizeof(header), offset);
+      writeAt(fd, compressed, size, offset + sizeof(header));
+      writeAt(fd, &summary, sizeof(summary), offset + sizeof(header) + size);
+      offset += sizeof(header) + header.size;
+    }
+    return offset;
+  }
+
+  header.count = count;
+  header.firstSeq = firstSeq;
+  uint64_t start = offset + sizeof(header);
+  uint64_t end = start;
+  if (CompactTrace) {
+    // Write the header once the size of the encoded records is known.
+    RecordEncoder encoder;
+    encoder.reset(0, firstSeq, false);
+    for (unsigned i = 0; i < count;) {
+      unsigned last = std::min(count, i + EncodeChunkEntries);
+      unsigned char *p = scratch;
+      for (; i < last; ++i)
+        p = encoder.encode(p, entries[i], 0);
+      writeAt(fd, scratch, p - scratch, end);
+      end += p - scratch;
+    }
+  } else {
+    writeAt(fd, entries, count * sizeof(Entry), start);
+    end += count * sizeof(Entry);
+  }
+  summarize(summary, entries, nullptr, count, firstSeq);
+  writeAt(fd, &summary, sizeof(summary), end);
+  end += sizeof(summary);
+  header.size = end - start;
+  writeAt(fd, &header, sizeof(header), offset);
+  return end;
+}
+
+/// \class The cache of the entries of the trace file.
+///
+/// The synchronous cache is written by one of two backends. By default the
+/// cache is a window of the trace file mapped into memory, which is
+/// synchronously written back and remapped when it fills up. With the pwrite
+/// backend, the cache is an anonymous buffer instead, which is written to the
+/// file with pwrite() and reused, so its pages are faulted in only once and
+/// no msync() is needed. In asynchronous mode, the cache rotates through
+/// several anonymous segments: a full segment is handed to a background
+/// writer thread, and the producer continues in the next free segment at
+/// once. It only waits on the writer (a stall) if every segment is still
+/// waiting to be written.
+///
+/// Whenever the cache is written with pwrite(), the file space is reserved
+/// ahead with fallocate() in steps of at least GIRI_PREALLOCATE_SIZE bytes,
+/// so that the file is not grown one write at a time.
+///
+/// In the compact format, the writer thread also encodes the records, so the
+/// trace file is a segmented trace with one segment per rotating segment.
 class EntryCache {
 public:
   /// Open the file descriptor and mmap the EntryCacheBytes bytes to the cache
@@ -98,24 +1237,122 @@ public:
   /// Add one entry to the cache
   void addToEntryCache(const Entry &entry);
 
-  /// Close the cache file
+  /// Flush the cached entries and close the cache file
   void closeCacheFile();
 
+  /// Write the cached entries followed by the given records from a signal
+  /// handler. This only uses async-signal-safe operations.
+  void crashFlush(const Entry *extra, unsigned count);
+
+  /// Continue in the child of fork() with a trace file of its own. The
+  /// records which the parent has still to write are dropped, and a new
+  /// writer thread is started if the cache is written asynchronously.
+  void forkChild(int FD);
+
+  /// Close the append window while the records are filtered, coalesced or
+  /// streamed, so that the fast path hands every record to the run-time, and
+  /// open it otherwise.
+  void updateWindow() {
+    if (TraceFiltered || CoalesceRecords || StreamingStores || BranchTrace)
+      giri_append_window.end = giri_append_window.next;
+    else
+      giri_append_window.end = cache + EntryCacheSize;
+  }
+
+  /// Get the number of times a producer waited for the writer thread
+  unsigned long getStalls();
+
+  /// Return true if the cache is written by the writer thread.
+  bool isAsync() const { return async; }
+
+  /// Return true if the cache is a mapped window of the trace file.
+  bool isMapped() const { return backend == MmapBackend; }
+
 private:
   /// Map the trace file to cache
   void mapCache(void);
 
+  /// Write the full cache to the trace file and start over with an empty one
+  void flushCache(void);
+
+  /// Preallocate the file space up to the given offset
+  void reserve(uint64_t end);
+
+  /// Hand the full segment to the writer and continue in the next one
+  void rotateSegment(void);
+
+  /// The main loop of the background writer thread
+  static void *writerMain(void *cache);
+
+  /// Write the first len bytes of the nth segment to the trace file.
+  void writeSegment(unsigned long n, size_t len);
+
 private:
-  /// The current index into the entry cache. This points to the next element
-  /// in which to write the next entry (cache holds a part of the trace file).
-  unsigned index;
+  /// Get the number of entries in the cache. The position of the next entry
+  /// is kept in giri_append_window, so that the fast path can append to the
+  /// cache (cache holds a part of the trace file).
+  unsigned used() const { return giri_append_window.next - cache; }
+
+  /// Return the last record of the cache.
+  Entry &last() {
+    return StreamingStores ? stage.last() : giri_append_window.next[-1];
+  }
+
+  /// Store the records of the staging line in the cache.
+  void drainStage() {
+    if (StreamingStores)
+      stage.drain(giri_append_window.next);
+  }
+
+  /// Make the whole cache the append window.
+  void resetWindow() {
+    giri_append_window.next = cache;
+    updateWindow();
+  }
+
   Entry *cache; ///< A cache of entries that need to be written to disk
+  StreamStage stage; ///< The staging line of the streaming stores
   off_t fileOffset; ///< The offset of the file which is cached into memory.
   int fd; ///< File which is being cached in memory.
 
   unsigned long EntryCacheBytes; ///< Size of the entry cache in bytes
   unsigned long EntryCacheSize; ///< Size of the entry cache
   static const float LOAD_FACTOR; ///< load factor of the system memory
+
+  //===-------------------- Writer backends -----------------------------===//
+  /// The ways in which the synchronous cache is written to the trace file
+  enum Backend {
+    MmapBackend,  ///< The cache is a mapped window of the file
+    PwriteBackend ///< The cache is an anonymous buffer written by pwrite()
+  };
+  Backend backend; ///< The backend of the cache
+  unsigned long preallocateBytes; ///< Smallest step of reserve()
+  uint64_t reserved; ///< The end of the file space reserved so far
+
+  //===-------------------- Asynchronous flushing -----------------------===//
+  bool async; ///< Whether segments are written by the writer thread
+  /// Whether the trace is segmented, with segments appended by the writer
+  bool segmented;
+  unsigned numSegments; ///< Number of rotating segments
+  Entry **segments; ///< The rotating segments
+  /// Number of segments handed to the writer.  Segment n is stored in
+  /// segments[n % numSegments] and written at offset n * EntryCacheBytes, or
+  /// appended at fileOffset in the compact format.
+  std::atomic<unsigned long> submitted;
+  /// Number of segments written by the writer
+  std::atomic<unsigned long> written;
+  /// The offset at which segment n is appended in the compact format, stored
+  /// in segmentStarts[n % numSegments] before written reaches n, so that the
+  /// crash path can append the segments left by the writer.
+  std::atomic<uint64_t> *segmentStarts;
+  unsigned long lastBytes; ///< Size of the last segment when stopping
+  bool stopping; ///< Whether the writer should exit once it is done
+  unsigned long stalls; ///< Number of times the producer waited
+  pthread_t writer; ///< The background writer thread
+  pthread_mutex_t writerMutex; ///< Protects the segment counters
+  pthread_cond_t submittedCond; ///< Signaled when a segment is submitted
+  pthread_cond_t writtenCond; ///< Signaled when a segment is written
+  unsigned char *encoded; ///< Buffer of the writer for encoded records
 };
 
 const float EntryCache::LOAD_FACTOR = 0.1;
@@ -124,25 +1361,109 @@ void EntryCache::init(int FD) {
   long pages = sysconf(_SC_PHYS_PAGES);
   long page_size = sysconf(_SC_PAGE_SIZE);
 
-  // assert that the size of an entry evenly divides the cache entry
-  // buffer size. The run-time will not work if this is not true.
-  if (page_size % sizeof(Entry)) {
-    ERROR("[GIRI] Entry size %lu does not divide page size!\n", sizeof(Entry));
-    abort();
+  // The cache must hold whole entries, and it is mapped at page-aligned
+  // offsets of the file. Hence its size is a multiple of the least common
+  // multiple of the page size and the entry size.
+  unsigned long unit = page_size;
+  while (unit % sizeof(Entry))
+    unit += page_size;
+
+  // Variable-length or compressed records cannot be written into the mapped
+  // window, so segmented traces are always written by the writer thread. Use
+  // a smaller default size for the rotating segments, as several of them are
+  // kept in memory.
+  segmented = CompactTrace || CompressTrace;
+  async = getEnvFlag("GIRI_ASYNC_FLUSH") || segmented;
+
+  // The writer thread always writes anonymous segments with pwrite().
+  backend = MmapBackend;
+  if (const char *name = getenv("GIRI_TRACE_WRITER")) {
+    if (strcmp(name, "pwrite") == 0)
+      backend = PwriteBackend;
+    else if (strcmp(name, "mmap") != 0)
+      ERROR("[GIRI] Ignoring unknown trace writer %s\n", name);
+    else if (async)
+      ERROR("[GIRI] The asynchronous trace writer always uses pwrite()\n");
   }
+  if (async)
+    backend = PwriteBackend;
+  preallocateBytes = getEnvULong("GIRI_PREALLOCATE_SIZE", 64ul << 20);
+  reserved = 0;
 
-  EntryCacheBytes = static_cast<long>(pages * LOAD_FACTOR ) * page_size;
+  if (backend == PwriteBackend)
+    EntryCacheBytes = 64ul << 20;
+  else
+    EntryCacheBytes = static_cast<long>(pages * LOAD_FACTOR ) * page_size;
+  EntryCacheBytes = getEnvULong("GIRI_SEGMENT_SIZE", EntryCacheBytes);
+  EntryCacheBytes = capToBudget(EntryCacheBytes, unit);
+  EntryCacheBytes -= EntryCacheBytes % unit;
+  if (EntryCacheBytes == 0)
+    EntryCacheBytes = unit;
   EntryCacheSize = EntryCacheBytes / sizeof(Entry);
 
   // Save the file descriptor of the file that we'll use.
   fd = FD;
 
   // Initialize all of the other fields.
-  index = 0;
   fileOffset = 0;
   cache = 0;
+  stalls = 0;
+
+  if (!async && backend == MmapBackend) {
+    mapCache();
+    return;
+  }
+  if (!async) {
+    cache = (Entry *)mmap(0,
+                          EntryCacheBytes,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1,
+                          0);
+    if (cache == MAP_FAILED) {
+      ERROR("[GIRI] Error allocating entry cache: %s\n", strerror(errno));
+      abort();
+    }
+    resetWindow();
+    return;
+  }
 
-  mapCache();
+  // Allocate the segments and start the writer thread.
+  numSegments = getEnvULong("GIRI_FLUSH_SEGMENTS", 4);
+  if (numSegments < 2)
+    numSegments = 2;
+  segments = new Entry *[numSegments];
+  for (unsigned i = 0; i < numSegments; ++i) {
+    segments[i] = (Entry *)mmap(0,
+                                EntryCacheBytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS,
+                                -1,
+                                0);
+    if (segments[i] == MAP_FAILED) {
+      ERROR("[GIRI] Error allocating trace segment: %s\n", strerror(errno));
+      abort();
+    }
+  }
+  submitted = written = lastBytes = 0;
+  stopping = false;
+  cache = segments[0];
+  resetWindow();
+  encoded = 0;
+  segmentStarts = 0;
+  if (segmented) {
+    encoded = new unsigned char[ScratchBytes];
+    fileOffset = writeTraceHeader(fd, 0);
+    segmentStarts = new std::atomic<uint64_t>[numSegments];
+    segmentStarts[0] = fileOffset;
+  }
+  pthread_mutex_init(&writerMutex, NULL);
+  pthread_cond_init(&submittedCond, NULL);
+  pthread_cond_init(&writtenCond, NULL);
+  if (pthread_create(&writer, NULL, writerMain, this) != 0) {
+    ERROR("[GIRI] Error creating the trace writer thread\n");
+    abort();
+  }
 }
 
 void EntryCache::mapCache() {
@@ -175,60 +1496,804 @@ void EntryCache::mapCache() {
   }
 
   // Reset the entry cache.
-  index = 0;
+  resetWindow();
 }
 
-void EntryCache::addToEntryCache(const Entry &entry) {
-  // Flush the cache if necessary.
-  if (index == EntryCacheSize) {
-    DEBUG("[GIRI] Writing the cache to file and remapping...\n");
+void EntryCache::flushCache() {
+  recordsWritten(cache, EntryCacheSize);
+  uint64_t start = Telemetry ? nowNs() : 0;
+  if (backend == MmapBackend) {
     // Unmap the data. This should force it to be written to disk.
     msync(cache, EntryCacheBytes, MS_SYNC);
     munmap(cache, EntryCacheBytes);
+    TraceBytes += EntryCacheBytes;
     // Advance the file offset to the next portion of the file.
     fileOffset += EntryCacheBytes;
     // Remap the cache
     mapCache();
+  } else {
+    reserve(fileOffset + EntryCacheBytes);
+    writeAt(fd, cache, EntryCacheBytes, fileOffset);
+    fileOffset += EntryCacheBytes;
+    resetWindow();
+  }
+  if (Telemetry)
+    CacheFlushes.add(nowNs() - start);
+}
+
+void EntryCache::reserve(uint64_t end) {
+#ifdef __linux__
+  if (end <= reserved)
+    return;
+  uint64_t length = std::max<uint64_t>(end - reserved, preallocateBytes);
+  if (fallocate(fd, 0, reserved, length) == 0) {
+    reserved += length;
+  } else {
+    // The file system cannot preallocate; let pwrite() grow the file.
+    DEBUG("[GIRI] Cannot preallocate the trace file: %s\n", strerror(errno));
+    reserved = ~uint64_t(0);
+  }
+#endif
+}
+
+void EntryCache::rotateSegment() {
+  pthread_mutex_lock(&writerMutex);
+  ++submitted;
+  pthread_cond_signal(&submittedCond);
+  // Wait only if the writer still owns every segment.
+  if (submitted - written == numSegments) {
+    ++stalls;
+    DEBUG("[GIRI] All trace segments are full, waiting for the writer...\n");
+    uint64_t start = Telemetry ? nowNs() : 0;
+    while (submitted - written == numSegments)
+      pthread_cond_wait(&writtenCond, &writerMutex);
+    if (Telemetry)
+      WriterStalls.add(nowNs() - start);
+  }
+  pthread_mutex_unlock(&writerMutex);
+
+  cache = segments[submitted % numSegments];
+  resetWindow();
+}
+
+void *EntryCache::writerMain(void *arg) {
+  EntryCache *EC = static_cast<EntryCache *>(arg);
+  pthread_mutex_lock(&EC->writerMutex);
+  while (true) {
+    while (EC->written == EC->submitted && !EC->stopping)
+      pthread_cond_wait(&EC->submittedCond, &EC->writerMutex);
+    if (EC->written == EC->submitted)
+      break;
+
+    // Write the oldest submitted segment without holding the lock.  Only the
+    // last segment submitted when stopping may be partially filled.
+    unsigned long n = EC->written;
+    size_t len = EC->EntryCacheBytes;
+    if (EC->stopping && n + 1 == EC->submitted)
+      len = EC->lastBytes;
+    pthread_mutex_unlock(&EC->writerMutex);
+    EC->writeSegment(n, len);
+    if (EC->segmented)
+      EC->segmentStarts[(n + 1) % EC->numSegments] = EC->fileOffset;
+    pthread_mutex_lock(&EC->writerMutex);
+
+    ++EC->written;
+    pthread_cond_signal(&EC->writtenCond);
+  }
+  pthread_mutex_unlock(&EC->writerMutex);
+  return NULL;
+}
+
+void EntryCache::writeSegment(unsigned long n, size_t len) {
+  Entry *segment = segments[n % numSegments];
+  recordsWritten(segment, len / sizeof(Entry));
+  uint64_t start = Telemetry ? nowNs() : 0;
+  if (!segmented) {
+    reserve(n * EntryCacheBytes + len);
+    writeAt(fd, segment, len, n * EntryCacheBytes);
+  } else {
+    // The size of the segment is only known once it is written, but it is
+    // less than twice the size of the raw records.
+    reserve(fileOffset + 2 * GIRI_COMPRESS_BOUND(len));
+    fileOffset = writeTraceSegment(fd,
+                                   fileOffset,
+                                   segment,
+                                   len / sizeof(Entry),
+                                   n * EntryCacheSize,
+                                   encoded);
   }
+  if (Telemetry)
+    CacheFlushes.add(nowNs() - start);
+}
+
+void EntryCache::forkChild(int FD) {
+  fd = FD;
+  fileOffset = 0;
+  reserved = 0;
+  stage.clear();
+  if (!async) {
+    // The mapped window is shared with the parent. Unmapping it in the child
+    // writes nothing and leaves the mapping of the parent alone.
+    if (backend == MmapBackend) {
+      munmap(cache, EntryCacheBytes);
+      mapCache();
+    } else {
+      resetWindow();
+    }
+    return;
+  }
+
+  // The writer thread of the parent does not exist in the child, and its
+  // mutex and conditions may have been in use at the time of the fork.
+  submitted = written = lastBytes = 0;
+  stopping = false;
+  stalls = 0;
+  cache = segments[0];
+  resetWindow();
+  if (segmented) {
+    fileOffset = writeTraceHeader(fd, 0);
+    segmentStarts[0] = fileOffset;
+  }
+  pthread_mutex_init(&writerMutex, NULL);
+  pthread_cond_init(&submittedCond, NULL);
+  pthread_cond_init(&writtenCond, NULL);
+  if (pthread_create(&writer, NULL, writerMain, this) != 0) {
+    ERROR("[GIRI] Error creating the trace writer thread\n");
+    abort();
+  }
+}
+
+unsigned long EntryCache::getStalls() {
+  if (!async)
+    return 0;
+  pthread_mutex_lock(&writerMutex);
+  unsigned long result = stalls;
+  pthread_mutex_unlock(&writerMutex);
+  return result;
+}
+
+void EntryCache::addToEntryCache(const Entry &entry) {
+  // The records of all the threads are in order in the cache, so the last
+  // one is the last record of the thread if it has the same thread.
+  if (CoalesceRecords && used() && coalesce(last(), entry))
+    return;
 
-  // Add the entry to the entry cache and increment the index
-  cache[index++] = entry;
+  // Flush the cache if necessary.
+  if (used() == EntryCacheSize) {
+    drainStage();
+    if (async) {
+      rotateSegment();
+    } else {
+      DEBUG("[GIRI] Writing the cache to file...\n");
+      flushCache();
+    }
+  }
+
+  // Add the entry to the entry cache and advance the window
+  Entry *slot = giri_append_window.next++;
+  if (StreamingStores)
+    stage.add(slot, entry);
+  else
+    *slot = entry;
+  if (TraceFiltered || CoalesceRecords || StreamingStores)
+    giri_append_window.end = giri_append_window.next;
 
 #if 0
   // Initial experiments show that this increases overhead (user + system time).
   // Tell the OS to sync if we've finished writing another page.
-  if ((uintptr_t)&(entryCache.cache[entryCache.index]) & 0x1000) {
-    msync(&entryCache.cache[entryCache.index - 1], 1, MS_ASYNC);
+  if ((uintptr_t)giri_append_window.next & 0x1000) {
+    msync(giri_append_window.next - 1, 1, MS_ASYNC);
   }
 #endif
 }
 
-void EntryCache::closeCacheFile() {
-  // Create basic block termination entries for each basic block on the stack.
-  // These were the basic blocks that were active when the program terminated.
-  // **** Should we print the return records for active functions as well?????????
-  for (auto I = BBStack.begin(); I != BBStack.end(); ++I) {
-    while (!I->second.empty()) {
-      // Create a basic block entry for it.
-      unsigned bbid = I->second.top().id;
-      unsigned char *fp = I->second.top().address;
-      addToEntryCache(Entry(RecordType::BBType, bbid, I->first, fp));
-      I->second.pop();
-    }
+void EntryCache::crashFlush(const Entry *extra, unsigned count) {
+  drainStage();
+  unsigned index = used();
+  size_t len = sizeof(Entry) * index;
+  if (!async) {
+    // The records of a mapped window are already in the file.
+    if (backend == PwriteBackend)
+      writeAt(fd, cache, len, fileOffset);
+    uint64_t end = fileOffset + len;
+    writeAt(fd, extra, count * sizeof(Entry), end);
+    ftruncate(fd, end + count * sizeof(Entry));
+    return;
   }
 
-  // Create an end entry to terminate the log.
-  addToEntryCache(Entry(RecordType::ENType, 0));
+  // Give the writer thread up to a second to write the segments which were
+  // handed to it. The lock cannot be taken here, so poll its progress.
+  for (unsigned i = 0; i < 1000 && written != submitted; ++i) {
+    struct timespec delay = { 0, 1000000 };
+    nanosleep(&delay, NULL);
+  }
+
+  if (!segmented) {
+    // Segments have fixed offsets, so write the ones that are left even if
+    // the writer is stuck; it would write the very same bytes.
+    for (unsigned long n = written; n < submitted; ++n)
+      writeAt(fd, segments[n % numSegments], EntryCacheBytes,
+              n * EntryCacheBytes);
+    uint64_t end = submitted * EntryCacheBytes;
+    writeAt(fd, cache, len, end);
+    writeAt(fd, extra, count * sizeof(Entry), end + len);
+    ftruncate(fd, end + len + count * sizeof(Entry));
+    return;
+  }
+
+  // The writer appends the segments, so the segments which are left are
+  // appended after the last one it completed, even if it is stuck or it is
+  // the crashing thread. Encoding is deterministic, so a writer which is only
+  // slow writes the very same bytes. The start of segment n is only replaced
+  // once written passes n, hence reading written again detects a stale one.
+  unsigned long n, last = submitted;
+  uint64_t offset;
+  do {
+    n = written;
+    offset = segmentStarts[n % numSegments];
+  } while (n != written);
+  for (; n < last; ++n)
+    offset = writeTraceSegment(fd, offset, segments[n % numSegments],
+                               EntryCacheSize, n * EntryCacheSize,
+                               CrashEncoded);
+  uint64_t firstSeq = last * EntryCacheSize;
+  offset = writeTraceSegment(fd, offset, cache, index, firstSeq,
+                             CrashEncoded);
+  offset = writeTraceSegment(fd, offset, extra, count, firstSeq + index,
+                             CrashEncoded);
+  ftruncate(fd, offset);
+}
 
+void EntryCache::closeCacheFile() {
+  drainStage();
+  unsigned index = used();
   size_t len = sizeof(Entry) * index;
-  // Unmap the data. This should force it to be written to disk.
-  msync(cache, len, MS_SYNC);
-  munmap(cache, len);
+  if (async) {
+    // Hand the partially filled segment to the writer and wait for it to
+    // write all the outstanding segments.
+    pthread_mutex_lock(&writerMutex);
+    lastBytes = len;
+    ++submitted;
+    stopping = true;
+    pthread_cond_signal(&submittedCond);
+    pthread_mutex_unlock(&writerMutex);
+    pthread_join(writer, NULL);
+
+    if (stalls)
+      ERROR("[GIRI] Tracing stalled %lu times waiting for the trace writer\n",
+            stalls);
+    if (segmented)
+      ftruncate(fd, fileOffset);
+    else
+      ftruncate(fd, (submitted - 1) * EntryCacheBytes + len);
+    return;
+  }
+
+  recordsWritten(cache, index);
+  if (backend == MmapBackend) {
+    // Unmap the data. This should force it to be written to disk.
+    msync(cache, len, MS_SYNC);
+    munmap(cache, len);
+  } else {
+    writeAt(fd, cache, len, fileOffset);
+    munmap(cache, EntryCacheBytes);
+  }
 
   // Truncate the file to be the actual size for small traces
   ftruncate(fd, len + fileOffset);
 }
 
+//===----------------------------------------------------------------------===//
+//                        Per-thread Trace Buffers
+//===----------------------------------------------------------------------===//
+
+/// If set, each thread appends its records to a private buffer instead of the
+/// shared entry cache, and recordLock()/recordUnlock() do nothing.
+static bool PerThreadBuffers = false;
+
+/// Number of records held by each per-thread buffer
+static unsigned long ThreadBufferEntries = 64 * 1024;
+
+/// The global ticket which orders the records of all the threads
+static std::atomic<uint64_t> NextSeq(0);
+
+/// If set, every thread appends its segments to a trace file of its own
+/// (see TF_ThreadFiles) instead of the shared trace file.
+static bool PerThreadFiles = false;
+
+/// The name of the trace file
+static std::string TraceName;
+
+/// \class A segmented trace file to which the threads append segments.
+struct SegmentFile {
+  SegmentFile(int fd, uint64_t end) : fd(fd), end(end) {}
+
+  int fd; ///< The file descriptor
+  /// The offset in the file at which the next segment is written
+  std::atomic<uint64_t> end;
+};
+
+/// The trace file. With per-thread trace files, it only receives the records
+/// written by the crash handler.
+static SegmentFile *TraceSegments = nullptr;
+
+/// The per-thread trace files by thread index. They stay open until the
+/// program exits, since a thread may still record events after its buffer
+/// was released.
+static std::vector<SegmentFile *> ThreadFiles;
+
+/// Reserve the space for one segment of size bytes of records written by the
+/// specified thread at the end of the file, and write its header and the
+/// summary of its records. Space is reserved with an atomic add on the file
+/// offset, so threads never wait on each other to write their segments.
+/// \return the offset at which the records of the segment are written.
+static uint64_t appendSegment(SegmentFile &file,
+                              ThreadIndex tid,
+                              const Entry *entries,
+                              const uint64_t *seqs,
+                              unsigned count,
+                              uint64_t size) {
+  SegmentHeader header;
+  header.magic = GIRI_SEGMENT_MAGIC;
+  header.count = count;
+  header.thread = static_cast<uint64_t>(tid);
+  header.firstSeq = seqs[0];
+  header.size = size + sizeof(SegmentSummary);
+
+  SegmentSummary summary;
+  summarize(summary, entries, seqs, count, 0);
+
+  uint64_t offset = file.end.fetch_add(sizeof(header) + header.size);
+  writeAt(file.fd, &header, sizeof(header), offset);
+  writeAt(file.fd, &summary, sizeof(summary), offset + sizeof(header) + size);
+  return offset + sizeof(header);
+}
+
+/// \class The buffer into which one thread appends its records.
+class ThreadBuffer {
+public:
+  ThreadBuffer(unsigned long capacity, ThreadIndex tid, SegmentFile *file) :
+    count(0), capacity(capacity), tid(tid), file(file), encoded(0),
+    epoch(TraceEpoch), state(Idle), parked(false) {
+    // Streamed groups of records are written at aligned offsets.
+    void *memory;
+    if (posix_memalign(&memory, StreamAlignment, capacity * sizeof(Entry))) {
+      ERROR("[GIRI] Error allocating a thread buffer\n");
+      abort();
+    }
+    entries = static_cast<Entry *>(memory);
+    seqs = new uint64_t[capacity];
+    if (CompressTrace)
+      encoded = new unsigned char[ScratchBytes];
+    else if (CompactTrace)
+      encoded = new unsigned char[capacity * GIRI_MAX_ENCODED_RECORD];
+  }
+
+  ~ThreadBuffer() {
+    free(entries);
+    delete [] seqs;
+    delete [] encoded;
+  }
+
+  /// Append one entry, stamping it with the next global sequence number.
+  void add(const Entry &entry) {
+    enter(Idle, Adding);
+    append(entry);
+    enter(Adding, Idle);
+  }
+
+  /// Write the buffered records to the trace file as one segment. The crash
+  /// handler flushes without counting the records, since it cannot take the
+  /// locks of the telemetry and the profile.
+  void flush(bool crash = false);
+
+  /// Stop the owner from modifying the buffer. The crash handler waits up to
+  /// a second for an owner which is adding records to park.
+  /// \return true if the buffer can be flushed.
+  bool freeze();
+
+private:
+  /// The states of the buffer. The owner adds and flushes records only in
+  /// the Adding and Flushing states, and the crash handler flushes the buffer
+  /// once it is Frozen and the owner is not in the middle of a change.
+  enum State { Idle, Adding, Flushing, Frozen };
+
+  /// Move from one state to another, or park the owner if the buffer was
+  /// frozen meanwhile.
+  void enter(int from, int to) {
+    if (!state.compare_exchange_strong(from, to))
+      park();
+  }
+
+  /// Wait for the crash handler to terminate the program.
+  void park() {
+    parked = true;
+    while (true) {
+      struct timespec delay = { 1, 0 };
+      nanosleep(&delay, NULL);
+    }
+  }
+
+  /// Append one entry in the Adding state.
+  void append(const Entry &entry) {
+    if (epoch != TraceEpoch.load(std::memory_order_relaxed))
+      resync();
+    if (CoalesceRecords && count &&
+        coalesce(StreamingStores ? stage.last() : entries[count - 1], entry))
+      return;
+    if (count == capacity) {
+      uint64_t start = Telemetry ? nowNs() : 0;
+      enter(Adding, Flushing);
+      flush();
+      enter(Flushing, Adding);
+      if (Telemetry)
+        getThreadTelemetry()->bufferFlush.add(nowNs() - start);
+    }
+    seqs[count] = NextSeq.fetch_add(1, std::memory_order_relaxed);
+    if (StreamingStores)
+      stage.add(entries + count, entry);
+    else
+      entries[count] = entry;
+    ++count;
+  }
+
+  /// Add the call records of the active functions of the thread after
+  /// tracing was enabled again. Other threads cannot read the stacks of this
+  /// thread without a lock, so every thread does it for itself.
+  void resync();
+
+  Entry *entries; ///< The buffered records
+  StreamStage stage; ///< The staging line of the streaming stores
+  uint64_t *seqs; ///< The sequence number of each buffered record
+  unsigned long count; ///< Number of buffered records
+  unsigned long capacity; ///< Maximum number of buffered records
+  ThreadIndex tid; ///< The thread owning this buffer
+  SegmentFile *file; ///< The file to which the buffer is flushed
+  unsigned char *encoded; ///< Buffer for the records in the compact format
+  unsigned epoch; ///< The value of TraceEpoch when the buffer was synced
+  std::atomic<int> state; ///< The State of the buffer
+  std::atomic<bool> parked; ///< Whether the owner waits for the termination
+};
+
+/// All the per-thread buffers of the live threads
+static std::vector<ThreadBuffer *> ThreadBuffers;
+/// The mutex protecting ThreadBuffers
+static pthread_mutex_t ThreadBuffersMutex = PTHREAD_MUTEX_INITIALIZER;
+/// The key whose destructor flushes the buffer of an exiting thread
+static pthread_key_t ThreadBufferKey;
+/// The buffer of the calling thread
+static thread_local ThreadBuffer *MyThreadBuffer = nullptr;
+
+/// Append the sequenced records of a thread to the file as one segment, or as
+/// one segment per chunk of records if the trace is compressed. In the
+/// compact format, the records are encoded into the given buffer, which holds
+/// ScratchBytes bytes in compressed traces.
+static void writeThreadSegment(SegmentFile &file,
+                               ThreadIndex tid,
+                               const Entry *entries,
+                               const uint64_t *seqs,
+                               unsigned long count,
+                               unsigned char *encoded) {
+  if (count == 0)
+    return;
+
+  if (CompressTrace) {
+    unsigned char *compressed = encoded + ChunkPayloadBytes;
+    for (unsigned long i = 0; i < count; i += EncodeChunkEntries) {
+      unsigned chunk = std::min<unsigned long>(count - i, EncodeChunkEntries);
+      unsigned char *p = encoded;
+      if (CompactTrace) {
+        RecordEncoder encoder;
+        encoder.reset(static_cast<uint64_t>(tid), seqs[i], true);
+        for (unsigned long j = i; j < i + chunk; ++j)
+          p = encoder.encode(p, entries[j], seqs[j]);
+      } else {
+        memcpy(p, entries + i, chunk * sizeof(Entry));
+        p += chunk * sizeof(Entry);
+        memcpy(p, seqs + i, chunk * sizeof(uint64_t));
+        p += chunk * sizeof(uint64_t);
+      }
+      size_t size = compressPayload(encoded, p - encoded, compressed);
+      uint64_t offset = appendSegment(file, tid, entries + i, seqs + i,
+                                      chunk, size);
+      writeAt(file.fd, compressed, size, offset);
+    }
+    return;
+  }
+
+  if (CompactTrace) {
+    RecordEncoder encoder;
+    encoder.reset(static_cast<uint64_t>(tid), seqs[0], true);
+    unsigned char *p = encoded;
+    for (unsigned long i = 0; i < count; ++i)
+      p = encoder.encode(p, entries[i], seqs[i]);
+    uint64_t offset = appendSegment(file, tid, entries, seqs, count,
+                                    p - encoded);
+    writeAt(file.fd, encoded, p - encoded, offset);
+  } else {
+    uint64_t size = count * (sizeof(Entry) + sizeof(uint64_t));
+    uint64_t offset = appendSegment(file, tid, entries, seqs, count, size);
+    writeAt(file.fd, entries, count * sizeof(Entry), offset);
+    writeAt(file.fd, seqs, count * sizeof(uint64_t),
+            offset + count * sizeof(Entry));
+  }
+}
+
+void ThreadBuffer::flush(bool crash) {
+  if (StreamingStores)
+    stage.drain(entries + count);
+  if (!crash)
+    recordsWritten(entries, count);
+  writeThreadSegment(*file, tid, entries, seqs, count, encoded);
+  count = 0;
+}
+
+void ThreadBuffer::resync() {
+  epoch = TraceEpoch;
+  ThreadStacks *stacks = getThreadStacks();
+  const std::vector<FunRecord> &calls = stacks->FNStack.records();
+  for (auto C = calls.begin(); C != calls.end(); ++C) {
+    Entry call(RecordType::CLType, C->id, tid, C->fnAddress);
+    if (passesFilters(call, stacks))
+      append(call);
+  }
+}
+
+bool ThreadBuffer::freeze() {
+  int previous = state.exchange(Frozen);
+  if (previous == Idle)
+    return true;
+  // The crash interrupted the owner itself, which cannot park. Records are
+  // complete once they are counted, but a segment may be half written.
+  if (this == MyThreadBuffer)
+    return previous == Adding;
+  for (unsigned i = 0; i < 1000 && !parked; ++i) {
+    struct timespec delay = { 0, 1000000 };
+    nanosleep(&delay, NULL);
+  }
+  return parked;
+}
+
+/// Flush and free the buffer of a thread which is exiting.
+static void releaseThreadBuffer(void *buffer) {
+  ThreadBuffer *TB = static_cast<ThreadBuffer *>(buffer);
+  pthread_mutex_lock(&ThreadBuffersMutex);
+  TB->flush();
+  for (auto I = ThreadBuffers.begin(); I != ThreadBuffers.end(); ++I)
+    if (*I == TB) {
+      ThreadBuffers.erase(I);
+      break;
+    }
+  pthread_mutex_unlock(&ThreadBuffersMutex);
+  delete TB;
+  MyThreadBuffer = nullptr;
+}
+
+/// Return the name of the per-thread trace file of a thread.
+static std::string getThreadFileName(unsigned index) {
+  return TraceName + "." + std::to_string(index);
+}
+
+/// Get the file to which a thread appends its segments, creating the
+/// per-thread trace file of the thread on first use.
+static SegmentFile *getThreadFile(ThreadIndex tid) {
+  if (!PerThreadFiles)
+    return TraceSegments;
+
+  pthread_mutex_lock(&ThreadBuffersMutex);
+  if (tid >= ThreadFiles.size())
+    ThreadFiles.resize(tid + 1, nullptr);
+  if (!ThreadFiles[tid]) {
+    std::string name = getThreadFileName(tid);
+    int fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0640u);
+    if (fd == -1) {
+      ERROR("[GIRI] Cannot open the trace file %s: %s\n", name.c_str(),
+            strerror(errno));
+      abort();
+    }
+    ThreadFiles[tid] = new SegmentFile(fd, writeTraceHeader(fd, TF_PerThread));
+  }
+  SegmentFile *file = ThreadFiles[tid];
+  pthread_mutex_unlock(&ThreadBuffersMutex);
+  return file;
+}
+
+/// Get the buffer of the calling thread, creating it on first use.
+static ThreadBuffer *getThreadBuffer() {
+  // Getting the index of a new thread adds its thread record, which creates
+  // the buffer.
+  ThreadIndex tid = getThreadIndex();
+  if (!MyThreadBuffer) {
+    MyThreadBuffer = new ThreadBuffer(ThreadBufferEntries, tid,
+                                      getThreadFile(tid));
+    pthread_setspecific(ThreadBufferKey, MyThreadBuffer);
+    pthread_mutex_lock(&ThreadBuffersMutex);
+    ThreadBuffers.push_back(MyThreadBuffer);
+    pthread_mutex_unlock(&ThreadBuffersMutex);
+  }
+  return MyThreadBuffer;
+}
+
+/// Write the header of the trace file to which the segments are appended.
+static void openTraceSegments(int fd) {
+  uint32_t flags = TF_PerThread |
+                   (PerThreadFiles ? uint32_t(TF_ThreadFiles) : 0u);
+  TraceSegments = new SegmentFile(fd, writeTraceHeader(fd, flags));
+
+  // Readers look for the thread files by counting up from the first one, so
+  // remove the files left behind by an earlier run with more threads.
+  if (PerThreadFiles)
+    for (unsigned index = 0;; ++index)
+      if (unlink(getThreadFileName(index).c_str()) != 0)
+        break;
+}
+
+/// Write the header of the trace file and prepare the per-thread buffers.
+static void initThreadBuffers(int fd) {
+  uint64_t recordBytes = sizeof(Entry) + sizeof(uint64_t);
+  ThreadBufferEntries = capToBudget(ThreadBufferEntries * recordBytes,
+                                    recordBytes) / recordBytes;
+  openTraceSegments(fd);
+  pthread_key_create(&ThreadBufferKey, releaseThreadBuffer);
+}
+
+/// Flush the buffers of all the threads which are still alive.
+static void flushThreadBuffers() {
+  pthread_mutex_lock(&ThreadBuffersMutex);
+  for (auto I = ThreadBuffers.begin(); I != ThreadBuffers.end(); ++I)
+    (*I)->flush();
+  pthread_mutex_unlock(&ThreadBuffersMutex);
+}
+
+//===----------------------------------------------------------------------===//
+//                        Flight Recorder
+//===----------------------------------------------------------------------===//
+
+/// If non-zero, the number of the most recent records kept by the flight
+/// recorder instead of writing the whole execution to the trace file
+static unsigned long FlightRecorderEntries = 0;
+
+/// Number of chunks of the flight recorder ring
+static const unsigned FlightRecorderChunks = 8;
+
+/// \class The flight recorder keeps the most recent records in a ring in
+/// memory, and writes them to the trace file at exit.
+///
+/// The window written to the file begins at a chunk boundary of the ring.
+/// At the start of every chunk, the recorder takes a snapshot of the state
+/// that the records in the chunk depend on: the thread records of the known
+/// threads, and a call record for every function active on the thread stacks.
+/// The snapshot of the first chunk of the window is written in front of it as
+/// a synthetic prefix, so that calls and returns within the window match.
+/// Active basic blocks need no synthetic records, as a basic block record
+/// marks the end of the block.
+///
+/// All the methods are called with the entry cache mutex held.
+class FlightRecorder {
+public:
+  /// Allocate a ring of at least the given number of records.
+  void init(unsigned long entries);
+
+  /// Add one entry to the ring, overwriting the oldest one if it is full.
+  void add(const Entry &entry) {
+    if (CoalesceRecords && total &&
+        coalesce(ring[(pos ? pos : capacity) - 1], entry))
+      return;
+    if (chunkLeft == 0)
+      checkpoint();
+    --chunkLeft;
+    if (entry.type == RecordType::THType)
+      threads.push_back(entry);
+    ring[pos] = entry;
+    if (++pos == capacity)
+      pos = 0;
+    ++total;
+  }
+
+  /// Write the synthetic prefix and the records of the window to the file,
+  /// followed by the given records. This only uses async-signal-safe
+  /// operations, so it is also called from the crash handler.
+  void write(int fd, const Entry *extra = nullptr, unsigned count = 0);
+
+  /// Drop all the records of the ring, keeping its memory.
+  void reset() {
+    chunkLeft = 0;
+    pos = 0;
+    total = 0;
+    threads.clear();
+  }
+
+private:
+  /// Take the snapshot of the chunk starting with the next record.
+  void checkpoint();
+
+  Entry *ring; ///< The ring of records
+  unsigned long capacity; ///< Number of records in the ring
+  unsigned long chunkSize; ///< Number of records in one chunk
+  unsigned long chunkLeft; ///< Number of records left in the current chunk
+  unsigned long pos; ///< Position of the next record in the ring
+  uint64_t total; ///< Number of records added to the ring
+  std::vector<Entry> threads; ///< The thread records of all the threads
+  /// The synthetic prefix of each chunk of the ring
+  std::vector<Entry> prefixes[FlightRecorderChunks];
+  unsigned char *scratch; ///< Buffer for encoding the records
+};
+
+void FlightRecorder::init(unsigned long entries) {
+  chunkSize = (entries + FlightRecorderChunks - 1) / FlightRecorderChunks;
+  capacity = chunkSize * FlightRecorderChunks;
+  ring = (Entry *)mmap(0,
+                       capacity * sizeof(Entry),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+  if (ring == MAP_FAILED) {
+    ERROR("[GIRI] Error allocating the flight recorder: %s\n", strerror(errno));
+    abort();
+  }
+  chunkLeft = 0;
+  pos = 0;
+  total = 0;
+  scratch = 0;
+  if (CompactTrace || CompressTrace)
+    scratch = new unsigned char[ScratchBytes];
+}
+
+void FlightRecorder::checkpoint() {
+  std::vector<Entry> &prefix = prefixes[(total / chunkSize) %
+                                        FlightRecorderChunks];
+  prefix = threads;
+
+  pthread_mutex_lock(&StacksRegistryMutex);
+  for (auto I = StacksRegistry.begin(); I != StacksRegistry.end(); ++I) {
+    const std::vector<FunRecord> &calls = (*I)->FNStack.records();
+    for (auto C = calls.begin(); C != calls.end(); ++C)
+      prefix.push_back(Entry(RecordType::CLType, C->id, (*I)->tid,
+                             C->fnAddress));
+  }
+  pthread_mutex_unlock(&StacksRegistryMutex);
+  chunkLeft = chunkSize;
+}
+
+void FlightRecorder::write(int fd, const Entry *extra, unsigned extraCount) {
+  // Start the window at the oldest chunk which is still complete.
+  uint64_t first = 0;
+  if (total > capacity)
+    first = (total - capacity + chunkSize - 1) / chunkSize * chunkSize;
+  const std::vector<Entry> &prefix = prefixes[(first / chunkSize) %
+                                              FlightRecorderChunks];
+  DEBUG("[GIRI] Writing records %lu to %lu of the flight recorder\n",
+        (unsigned long)first, (unsigned long)total);
+
+  // The window is at most two contiguous runs of the ring.
+  uint64_t offset = writeTraceHeader(fd, TF_Window);
+  uint64_t seq = 0;
+  if (first != 0) {
+    offset = writeTraceSegment(fd, offset, prefix.data(), prefix.size(), seq,
+                               scratch);
+    seq += prefix.size();
+  }
+  unsigned long start = first % capacity;
+  unsigned long count = total - first;
+  unsigned long run = std::min(count, capacity - start);
+  offset = writeTraceSegment(fd, offset, ring + start, run, seq, scratch);
+  seq += run;
+  offset = writeTraceSegment(fd, offset, ring, count - run, seq, scratch);
+  seq += count - run;
+  offset = writeTraceSegment(fd, offset, extra, extraCount, seq, scratch);
+  ftruncate(fd, offset);
+
+  // The records are not counted in the crash handler, which passes the extra
+  // records and cannot take the locks of the telemetry and the profile.
+  if (!extra) {
+    if (first != 0)
+      recordsWritten(prefix.data(), prefix.size());
+    recordsWritten(ring + start, run);
+    recordsWritten(ring, count - run);
+  }
+}
+
 //===----------------------------------------------------------------------===//
 //                       Record and Helper Functions
 //===----------------------------------------------------------------------===//
@@ -236,23 +2301,408 @@ void EntryCache::closeCacheFile() {
 /// This is the very entry cache used by all record functions
 /// Call entryCache.init(fd) before usage
 static EntryCache entryCache;
+/// The flight recorder used instead of the entry cache if enabled
+static FlightRecorder flightRecorder;
+/// The free part of the entry cache, empty unless the entry cache is used
+AppendWindow giri_append_window = { nullptr, nullptr };
 /// the mutex of modifying the EntryCache
 static pthread_mutex_t EntryCacheMutex;
+/// The lock of the records, which the fast path takes without calling the
+/// run-time
+AppendLock giri_append_lock = { &EntryCacheMutex, false };
+
+/// Append one entry to the trace.
+static inline void addEntry(const Entry &entry) {
+  if (PerThreadBuffers)
+    getThreadBuffer()->add(entry);
+  else if (FlightRecorderEntries)
+    flightRecorder.add(entry);
+  else
+    entryCache.addToEntryCache(entry);
+}
+
+/// Add an entry, unless it is filtered out.
+static inline void filterEntry(const Entry &entry) {
+  if (__builtin_expect(TraceFiltered.load(std::memory_order_relaxed), false)) {
+    ThreadStacks *stacks = getThreadStacks();
+    if (TraceDisabled || !passesFilters(entry, stacks) ||
+        !passesBudget(entry, stacks))
+      return;
+  }
+  addEntry(entry);
+}
+
+/// Write the pending outcome bits of the thread owning the stacks, if any.
+static void flushBranches(ThreadStacks *stacks) {
+  if (!stacks || !stacks->branchCount)
+    return;
+  Entry entry = branchEntry(stacks);
+  clearBranches(stacks);
+  filterEntry(entry);
+}
+
+/// Add an entry of a record function, unless it is filtered out. The pending
+/// outcome bits of the thread precede it.
+static inline void traceEntry(const Entry &entry) {
+  if (__builtin_expect(BranchTrace.load(std::memory_order_relaxed), false))
+    flushBranches(MyStacks);
+  filterEntry(entry);
+}
+
+//===----------------------------------------------------------------------===//
+//                        Thread Indices
+//===----------------------------------------------------------------------===//
+
+/// The index of the next thread which records an event
+static std::atomic<unsigned> NextThreadIndex(0);
+
+/// The index of the calling thread. It is exported to the fast path, and is
+/// __thread rather than thread_local so that reading it needs no call.
+__thread unsigned giri_thread_index = GIRI_NO_THREAD_INDEX;
+
+/// Assign the next index to the calling thread and add its thread record.
+static ThreadIndex newThreadIndex() {
+  unsigned index = NextThreadIndex.fetch_add(1, std::memory_order_relaxed);
+  if (index > UINT16_MAX) {
+    ERROR("[GIRI] More than %u threads are not supported\n", UINT16_MAX + 1);
+    abort();
+  }
+  giri_thread_index = index;
+
+  Entry entry(RecordType::THType, index);
+  entry.tid = index;
+  entry.address = (uintptr_t)pthread_self();
+  addEntry(entry);
+  return index;
+}
+
+/// Get the dense index of the calling thread, assigning it on first use.
+static inline ThreadIndex getThreadIndex() {
+  if (giri_thread_index == GIRI_NO_THREAD_INDEX)
+    return newThreadIndex();
+  return giri_thread_index;
+}
 
 /// helper function which is registered at atexit()
 static void finish() {
+  // The crash handler has written the trace already.
+  if (Crashed)
+    return;
   DEBUG("[GIRI] Writing cache data to trace file and closing.\n");
-  // Make sure that we flush the entry cache on exit.
-  entryCache.closeCacheFile();
+
+  // Create basic block termination entries for each basic block on the stack.
+  // These were the basic blocks that were active when the program terminated.
+  // **** Should we print the return records for active functions as well?????????
+  // The entries are added once the registry is unlocked, as the flight
+  // recorder takes its own snapshots of the stacks.
+  std::vector<Entry> terminations;
+  pthread_mutex_lock(&StacksRegistryMutex);
+  for (auto I = StacksRegistry.begin(); I != StacksRegistry.end(); ++I) {
+    // The pending outcome bits of the thread precede the end of the trace.
+    if ((*I)->branchCount) {
+      terminations.push_back(branchEntry(*I));
+      clearBranches(*I);
+    }
+    ShadowStack<BBRecord> &BBS = (*I)->BBStack;
+    while (!BBS.empty()) {
+      // Create a basic block entry for it.
+      unsigned bbid = BBS.top().id;
+      unsigned char *fp = BBS.top().address;
+      terminations.push_back(Entry(RecordType::BBType, bbid, (*I)->tid, fp));
+      BBS.pop();
+    }
+  }
+  pthread_mutex_unlock(&StacksRegistryMutex);
+  for (auto I = terminations.begin(); I != terminations.end(); ++I)
+    addEntry(*I);
+
+  // Create an end entry to terminate the log.
+  addEntry(Entry(RecordType::ENType, 0));
+
+  // Make sure that we flush the trace on exit.
+  uint64_t start = Telemetry ? nowNs() : 0;
+  const char *mode;
+  if (PerThreadBuffers) {
+    flushThreadBuffers();
+    mode = PerThreadFiles ? "per-thread-files" : "per-thread";
+  } else if (FlightRecorderEntries) {
+    flightRecorder.write(record);
+    mode = "flight-recorder";
+  } else {
+    entryCache.closeCacheFile();
+    if (entryCache.isAsync())
+      mode = "async";
+    else
+      mode = entryCache.isMapped() ? "entry-cache" : "pwrite";
+  }
+  if (Telemetry) {
+    ExitFlushNs = nowNs() - start;
+    writeTelemetryReport(mode,
+                         CompactTrace ? GIRI_TRACE_VERSION_COMPACT
+                                      : GIRI_TRACE_VERSION,
+                         CompressTrace);
+  }
+  if (Profile)
+    writeProfile();
 
   // destroy the mutexes
   pthread_mutex_destroy(&EntryCacheMutex);
 }
 
-/// Signal handler to write only tracing data to file
-static void cleanup_only_tracing(int signum) {
-  ERROR("[GIRI] Abnormal termination, signal number %d\n", signum);
-  exit(signum);
+//===----------------------------------------------------------------------===//
+//                        Crash Handling
+//===----------------------------------------------------------------------===//
+//
+// When the program is terminated by a signal, the signal handler writes the
+// trace itself instead of calling exit(): the signal may have interrupted the
+// run-time or malloc() while they held a lock, so running finish() from there
+// deadlocks or corrupts the trace. The crash path takes no locks, allocates no
+// memory and writes with pwrite(). It reads the shadow stacks without
+// modifying them to terminate the active basic blocks, adds the END record,
+// and truncates the file to the end of the records, so readers need not
+// search for the end of the valid data.
+//
+
+/// Maximum number of records added by the crash path
+static const unsigned MaxCrashEntries = 4096;
+/// The records added by the crash path
+static Entry CrashEntries[MaxCrashEntries];
+/// The sequence numbers of the records added with per-thread buffers
+static uint64_t CrashSeqs[MaxCrashEntries];
+static_assert(MaxCrashEntries <= EncodeChunkEntries,
+              "The crash records must fit into one scratch buffer");
+/// The alternate stack of the signal handler, so that a stack overflow can be
+/// handled as well
+static char CrashStack[64 * 1024];
+/// Set once the trace has been written by the crash path
+static std::atomic<bool> CrashFlushed(false);
+/// The thread running the crash path, so that a signal raised by the crash
+/// path itself terminates the program instead of waiting for it
+static std::atomic<pthread_t> CrashThread;
+
+/// Write a message followed by a number to stderr without using stdio.
+static void writeCrashMessage(const char *message, int number) {
+  char buf[16];
+  unsigned pos = sizeof(buf);
+  buf[--pos] = '\n';
+  do {
+    buf[--pos] = '0' + number % 10;
+    number /= 10;
+  } while (number && pos > 0);
+  write(STDERR_FILENO, message, strlen(message));
+  write(STDERR_FILENO, buf + pos, sizeof(buf) - pos);
+}
+
+/// Fill CrashEntries with the pending outcome bits of the threads, the
+/// termination records of the active basic blocks and the END record.
+/// \return the number of records.
+static unsigned collectCrashEntries() {
+  unsigned count = 0;
+  for (auto I = StacksRegistry.begin(); I != StacksRegistry.end(); ++I) {
+    if ((*I)->branchCount && count < MaxCrashEntries - 1)
+      CrashEntries[count++] = branchEntry(*I);
+    const std::vector<BBRecord> &blocks = (*I)->BBStack.records();
+    for (auto B = blocks.rbegin(); B != blocks.rend(); ++B)
+      if (count < MaxCrashEntries - 1)
+        CrashEntries[count++] = Entry(RecordType::BBType, B->id, (*I)->tid,
+                                      B->address);
+  }
+  CrashEntries[count++] = Entry(RecordType::ENType, 0);
+  return count;
+}
+
+/// Take a lock for the rest of the program from the crash path, waiting up
+/// to a second for it.
+/// \return true if the lock was taken.
+static bool crashLock(pthread_mutex_t *mutex) {
+  for (unsigned i = 0; i < 1000; ++i) {
+    if (pthread_mutex_trylock(mutex) == 0)
+      return true;
+    struct timespec delay = { 0, 1000000 };
+    nanosleep(&delay, NULL);
+  }
+  return false;
+}
+
+/// Flush the buffers of all the threads, and append the given records as a
+/// segment of the calling thread. Holding the lock of the buffers keeps the
+/// exiting threads from freeing them, and freezing a buffer keeps its owner
+/// from adding records to it.
+static void crashFlushThreadBuffers(const Entry *extra, unsigned count) {
+  if (crashLock(&ThreadBuffersMutex)) {
+    for (auto I = ThreadBuffers.begin(); I != ThreadBuffers.end(); ++I)
+      if ((*I)->freeze())
+        (*I)->flush(true);
+  } else {
+    writeCrashMessage("[GIRI] Dropping the thread buffers, buffers: ",
+                      ThreadBuffers.size());
+  }
+  for (unsigned i = 0; i < count; ++i)
+    CrashSeqs[i] = NextSeq.fetch_add(1, std::memory_order_relaxed);
+  ThreadIndex tid = 0;
+  if (giri_thread_index != GIRI_NO_THREAD_INDEX)
+    tid = giri_thread_index;
+  writeThreadSegment(*TraceSegments, tid, extra, CrashSeqs, count,
+                     CrashEncoded);
+}
+
+/// Signal handler which writes the trace data of a program terminated by a
+/// signal, and then terminates it the way the signal would have.
+static void crashHandler(int signum) {
+  if (!Crashed.exchange(true)) {
+    CrashThread = pthread_self();
+    writeCrashMessage("[GIRI] Abnormal termination, signal number ", signum);
+    crashLock(&StacksRegistryMutex);
+    unsigned count = collectCrashEntries();
+    if (PerThreadBuffers)
+      crashFlushThreadBuffers(CrashEntries, count);
+    else if (FlightRecorderEntries)
+      flightRecorder.write(record, CrashEntries, count);
+    else
+      entryCache.crashFlush(CrashEntries, count);
+    CrashFlushed = true;
+  } else if (!pthread_equal(CrashThread, pthread_self())) {
+    // Another thread is writing the trace; wait for it to finish.
+    while (!CrashFlushed) {
+      struct timespec delay = { 0, 1000000 };
+      nanosleep(&delay, NULL);
+    }
+  }
+
+  // The signal is blocked while it is handled, so it is delivered again once
+  // the handler returns, now with the default action.
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+//===----------------------------------------------------------------------===//
+//                        Process Forks
+//===----------------------------------------------------------------------===//
+//
+// A child created by fork() inherits the trace file, the entry cache and the
+// buffers of its parent, and would write its records over those of the
+// parent. The fork handlers give the child a trace of its own instead,
+// <trace>.pid<pid>, written in the same way as the trace of the parent. The
+// thread files of a per-thread trace are named <trace>.<index>, so the pid
+// cannot be used as the suffix on its own.
+//
+// The prepare handler takes the locks of the run-time, so that the child
+// inherits them in a consistent state, and the parent releases them right
+// after the fork. The child drops the records which the parent has still to
+// write, as well as the state of the threads which do not exist in the child.
+// The forking thread becomes thread 0 of the child. Its trace begins with the
+// call records of the functions active in the thread, like the window of the
+// flight recorder, so that the returns of the child have matching calls. A
+// slice of the child ends at the fork; the stores of the parent are found in
+// the trace of the parent.
+//
+
+/// Take the locks of the run-time before fork(), in the order in which they
+/// nest.
+static void prepareFork() {
+  pthread_mutex_lock(&EntryCacheMutex);
+  pthread_mutex_lock(&ThreadBuffersMutex);
+  pthread_mutex_lock(&StacksRegistryMutex);
+  pthread_mutex_lock(&TelemetryMutex);
+  pthread_mutex_lock(&ProfileMutex);
+}
+
+/// Release the locks in the parent after fork().
+static void parentAfterFork() {
+  pthread_mutex_unlock(&ProfileMutex);
+  pthread_mutex_unlock(&TelemetryMutex);
+  pthread_mutex_unlock(&StacksRegistryMutex);
+  pthread_mutex_unlock(&ThreadBuffersMutex);
+  pthread_mutex_unlock(&EntryCacheMutex);
+}
+
+/// Open the trace of the child after fork() and release the locks.
+static void childAfterFork() {
+  TraceName += ".pid" + std::to_string(getpid());
+  int fd = open(TraceName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0640u);
+  if (fd == -1) {
+    ERROR("[GIRI] Cannot open the trace file %s: %s\n", TraceName.c_str(),
+          strerror(errno));
+    abort();
+  }
+  close(record);
+  record = fd;
+  DEBUG("[GIRI] Opened trace file of the child: %s\n", TraceName.c_str());
+
+  // Only the forking thread exists in the child, and it gets the first index.
+  // The stacks of the other threads may have been changing at the time of
+  // the fork, so they are dropped without being freed.
+  NextThreadIndex = 0;
+  NextSeq = 0;
+  giri_thread_index = GIRI_NO_THREAD_INDEX;
+  StacksRegistry.clear();
+  if (MyStacks) {
+    MyStacks->tid = 0;
+    StacksRegistry.push_back(MyStacks);
+  }
+
+  // The trace of the child starts with the whole budget.
+  if (TraceBudget) {
+    TraceBytes = 0;
+    BudgetLevel = 0;
+    NextBudgetStep = budgetStep(TG_Coalesced);
+    CoalesceRecords = getEnvFlag("GIRI_COALESCE");
+  }
+
+  if (PerThreadBuffers) {
+    for (auto I = ThreadBuffers.begin(); I != ThreadBuffers.end(); ++I)
+      delete *I;
+    ThreadBuffers.clear();
+    MyThreadBuffer = nullptr;
+    pthread_setspecific(ThreadBufferKey, nullptr);
+    for (auto I = ThreadFiles.begin(); I != ThreadFiles.end(); ++I)
+      if (*I) {
+        close((*I)->fd);
+        delete *I;
+      }
+    ThreadFiles.clear();
+    delete TraceSegments;
+    openTraceSegments(record);
+  } else if (FlightRecorderEntries) {
+    flightRecorder.reset();
+  } else {
+    entryCache.forkChild(record);
+  }
+
+  if (Telemetry) {
+    TelemetryPath = TraceName + ".telemetry.json";
+    TelemetryStart = nowNs();
+    TelemetryRegistry.clear();
+    if (MyTelemetry) {
+      *MyTelemetry = ThreadTelemetry();
+      TelemetryRegistry.push_back(MyTelemetry);
+    }
+    RecordCounts.clear();
+    CacheFlushes = LatencyHistogram();
+    WriterStalls = LatencyHistogram();
+  }
+  if (Profile) {
+    ProfilePath = TraceName + ".profile";
+    for (unsigned i = 0; i < 3; ++i)
+      ProfileCounters[i].clear();
+    ProfileRecords = 0;
+  }
+
+  parentAfterFork();
+
+  // Start the trace with the thread record and the active calls of the
+  // forking thread.
+  if (!MyStacks || TraceDisabled)
+    return;
+  recordLock("fork");
+  ThreadIndex tid = getThreadIndex();
+  const std::vector<FunRecord> &calls = MyStacks->FNStack.records();
+  for (auto C = calls.begin(); C != calls.end(); ++C) {
+    Entry call(RecordType::CLType, C->id, tid, C->fnAddress);
+    if (passesFilters(call, MyStacks))
+      addEntry(call);
+  }
+  recordUnlock("fork");
 }
 
 void recordInit(const char *name) {
@@ -263,46 +2713,175 @@ void recordInit(const char *name) {
   assert(record != -1 && "Failed to open tracing file!\n");
   DEBUG("[GIRI] Opened trace file: %s\n", name);
 
-  // Initialize the entry cache by giving it a memory buffer to use.
-  entryCache.init(record);
+  TraceName = name;
+  PerThreadFiles = getEnvFlag("GIRI_PER_THREAD_FILES");
+  PerThreadBuffers = getEnvFlag("GIRI_PER_THREAD_BUFFERS") || PerThreadFiles;
+  ThreadBufferEntries = getEnvULong("GIRI_THREAD_BUFFER_ENTRIES",
+                                    ThreadBufferEntries);
+  unsigned long format = getEnvULong("GIRI_TRACE_FORMAT", GIRI_TRACE_VERSION);
+  if (format != GIRI_TRACE_VERSION && format != GIRI_TRACE_VERSION_COMPACT)
+    ERROR("[GIRI] Ignoring unknown trace format %lu\n", format);
+  CompactTrace = format == GIRI_TRACE_VERSION_COMPACT;
+  CompressTrace = getEnvFlag("GIRI_COMPRESS");
+  CoalesceRecords = getEnvFlag("GIRI_COALESCE");
+  StreamingStores = getEnvFlag("GIRI_STREAMING_STORES");
+#ifndef __SSE2__
+  if (StreamingStores) {
+    ERROR("[GIRI] Streaming stores are not supported on this target\n");
+    StreamingStores = false;
+  }
+#endif
+  FlightRecorderEntries = getEnvULong("GIRI_FLIGHT_RECORDER", 0);
+  Telemetry = getEnvFlag("GIRI_TELEMETRY");
+  if (Telemetry) {
+    TelemetryPath = std::string(name) + ".telemetry.json";
+    TelemetryStart = nowNs();
+  }
+  Profile = getEnvFlag("GIRI_PROFILE");
+  if (Profile)
+    ProfilePath = std::string(name) + ".profile";
+  if (FlightRecorderEntries && PerThreadBuffers) {
+    ERROR("[GIRI] The flight recorder does not use per-thread buffers\n");
+    PerThreadBuffers = PerThreadFiles = false;
+  }
+  giri_append_lock.mutex = PerThreadBuffers ? nullptr : &EntryCacheMutex;
+  giri_append_lock.timed = Telemetry;
+  initTraceFilters();
+  initTraceBudget();
+
+  // Initialize the entry cache by giving it a memory buffer to use, or
+  // prepare the file for the segments of the per-thread buffers, or
+  // allocate the ring of the flight recorder.
+  if (PerThreadBuffers)
+    initThreadBuffers(record);
+  else if (FlightRecorderEntries)
+    flightRecorder.init(FlightRecorderEntries);
+  else
+    entryCache.init(record);
   pthread_mutex_init(&EntryCacheMutex, NULL);
 
   atexit(finish);
-
-  // Register the signal handlers for flushing of diagnosis tracing data to file
-  signal(SIGINT, cleanup_only_tracing);
-  signal(SIGQUIT, cleanup_only_tracing);
-  signal(SIGSEGV, cleanup_only_tracing);
-  signal(SIGABRT, cleanup_only_tracing);
-  signal(SIGTERM, cleanup_only_tracing);
-  signal(SIGKILL, cleanup_only_tracing);
-  signal(SIGILL, cleanup_only_tracing);
-  signal(SIGFPE, cleanup_only_tracing);
+  pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
+
+  // Register the signal handlers for flushing of diagnosis tracing data to
+  // file. They run on an alternate stack in the thread initializing the
+  // run-time, so that a stack overflow of the main thread is traced.
+  stack_t altStack;
+  altStack.ss_sp = CrashStack;
+  altStack.ss_size = sizeof(CrashStack);
+  altStack.ss_flags = 0;
+  sigaltstack(&altStack, NULL);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = crashHandler;
+  action.sa_flags = SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  const int signals[] = {
+    SIGINT, SIGQUIT, SIGSEGV, SIGABRT, SIGTERM, SIGILL, SIGFPE, SIGBUS
+  };
+  for (unsigned i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i)
+    sigaction(signals[i], &action, NULL);
 }
 
 /// \brief Lock the entry cache mutex. This function is instrumented before
 /// one Load/Store was executed. The load / and store sequence should be
-/// guaranteed in the way they happen. 
+/// guaranteed in the way they happen. With per-thread buffers, the order is
+/// kept by the sequence numbers instead and no lock is taken.
 void recordLock(const char *inst_name) {
-  pthread_mutex_lock(&EntryCacheMutex);
+  if (PerThreadBuffers)
+    return;
+  if (__builtin_expect(Telemetry, false))
+    lockWithTelemetry(&EntryCacheMutex);
+  else
+    pthread_mutex_lock(&EntryCacheMutex);
   DEBUG("[GIRI] Lock for instruction: %s\n", inst_name);
 }
 
 /// \brief Unlock the entry cache mutex.
 void recordUnlock(const char *inst_name) {
+  if (PerThreadBuffers)
+    return;
   DEBUG("[GIRI] Release the lock for instruction: %s\n", inst_name);
   pthread_mutex_unlock(&EntryCacheMutex);
 }
 
+/// \brief Take the entry cache mutex for the fast path while the run-time
+/// measures itself.
+void giri_lock_timed(void) {
+  lockWithTelemetry(&EntryCacheMutex);
+}
+
+/// \brief Add a record for the fast path, which found no room in the append
+/// window or runs on a thread with no index yet.
+void giri_append_slow(const Entry *entry) {
+  Entry copy = *entry;
+  copy.tid = getThreadIndex();
+  traceEntry(copy);
+}
+
+/// \brief Start tracing again after giri_trace_disable() or when the program
+/// was started with GIRI_START_DISABLED.
+void giri_trace_enable(void) {
+  recordLock("giri_trace_enable");
+  if (TraceDisabled) {
+    TraceDisabled = false;
+    TraceFiltered = TracedTypes != ~0u || !TracedThreads.empty() ||
+                    !TracedFunctions.empty() || TraceBudget;
+    ++TraceEpoch;
+
+    // With the entry cache mutex held, the stacks of the other threads do not
+    // change, so add the call records of all the threads at once. Per-thread
+    // buffers add them when their thread records its next event.
+    if (!PerThreadBuffers) {
+      std::vector<Entry> calls;
+      pthread_mutex_lock(&StacksRegistryMutex);
+      for (auto I = StacksRegistry.begin(); I != StacksRegistry.end(); ++I) {
+        const std::vector<FunRecord> &FNS = (*I)->FNStack.records();
+        for (auto C = FNS.begin(); C != FNS.end(); ++C) {
+          Entry call(RecordType::CLType, C->id, (*I)->tid, C->fnAddress);
+          if (passesFilters(call, *I))
+            calls.push_back(call);
+        }
+      }
+      pthread_mutex_unlock(&StacksRegistryMutex);
+      for (auto I = calls.begin(); I != calls.end(); ++I)
+        addEntry(*I);
+      if (!FlightRecorderEntries)
+        entryCache.updateWindow();
+    }
+  }
+  recordUnlock("giri_trace_enable");
+}
+
+/// \brief Stop tracing until giri_trace_enable() is called. The shadow stacks
+/// are still maintained while tracing is disabled.
+void giri_trace_disable(void) {
+  recordLock("giri_trace_disable");
+  TraceDisabled = true;
+  TraceFiltered = true;
+  if (!PerThreadBuffers && !FlightRecorderEntries)
+    entryCache.updateWindow();
+  recordUnlock("giri_trace_disable");
+}
+
+/// \brief Return the number of times the traced program waited for the
+/// background trace writer because all the segments were full.
+unsigned long giri_flush_stalls(void) {
+  return entryCache.getStalls();
+}
+
 /// Record that a basic block has started execution. This doesn't generate a
 /// record in the log itself; rather, it is used to create records for basic
 /// block termination if the program terminates before the basic blocks
 /// complete execution.
 void recordStartBB(unsigned id, unsigned char *fp) {
-  pthread_t tid = pthread_self();
-
   // Push the basic block identifier on to the back of the stack.
-  BBStack[tid].push(BBRecord(id, fp));
+  ThreadStacks *stacks = getThreadStacks();
+  stacks->BBStack.push(BBRecord(id, fp));
+  if (__builtin_expect(!TracedFunctions.empty(), false))
+    if (isTracedFunction(reinterpret_cast<uintptr_t>(fp)))
+      ++stacks->tracedBlocks;
 }
 
 /// Record that a basic block has finished execution.
@@ -313,19 +2892,22 @@ void recordBB(unsigned id, unsigned char *fp, unsigned lastBB) {
 
   // Record that this basic block has been executed.
   unsigned callID = 0;
-  pthread_t tid = pthread_self();
+  ThreadIndex tid = getThreadIndex();
+  ShadowStack<FunRecord> &FNS = getFNStack();
 
   // If this is the last BB of this function invocation, take the function id
-  // off the FFStack. We have recorded that it has finished execution. Store
-  // the call id to record the end of function call at the end of the last BB.
+  // off the FFStack once we have recorded that it has finished execution.
+  // Store the call id to record the end of function call at the end of the
+  // last BB.
+  bool popCall = false;
   if (lastBB) {
-    if (!FNStack[tid].empty()) {
-      if (FNStack[tid].top().fnAddress != fp ) {
+    if (!FNS.empty()) {
+      if (FNS.top().fnAddress != fp ) {
         ERROR("[GIRI] Function id on stack doesn't match for id %u.\
                MAY be due to function call from external code\n", id);
       } else {
-        callID = FNStack[tid].top().id;
-        FNStack[tid].pop();
+        callID = FNS.top().id;
+        popCall = true;
       }
     } else {
       // If nothing in stack, it is main function return which doesn't have a
@@ -334,18 +2916,118 @@ void recordBB(unsigned id, unsigned char *fp, unsigned lastBB) {
     }
   }
 
-  entryCache.addToEntryCache(Entry(RecordType::BBType, id, tid, fp, callID));
+  traceEntry(Entry(RecordType::BBType, id, tid, fp, callID));
+  if (popCall)
+    FNS.pop();
 
   // Take the basic block off the basic block stack.  We have recorded that it
   // has finished execution.
-  BBStack[tid].pop();
+  ThreadStacks *stacks = getThreadStacks();
+  if (__builtin_expect(!TracedFunctions.empty(), false)) {
+    unsigned char *blockFunction = stacks->BBStack.top().address;
+    if (isTracedFunction(reinterpret_cast<uintptr_t>(blockFunction)))
+      --stacks->tracedBlocks;
+  }
+  stacks->BBStack.pop();
+}
+
+/// Start the branch encoding of the control flow, which the program uses as
+/// it records a function entry.
+static void startBranchTrace() {
+  if (FlightRecorderEntries || !TracedFunctions.empty())
+    ERROR("[GIRI] The flight recorder and GIRI_TRACE_FUNCTIONS drop records "
+          "which are needed to decode the branches of the trace\n");
+  BranchTrace = true;
+  if (!PerThreadBuffers && !FlightRecorderEntries)
+    entryCache.updateWindow();
+}
+
+/// Record that a function has started execution. Only programs instrumented
+/// with -trace-branches record function entries.
+/// \param id - The ID of the entry block of the function.
+/// \param fp - The pointer to the function.
+void recordFunctionEntry(unsigned id, unsigned char *fp) {
+  DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
+  if (__builtin_expect(!BranchTrace.load(std::memory_order_relaxed), false))
+    startBranchTrace();
+  traceEntry(Entry(RecordType::FNType, id, getThreadIndex(), fp));
+}
+
+/// Record the outcome of a conditional branch, switch or indirect branch.
+/// The bits are kept by the thread until they fill a branch outcomes record,
+/// or another record of the thread is added.
+/// \param outcome - The outcome in its low bits.
+/// \param bits - The number of bits of the outcome, at most 64.
+void recordBranch(uint64_t outcome, unsigned bits) {
+  ThreadStacks *stacks = getThreadStacks();
+  if (stacks->branchCount + bits > BranchRecordBits) {
+    recordLock("recordBranch");
+    flushBranches(stacks);
+    recordUnlock("recordBranch");
+  }
+
+  if (bits < 64)
+    outcome &= (UINT64_C(1) << bits) - 1;
+  unsigned position = stacks->branchCount;
+  unsigned shift = position % 64;
+  stacks->branchBits[position / 64] |= outcome << shift;
+  if (shift && shift + bits > 64)
+    stacks->branchBits[1] |= outcome >> (64 - shift);
+  stacks->branchCount += bits;
+}
+
+/// Append the records of a batch. With the entry cache, the records which
+/// fit into the append window are stored there at once.
+static void appendBatch(const BatchRecord *records,
+                        unsigned char **slots,
+                        unsigned count) {
+  ThreadIndex tid = getThreadIndex();
+  Entry *next = giri_append_window.next;
+  if (count <= static_cast<size_t>(giri_append_window.end - next)) {
+    for (unsigned i = 0; i < count; ++i)
+      next[i] = Entry(static_cast<RecordType>(records[i].type),
+                      records[i].id, tid, slots[i], records[i].length);
+    giri_append_window.next = next + count;
+    return;
+  }
+  for (unsigned i = 0; i < count; ++i)
+    traceEntry(Entry(static_cast<RecordType>(records[i].type),
+                     records[i].id, tid, slots[i], records[i].length));
+}
+
+/// Record the loads, stores and selects of a basic block which were executed
+/// before a call.
+/// \param records - The type, id and length of each record.
+/// \param slots - The address of each load and store, or the condition of
+///                each select.
+/// \param count - The number of records.
+void recordBatch(const BatchRecord *records,
+                 unsigned char **slots,
+                 unsigned count) {
+  DEBUG("[GIRI] Inside %s: count = %u\n", __func__, count);
+  recordLock("recordBatch");
+  appendBatch(records, slots, count);
+  recordUnlock("recordBatch");
+}
+
+/// Record the loads, stores and selects of a basic block since its last call,
+/// and that the basic block has finished execution.
+void recordBlockBatch(unsigned id, unsigned char *fp, unsigned lastBB,
+                      const BatchRecord *records,
+                      unsigned char **slots,
+                      unsigned count) {
+  DEBUG("[GIRI] Inside %s: id = %u, count = %u\n", __func__, id, count);
+  recordLock("recordBlockBatch");
+  appendBatch(records, slots, count);
+  recordBB(id, fp, lastBB);
+  recordUnlock("recordBlockBatch");
 }
 
 /// Record that a load has been executed.
 void recordLoad(unsigned id, unsigned char *p, uintptr_t length) {
-  pthread_t tid = pthread_self();
+  ThreadIndex tid = getThreadIndex();
   DEBUG("[GIRI] Inside %s: id = %u, len = %lx\n", __func__, id, length);
-  entryCache.addToEntryCache(Entry(RecordType::LDType, id, tid, p, length));
+  traceEntry(Entry(RecordType::LDType, id, tid, p, length));
 }
 
 /// Record that a string has been read.
@@ -355,11 +3037,11 @@ void recordStrLoad(unsigned id, char *p) {
   uintptr_t length = strlen(p) + 1;
   DEBUG("[GIRI] Inside %s: id = %u, leng = %lx\n", __func__, id, length);
   // Record that a load has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::LDType,
-                                   id,
-                                   pthread_self(),
-                                   (unsigned char *)p,
-                                   length));
+  traceEntry(Entry(RecordType::LDType,
+                 id,
+                 getThreadIndex(),
+                 (unsigned char *)p,
+                 length));
 }
 
 /// Record that a store has occurred.
@@ -369,11 +3051,11 @@ void recordStrLoad(unsigned id, char *p) {
 void recordStore(unsigned id, unsigned char *p, uintptr_t length) {
   DEBUG("[GIRI] Inside %s: id = %u, length = %lx\n", __func__, id, length);
   // Record that a store has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::STType,
-                                   id,
-                                   pthread_self(),
-                                   p,
-                                   length));
+  traceEntry(Entry(RecordType::STType,
+                 id,
+                 getThreadIndex(),
+                 p,
+                 length));
 }
 
 /// Record that a string has been written.
@@ -386,11 +3068,11 @@ void recordStrStore(unsigned id, char *p) {
   DEBUG("[GIRI] Inside %s: id = %u, length = %lx\n", __func__, id, length);
   // Record that there has been a store starting at the first address of the
   // string and continuing for the length of the string.
-  entryCache.addToEntryCache(Entry(RecordType::STType,
-                                   id,
-                                   pthread_self(),
-                                   (unsigned char *)p,
-                                   length));
+  traceEntry(Entry(RecordType::STType,
+                 id,
+                 getThreadIndex(),
+                 (unsigned char *)p,
+                 length));
 }
 
 /// Record that a string has been written on strcat.
@@ -406,11 +3088,33 @@ void recordStrcatStore(unsigned id, char *p, char *s) {
   // Record that there has been a store starting at the firstlast
   // address (the position of null termination char) of the string and
   // continuing for the length of the source string.
-  entryCache.addToEntryCache(Entry(RecordType::STType,
-                                   id,
-                                   pthread_self(),
-                                   (unsigned char *)start,
-                                   length));
+  traceEntry(Entry(RecordType::STType,
+                 id,
+                 getThreadIndex(),
+                 (unsigned char *)start,
+                 length));
+}
+
+/// Record the accesses of a load or store in one execution of an innermost
+/// loop, whose addresses advance by the stride.
+/// \param id     - The ID of the load or store instruction.
+/// \param base   - The address of the first access.
+/// \param stride - The distance in bytes between the accesses.
+/// \param count  - The number of accesses.
+/// \param size   - The size in bytes of every access.
+void recordStrided(unsigned id, unsigned char *base, int32_t stride,
+                   uint64_t count, unsigned size) {
+  DEBUG("[GIRI] Inside %s: id = %u, count = %lu\n", __func__, id, count);
+  ThreadIndex tid = getThreadIndex();
+  // A record holds at most UINT32_MAX accesses; the next one continues it.
+  while (count) {
+    uint32_t part = count > UINT32_MAX ? UINT32_MAX : count;
+    Entry entry(RecordType::AFType, id, tid, base, stridedLength(part, stride));
+    entry.repeat = static_cast<unsigned char>(size);
+    traceEntry(entry);
+    base += static_cast<int64_t>(stride) * part;
+    count -= part;
+  }
 }
 
 /// Record that a call instruction was executed.
@@ -418,12 +3122,12 @@ void recordStrcatStore(unsigned id, char *p, char *s) {
 /// \param fp - The address of the function that was called.
 void recordCall(unsigned id, unsigned char *fp) {
   DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
-  pthread_t tid = pthread_self();
+  ThreadIndex tid = getThreadIndex();
 
   // Record that a call has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::CLType, id, tid, fp));
+  traceEntry(Entry(RecordType::CLType, id, tid, fp));
   // Push the Function call identifier on to the back of the stack.
-  FNStack[tid].push(FunRecord(id, fp));
+  getFNStack().push(FunRecord(id, fp));
 }
 
 // FIXME: Do we still need it after adding separate return records????
@@ -433,20 +3137,28 @@ void recordCall(unsigned id, unsigned char *fp) {
 void recordExtCall(unsigned id, unsigned char *fp) {
   DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
   // Record that a call has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::CLType,
-                                   id,
-                                   pthread_self(),
-                                   fp));
+  traceEntry(Entry(RecordType::CLType,
+                 id,
+                 getThreadIndex(),
+                 fp));
 }
 
 /// Record that a function has finished execution by adding a return trace entry
 void recordReturn(unsigned id, unsigned char *fp) {
   DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
   // Record that a call has returned.
-  entryCache.addToEntryCache(Entry(RecordType::RTType,
-                                   id,
-                                   pthread_self(),
-                                   fp));
+  traceEntry(Entry(RecordType::RTType,
+                 id,
+                 getThreadIndex(),
+                 fp));
+
+  // Without basic block records, the call is taken off the stack here rather
+  // than by the last basic block of the function it called.
+  if (BranchTrace.load(std::memory_order_relaxed)) {
+    ShadowStack<FunRecord> &FNS = getFNStack();
+    if (!FNS.empty() && FNS.top().id == id && FNS.top().fnAddress == fp)
+      FNS.pop();
+  }
 }
 
 /// Record that an external function has finished execution by updating function
@@ -455,13 +3167,13 @@ void recordReturn(unsigned id, unsigned char *fp) {
 ///       Not needed anymore as we don't add external function call records
 void recordExtCallRet(unsigned callID, unsigned char *fp) {
   DEBUG("[GIRI] Inside %s: callID = %u\n", __func__, callID); 
-  pthread_t tid = pthread_self();
-  assert(!FNStack[tid].empty());
-  if (FNStack[tid].top().fnAddress != fp)
+  ShadowStack<FunRecord> &FNS = getFNStack();
+  assert(!FNS.empty());
+  if (FNS.top().fnAddress != fp)
 	ERROR("[GIRI] Function id on stack doesn't match for id %u. \
            MAY be due to function call from external code\n", callID);
   else
-     FNStack[tid].pop();
+     FNS.pop();
 }
 
 /// This function records which input of a select instruction was selected.
@@ -471,8 +3183,23 @@ void recordExtCallRet(unsigned callID, unsigned char *fp) {
 void recordSelect(unsigned id, unsigned char flag) {
   DEBUG("[GIRI] Inside %s: id = %u, flag = %c\n", __func__, id, flag);
   // Record that a store has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::PDType,
-                                   id,
-                                   pthread_self(),
-                                   reinterpret_cast<unsigned char *>(flag)));
+  traceEntry(Entry(RecordType::PDType,
+                 id,
+                 getThreadIndex(),
+                 reinterpret_cast<unsigned char *>(flag)));
+}
+
+/// Record a synchronization operation of the program.
+/// \param id - The ID of the call instruction performing the operation.
+/// \param kind - The SyncKind of the operation.
+/// \param object - The mutex or condition, or the pthread_t * of the thread
+///                 for SK_ThreadCreated (null if no thread was created), or
+///                 the pthread_t of the thread for SK_ThreadJoin.
+void recordSync(unsigned id, unsigned kind, unsigned char *object) {
+  DEBUG("[GIRI] Inside %s: id = %u, kind = %u\n", __func__, id, kind);
+  // The new thread is only known once pthread_create() has returned.
+  if (kind == SK_ThreadCreated && object)
+    object = reinterpret_cast<unsigned char *>(
+               *reinterpret_cast<pthread_t *>(object));
+  traceEntry(Entry(RecordType::SYType, id, getThreadIndex(), object, kind));
 }
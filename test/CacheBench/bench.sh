@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Usage: bench.sh <workload> <traced program> <arguments>...
+#
+# Run the traced program in SCRATCH_DIR with the regular and the streaming
+# stores, and print the fastest of REPEAT runs. With PERF=1, also print the
+# cache misses of that run as counted by perf(1).
+
+WORKLOAD=$1
+EXE=$2
+shift 2
+
+DIR="$SCRATCH_DIR/giri-cache-bench.$$"
+mkdir -p "$DIR" || exit 1
+
+# matrix_multiply maps its input matrices from these files.
+if [ -n "$MATRIX_LEN" ]; then
+  head -c $((MATRIX_LEN * MATRIX_LEN * 4)) /dev/zero > "$DIR/matrix_file_A.txt"
+  head -c $((MATRIX_LEN * MATRIX_LEN * 4)) /dev/zero > "$DIR/matrix_file_B.txt"
+fi
+
+printf "%-16s %-10s %10s %16s\n" "workload" "stores" "seconds" "cache-misses"
+for streaming in 0 1; do
+  case $streaming in
+    0) stores=regular ;;
+    1) stores=streaming ;;
+  esac
+  best=
+  misses=-
+  for run in $(seq $REPEAT); do
+    start=$(date +%s%N)
+    if [ "$PERF" = 1 ]; then
+      (cd "$DIR" && GIRI_STREAMING_STORES=$streaming \
+         perf stat -x, -e cache-misses -o perf.txt "$EXE" "$@" > /dev/null)
+    else
+      (cd "$DIR" && GIRI_STREAMING_STORES=$streaming "$EXE" "$@" > /dev/null)
+    fi
+    end=$(date +%s%N)
+    ns=$((end - start))
+    if [ -z "$best" ] || [ $ns -lt $best ]; then
+      best=$ns
+      if [ "$PERF" = 1 ]; then
+        misses=$(awk -F, '/cache-misses/ { print $1 }' "$DIR/perf.txt")
+      fi
+    fi
+  done
+  awk -v w="$WORKLOAD" -v s=$stores -v ns=$best -v m="$misses" \
+      'BEGIN { printf "%-16s %-10s %10.3f %16s\n", w, s, ns / 1e9, m }'
+done
+
+rm -rf "$DIR"
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int sum(int n)
+{
+    int total;
+    int rest = 0;
+
+    if (n <= 0)
+        return 0;
+
+    total = n * 2;
+    if (n > 1)
+        rest = sum(n - 1);
+    printf("level %d\n", n);
+    total = total + rest;
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 1;
+    int unused;
+
+    if (argc > 1)
+        n = atoi(argv[1]);
+    unused = n * 3;
+    printf("unused %d\n", unused);
+    return sum(n);
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int values[8];
+
+void scale(int *v, int factor)
+{
+    *v = *v * factor;
+}
+
+int main(int argc, char *argv[])
+{
+    int factor = argc > 1 ? atoi(argv[1]) : 2;
+    int *slot = &values[factor % 8];
+
+    values[0] = factor;
+    *slot = factor + 1;
+    scale(slot, factor);
+    values[1] = *slot + values[0];
+    values[2] = values[3];
+    printf("%d %d\n", values[1], values[2]);
+
+    return values[1];
+}
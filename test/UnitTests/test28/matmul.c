@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 6
+
+int A[N][N], B[N][N], C[N][N];
+
+int main(int argc, char *argv[])
+{
+    int seed = argc > 1 ? atoi(argv[1]) : 3;
+    int i, j, k;
+
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N; j++) {
+            A[i][j] = (i + j + seed) % 7;
+            B[i][j] = (i * j + seed) % 5;
+        }
+
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N; j++) {
+            int sum = 0;
+            for (k = 0; k < N; k++)
+                sum += A[i][k] * B[k][j];
+            C[i][j] = sum;
+        }
+
+    printf("%d\n", C[2][3]);
+    return C[N - 1][N - 1] % 64;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int twice(int x)
+{
+    return 2 * x;
+}
+
+int square(int x)
+{
+    return x * x;
+}
+
+int classify(int x)
+{
+    switch (x % 4) {
+    case 0:
+        return 1;
+    case 1:
+        return x;
+    case 2:
+        return -x;
+    default:
+        return 0;
+    }
+}
+
+int depth(int n)
+{
+    if (n <= 1)
+        return 1;
+    return 1 + depth(n / 2);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 5;
+    int (*op)(int) = n % 2 ? twice : square;
+    int total = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        total += classify(i);
+    total += op(n);
+    total += depth(n);
+    printf("%d\n", total);
+
+    return total;
+}
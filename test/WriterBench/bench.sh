@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Usage: bench.sh <traced program> <trace file name> <input>
+#
+# Run the traced program in each of the SCRATCH_DIRS with each of the WRITERS
+# and SEGMENT_SIZES, and print the throughput of the fastest of REPEAT runs.
+
+EXE=$1
+TRACE=$2
+INPUT=$3
+
+printf "%-20s %-8s %12s %10s %10s %14s\n" \
+  "directory" "writer" "segment" "MB" "seconds" "records/s"
+for dir in $SCRATCH_DIRS; do
+  for writer in $WRITERS; do
+    case $writer in
+      async) env="GIRI_ASYNC_FLUSH=1" ;;
+      *) env="GIRI_TRACE_WRITER=$writer" ;;
+    esac
+    for size in $SEGMENT_SIZES; do
+      best=
+      for run in $(seq $REPEAT); do
+        rm -f "$dir/$TRACE"
+        sync
+        start=$(date +%s%N)
+        (cd "$dir" && env $env GIRI_SEGMENT_SIZE=$size "$EXE" $INPUT \
+                        > /dev/null)
+        end=$(date +%s%N)
+        ns=$((end - start))
+        if [ -z "$best" ] || [ $ns -lt $best ]; then
+          best=$ns
+        fi
+      done
+      bytes=$(stat -c %s "$dir/$TRACE")
+      rm -f "$dir/$TRACE"
+      awk -v d="$dir" -v w="$writer" -v s=$size -v b=$bytes -v ns=$best \
+          'BEGIN { printf "%-20s %-8s %12d %10.1f %10.3f %14.0f\n",
+                   d, w, s, b / 1048576, ns / 1e9, (b / 24) / (ns / 1e9) }'
+    done
+  done
+done
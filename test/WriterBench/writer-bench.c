@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Sum and update an array over and over, so that the traced program does
+ * little more than produce load, store and basic block records. */
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    int data[256] = {0};
+    long i, sum = 0;
+
+    for (i = 0; i < iterations; i++) {
+        sum += data[i % 256];
+        data[(i * 7) % 256] = (int)(sum & 0xff);
+    }
+
+    printf("%ld\n", sum);
+    return 0;
+}
@@ -0,0 +1,105 @@
+//===-- girimerge - Merge a trace into one flat trace file ----------------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed
+// under the University of Illinois Open Source License. See LICENSE.TXT for
+// details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This program rewrites a trace as a flat array of entries in their global
+// order, the layout of the traces written by the entry cache. It merges the
+// per-thread segments of a trace, including the segments in the per-thread
+// trace files (<trace>.<index>), with the k-way merge of the TraceReader, so
+// only the current segment of each thread is held in memory.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Giri/TraceReader.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+InputFilename(cl::Positional, cl::desc("<trace file>"), cl::Required);
+
+static cl::opt<std::string>
+OutputFilename("o", cl::desc("Output flat trace file name"),
+               cl::value_desc("filename"), cl::init("-"));
+
+/// Number of entries written at once
+static const unsigned WriteBufferEntries = 4096;
+
+/// Write the buffered entries to the file.
+/// \return false if the entries could not be written.
+static bool writeEntries(int fd, const std::vector<Entry> &entries) {
+  const char *p = reinterpret_cast<const char *>(entries.data());
+  size_t len = entries.size() * sizeof(Entry);
+  while (len > 0) {
+    ssize_t written = write(fd, p, len);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    p += written;
+    len -= written;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  // Parse the command line options.
+  cl::ParseCommandLineOptions(argc, argv, "Trace Merge Utility\n");
+
+  giri::TraceReader Reader(InputFilename);
+  if (!Reader.isOpen()) {
+    errs() << "Cannot open the trace file " << InputFilename << "\n";
+    return 1;
+  }
+
+  int fd = STDOUT_FILENO;
+  if (OutputFilename != "-") {
+    fd = open(OutputFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0640u);
+    if (fd == -1) {
+      errs() << "Cannot open the output file " << OutputFilename << ": "
+             << strerror(errno) << "\n";
+      return 1;
+    }
+  }
+
+  // The reader supplies the END record if the trace has none, so the output
+  // is always terminated.
+  std::vector<Entry> buffer;
+  buffer.reserve(WriteBufferEntries);
+  Entry entry;
+  bool ok = true;
+  while (ok && Reader.next(entry)) {
+    buffer.push_back(entry);
+    if (buffer.size() == WriteBufferEntries) {
+      ok = writeEntries(fd, buffer);
+      buffer.clear();
+    }
+  }
+  ok = ok && writeEntries(fd, buffer);
+  if (!ok) {
+    errs() << "Cannot write the output file " << OutputFilename << ": "
+           << strerror(errno) << "\n";
+    return 1;
+  }
+
+  if (fd != STDOUT_FILENO)
+    close(fd);
+  return 0;
+}
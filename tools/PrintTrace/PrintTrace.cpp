@@ -13,6 +13,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "Giri/TraceFile.h"
+#include "Giri/TraceReader.h"
 
 #include "llvm/Support/CommandLine.h"
 
@@ -31,13 +32,10 @@ int main(int argc, char ** argv) {
   // Parse the command line options.
   cl::ParseCommandLineOptions(argc, argv, "Print Trace Utility\n");
 
-  // Open the trace file for read-only access.
-  int fd = 0;
-  if (InputFilename == "-")
-    fd = STDIN_FILENO;
-  else
-    fd = open (InputFilename.c_str(), O_RDONLY);
-  assert((fd != -1) && "Cannot open file!\n");
+  // Open the trace file for read-only access.  Traces written by per-thread
+  // buffers are merged into their global order by the reader.
+  giri::TraceReader Reader(InputFilename);
+  assert(Reader.isOpen() && "Cannot open file!\n");
 
   // Print a header that reminds the user of what the fields mean.
   printf("-----------------------------------------------------------------------------\n");
@@ -47,9 +45,8 @@ int main(int argc, char ** argv) {
 
   // Read in each entry and print it out.
   Entry entry;
-  ssize_t readsize;
   unsigned index = 0;
-  while ((readsize = read(fd, &entry, sizeof(entry))) == sizeof(entry)) {
+  while (Reader.next(entry)) {
     printf("%10u: ", index++);
 
     // Print the entry's type
@@ -75,32 +72,60 @@ int main(int argc, char ** argv) {
       case RecordType::ENType:
         printf("End         : ");
         break;
+      case RecordType::THType:
+        printf("Thread      : ");
+        break;
+      case RecordType::SYType:
+        printf("Sync        : ");
+        break;
+      case RecordType::GPType:
+        printf("Gap         : ");
+        break;
+      case RecordType::AFType:
+        printf("Strided     : ");
+        break;
+      case RecordType::FNType:
+        printf("Function    : ");
+        break;
+      case RecordType::BRType:
+        printf("Branches    : ");
+        break;
     }
 
     // Print the value associated with the entry.
     if (entry.type == RecordType::BBType)
-      printf("%6u: %8lu: %16lx: %8lu\n",
+      printf("%6u: %8u: %16lx: %8lu\n",
              entry.id,
              entry.tid,
              entry.address,
              entry.length);
+    else if (entry.type == RecordType::AFType)
+      printf("%6u: %8u: %16lx: %8u x %u bytes, stride %d\n",
+             entry.id,
+             entry.tid,
+             entry.address,
+             stridedCount(entry),
+             static_cast<unsigned>(entry.repeat),
+             stridedStride(entry));
+    else if (entry.type == RecordType::BRType) {
+      // Print the outcome bits in the order of the branches.
+      printf("%6u: %8u: ", entry.id, entry.tid);
+      for (unsigned i = 0; i < entry.id && i < BranchRecordBits; ++i)
+        putchar('0' + branchBit(entry, i));
+      putchar('\n');
+    } else if (entry.repeat)
+      printf("%6u: %8u: %16lx: %8lx (%u accesses)\n",
+             entry.id,
+             entry.tid,
+             entry.address,
+             entry.length,
+             entry.repeat + 1u);
     else
-      printf("%6u: %8lu: %16lx: %8lx\n",
+      printf("%6u: %8u: %16lx: %8lx\n",
              entry.id,
              entry.tid,
              entry.address,
              entry.length);
-
-    // Stop printing entries if we've hit the end of the log.
-    if (entry.type == RecordType::ENType) {
-      readsize = 0;
-      break;
-    }
-  }
-
-  if (readsize != 0) {
-    fprintf(stderr, "Read of incorrect size\n");
-    exit(1);
   }
 
   return 0;